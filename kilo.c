@@ -36,12 +36,15 @@
 
 #ifdef __linux__
 #define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700 /* For realpath(). */
+#define _DEFAULT_SOURCE /* For MAP_ANONYMOUS. */
 #endif
 
 #include <termios.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
@@ -49,10 +52,24 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 /* Syntax highlight types */
 #define HL_NORMAL 0
@@ -65,9 +82,18 @@
 #define HL_NUMBER 7
 #define HL_MATCH 8      /* Search match. */
 
+#define HL_OC_UNKNOWN -1 /* Multi-line comment state never computed. */
+
 #define HL_HIGHLIGHT_STRINGS (1<<0)
 #define HL_HIGHLIGHT_NUMBERS (1<<1)
 
+/* A keyword in the compiled keywords table of a syntax. */
+struct kwEntry {
+    const char *word;   /* Keyword, NULL for empty slots. */
+    int len;            /* Keyword length, without the trailing '|'. */
+    int hl;             /* HL_KEYWORD1 or HL_KEYWORD2. */
+};
+
 struct editorSyntax {
     char **filematch;
     char **keywords;
@@ -75,38 +101,236 @@ struct editorSyntax {
     char multiline_comment_start[3];
     char multiline_comment_end[3];
     int flags;
+    /* Filled by editorSyntaxCompile(): a perfect hash table of the
+     * keywords, so every keyword lands in a different slot. */
+    struct kwEntry *kwtable;
+    unsigned int kwmask;    /* Table size minus one (size is power of 2). */
+    unsigned int kwseed;    /* Hash seed giving no collisions. */
 };
 
-/* This structure represents a single line of the file we are editing. */
-typedef struct erow {
-    int idx;            /* Row index in the file, zero-based. */
-    int size;           /* Size of the row, excluding the null term. */
+/* State of the syntax highlight lexer at a given offset of a row. */
+typedef struct lexState {
+    int pos;                /* Offset in the rendered row. */
+    unsigned char in_comment, in_string, prev_sep;
+} lexState;
+
+/* Position of a char in the row, in the rendered row, and on screen. The
+ * rendered rows containing UTF-8 have an entry every KILO_COL_INDEX_STEP
+ * bytes, see editorRenderText(). */
+typedef struct colIndex {
+    int cx;             /* Offset in the row. */
+    int rb;             /* Offset in the rendered row. */
+    int col;            /* Screen column. */
+} colIndex;
+
+/* The rendered version of a row and its syntax highlight, allocated
+ * together when the row is displayed. See editorRowRender(). */
+typedef struct rowCache {
+    char *render;       /* Row content "rendered" for screen (for TABs), or
+                           the row content itself when it has no TABs. */
+    unsigned char *hl;  /* Syntax highlight type for each character in render,
+                           packed two per byte, or NULL if not computed. */
     int rsize;          /* Size of the rendered row. */
+    int hloff;          /* Offset of the highlight space inside 'buf'. */
+    int bytes;          /* Size of the allocation. */
+    lexState resume;    /* Where the highlight can be computed again from
+                           after an edit, see editorRowEdited(). */
+    int ixoff;          /* Offset of the column index inside 'buf'. */
+    int nidx;           /* Entries of the column index, 0 if the rendered
+                           row is ASCII: offsets are then columns. */
+    char buf[];
+} rowCache;
+
+/* This structure represents a single line of the file we are editing.
+ * Rows are stored in arrays owned by the leaves of the rows tree (see
+ * below), so the row index is not stored but derived from the position of
+ * the row in the tree, see editorRowIdx(). There may be tens of millions of
+ * rows, so everything not needed by all of them lives elsewhere. */
+typedef struct erow {
+    struct rowsNode *leaf; /* Leaf of the rows tree holding this row. */
     char *chars;        /* Row content. */
-    char *render;       /* Row content "rendered" for screen (for TABs). */
-    unsigned char *hl;  /* Syntax highlight type for each character in render.*/
-    int hl_oc;          /* Row had open comment at end in last syntax highlight
-                           check. */
+    rowCache *cache;    /* Render and highlight, or NULL if not cached. */
+    struct rowLong *ext; /* State of long rows, or NULL. See editorRowLong(). */
+    int size;           /* Size of the row, excluding the null term. */
+    signed char hl_oc;  /* Row had open comment at end in last syntax highlight
+                           check, or HL_OC_UNKNOWN if never highlighted. */
+    unsigned char mapped; /* If true 'chars' points inside E.map and is not
+                           null terminated: it is copied on the heap the
+                           first time the row is modified. */
+    unsigned char capbits; /* If not zero 'chars' has room for 1<<capbits
+                              bytes, otherwise for size+1. */
 } erow;
 
 typedef struct hlcolor {
     int r,g,b;
 } hlcolor;
 
+/* The rows of the file are kept in a balanced tree of line blocks (a
+ * B+tree where every node knows how many rows its subtree holds). Leaves
+ * hold up to ROWS_LEAF_CAP rows and are linked together, inner nodes store
+ * up to ROWS_NODE_CAP children. Looking up, inserting and deleting a row
+ * given its index is O(log N), and walking rows in order is O(1) per row.
+ *
+ * The leaves of a file just opened only know the text of their lines: the
+ * rows are created the first time the leaf is accessed, see rowsLoad(). */
+#define ROWS_LEAF_CAP 64
+#define ROWS_NODE_CAP 32
+
+typedef struct rowsNode {
+    struct rowsNode *parent;    /* NULL for the root. */
+    struct rowsNode *prev, *next; /* Sibling leaves, only used in leaves. */
+    int leaf;                   /* True if the node holds rows. */
+    int count;                  /* Number of rows or children here. */
+    int numrows;                /* Number of rows in the whole subtree. */
+    erow *row;                  /* Rows of a leaf, NULL if not loaded. */
+    char *text;                 /* Lines of a leaf not loaded yet, every */
+    size_t textlen;             /* one counted with its newline. */
+    struct rowsNode *child[];   /* ROWS_NODE_CAP, only in inner nodes. */
+} rowsNode;
+
+#define KILO_HL_PENDING 64
+
+/* A screen buffer: character and attribute of every cell of the terminal,
+ * stored row after row. */
+typedef struct screenBuf {
+    int rows, cols;
+    char *chars;        /* ASCII chars, or CELL_GLYPH / CELL_WIDE. */
+    unsigned char *attrs;
+    uint64_t *glyphs;   /* UTF-8 bytes of the CELL_GLYPH cells. */
+} screenBuf;
+
+/* A search query, see the search engine section. */
+#define KILO_QUERY_LEN 256
+
+#define SEARCH_ICASE (1<<0)     /* Case insensitive match. */
+#define SEARCH_WORD (1<<1)      /* Match only whole words. */
+#define SEARCH_REGEX (1<<2)     /* The query is a regular expression. */
+#define SEARCH_NONE ((size_t)-1)
+
+/* Editing commands recorded in the swap journal, see its section. */
+#define JOURNAL_BASE 'b'    /* Identity of the file the journal applies to. */
+#define JOURNAL_TEXT 't'    /* editorInsertText() of the payload. */
+#define JOURNAL_CHAR 'c'    /* editorInsertChar() of 'arg'. */
+#define JOURNAL_NEWLINE 'n' /* editorInsertNewline(). */
+#define JOURNAL_DEL 'd'     /* editorDelChar(). */
+#define JOURNAL_REPLACE 'r' /* editorReplaceAll(), payload "query\0with". */
+#define JOURNAL_MARK 'm'    /* Snapshot of the save 'arg' taken. */
+#define JOURNAL_SAVED 's'   /* Save 'arg' wrote the file in the payload. */
+#define JOURNAL_FOLLOW 'f'  /* kilo -f read the file in the payload. */
+
+typedef struct searchQuery {
+    char s[KILO_QUERY_LEN+1];   /* The query, lowercase if SEARCH_ICASE
+                                   unless it is a regex. */
+    size_t len;                 /* Query length, 0 if empty or invalid. */
+    int flags;
+    unsigned char first[2];     /* First byte, lower/upper case. */
+    unsigned char last[2];      /* Last byte, lower/upper case. */
+    struct regex *re;           /* Compiled query if SEARCH_REGEX. */
+} searchQuery;
+
+struct regex *regexCompile(const char *s, int flags);
+void regexFree(struct regex *re);
+size_t regexSearch(struct regex *re, const char *hay, size_t hlen, size_t pos,
+                   size_t *mlen);
+
+/* The index of all the matches of the find mode query, filled by a
+ * background thread. See the match index section. */
+#define FIND_CHUNK_BITS 16
+#define FIND_CHUNK_SIZE (1<<FIND_CHUNK_BITS)
+#define FIND_MAX_CHUNKS 256     /* Up to 16M matches are indexed. */
+
+typedef struct findMatch {
+    int row, col;               /* Match position, 'col' is in chars. */
+    int len;                    /* Match length, regex matches vary. */
+} findMatch;
+
+struct findIndex {
+    int active;                 /* True while in find mode. */
+    int cur_row, cur_col;       /* Current match, cur_row is -1 if none. */
+    int cur_len;
+    searchQuery q;              /* Query the index refers to. */
+    int *cand;                  /* If not NULL only these rows can match, */
+    int ncand;                  /* see searchExtends(). */
+    findMatch *chunk[FIND_MAX_CHUNKS];
+    int count;                  /* Matches published by the worker. */
+    int scanned;                /* Rows < scanned are fully indexed. */
+    int done;                   /* The whole file was indexed. */
+    int cancel;                 /* Set to ask the worker to stop. */
+    int running;                /* Worker started and not yet joined. */
+    pthread_t thread;
+};
+
+#define KILO_INBUF 65536 /* Input queue size. */
+
+/* Counters and histograms of the hot paths, see the instrumentation
+ * section. Histograms have STATS_SUB buckets for every power of two. */
+#define STATS_SUB_BITS 4
+#define STATS_SUB (1<<STATS_SUB_BITS)
+#define STATS_BUCKETS ((64-STATS_SUB_BITS+1)*STATS_SUB)
+
+typedef struct statsHist {
+    long long count, sum, max;
+    long long bucket[STATS_BUCKETS];
+} statsHist;
+
+struct editorStats {
+    long long keys;         /* Keys read. */
+    long long frames;       /* Number of frames written. */
+    long long frame_bytes;  /* Bytes written by the last frame. */
+    long long bytes;        /* Bytes written to the terminal in total. */
+    long long allocs;       /* Memory allocations, see kmalloc(). */
+    long long reallocs;     /* How many of them were reallocations. */
+    long long lexed;        /* Rows highlighted by the main thread. */
+    long long lexed_bg;     /* Rows highlighted in background. */
+    long long search_bytes; /* Bytes scanned by searches. */
+    long long input_time;   /* When input not yet answered arrived, or 0. */
+    long long frame_lexed;  /* Rows highlighted since the last frame. */
+    int frame_dirty;        /* E.dirty at the last frame. */
+    statsHist latency;      /* Input to frame written, in microseconds. */
+    statsHist write_time;   /* Time to write a frame, in microseconds. */
+    statsHist frame_size;   /* Bytes of every frame. */
+    statsHist edit_lexed;   /* Rows highlighted by every edit. */
+};
+
 struct editorConfig {
-    int cx,cy;  /* Cursor x and y position in characters */
+    int cx,cy;  /* Cursor offset in the row, and screen row. */
     int rowoff;     /* Offset of row displayed. */
-    int coloff;     /* Offset of column displayed. */
+    int coloff;     /* Render column displayed at the left. */
     int screenrows; /* Number of rows that we can show */
     int screencols; /* Number of cols that we can show */
     int numrows;    /* Number of rows */
     int rawmode;    /* Is terminal raw mode enabled? */
-    erow *row;      /* Rows */
+    rowsNode *rows; /* Rows tree root. */
     int dirty;      /* File modified but not saved. */
     char *filename; /* Currently open filename */
+    char *map;      /* Backing store of unmodified rows, or NULL. */
+    int hl_pending[KILO_HL_PENDING]; /* Rows whose hl_oc must be checked,
+                                        sorted. See editorSyntaxResolve(). */
+    int hl_npending;    /* Number of entries in hl_pending. */
+    int hl_force;       /* Pending rows before it always propagate. */
+    struct hlJob *hl_job;   /* Background highlight job, or NULL. */
+    int hl_edit_min;    /* Lowest row modified since the job was issued. */
+    size_t cache_bytes; /* Memory used by cached render and hl. */
+    int cache_clock;    /* Next row the cache eviction will look at. */
+    screenBuf front;    /* What the terminal is showing. */
+    screenBuf back;     /* The frame being composed. */
+    int front_valid;    /* If false the next frame is fully redrawn. */
+    int cursor_y, cursor_x; /* Cursor position sent with the last frame. */
+    struct editorStats stats;   /* See the instrumentation section. */
+    int stats_overlay;          /* Show the stats above the status bar. */
+    size_t mapsize; /* Size of the backing store. */
+    size_t maploaded;   /* Bytes of it whose lines have rows so far. */
     char statusmsg[80];
-    time_t statusmsg_time;
+    int statusmsg_timer;    /* Timer clearing the status message. */
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
+    struct findIndex find;  /* Find mode state and match index. */
+    struct saveJob *save;   /* Background save in progress, or NULL. */
+    char inbuf[KILO_INBUF]; /* Input read from the terminal. */
+    int inpos, inlen;       /* Next byte to consume, bytes in inbuf. */
+    int bench;              /* Headless benchmark mode, see kilo -B. */
+    int pager;              /* Read only pager mode, see kilo -R. */
+    int follow;             /* Follow appends to the file, see kilo -f. */
+    int row_gaps;           /* Some long row may have a gap in the middle. */
 };
 
 static struct editorConfig E;
@@ -115,14 +339,19 @@ enum KEY_ACTION{
         KEY_NULL = 0,       /* NULL */
         CTRL_C = 3,         /* Ctrl-c */
         CTRL_D = 4,         /* Ctrl-d */
+        CTRL_E = 5,         /* Ctrl-e */
         CTRL_F = 6,         /* Ctrl-f */
+        CTRL_G = 7,         /* Ctrl-g */
         CTRL_H = 8,         /* Ctrl-h */
         TAB = 9,            /* Tab */
         CTRL_L = 12,        /* Ctrl+l */
         ENTER = 13,         /* Enter */
         CTRL_Q = 17,        /* Ctrl-q */
+        CTRL_R = 18,        /* Ctrl-r */
         CTRL_S = 19,        /* Ctrl-s */
+        CTRL_T = 20,        /* Ctrl-t */
         CTRL_U = 21,        /* Ctrl-u */
+        CTRL_W = 23,        /* Ctrl-w */
         ESC = 27,           /* Escape */
         BACKSPACE =  127,   /* Backspace */
         /* The following are just soft codes, not really reported by the
@@ -135,10 +364,42 @@ enum KEY_ACTION{
         HOME_KEY,
         END_KEY,
         PAGE_UP,
-        PAGE_DOWN
+        PAGE_DOWN,
+        CTRL_HOME,
+        CTRL_END,
+        PASTE_START,
+        PASTE_END
 };
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorDrawNonprint(char *c, unsigned char *a, int len);
+void pagerDrawRows(void);
+void pagerStatus(char *status, size_t slen, char *rstatus, size_t rlen);
+erow *editorRowNext(erow *row);
+erow *editorRowPrev(erow *row);
+void editorInsertRowChars(int at, char *chars, size_t len, int mapped);
+void editorRowRender(erow *row);
+int editorRowIsLong(erow *row);
+int editorRowWindowValid(erow *row);
+int editorRowChar(erow *row, int at);
+void editorRowFlatten(erow *row);
+void editorRowsFlatten(void);
+int editorSyntaxResolve(int at, int *budget);
+size_t editorRenderSize(const char *chars, int size);
+int editorRenderText(const char *chars, int size, char *out, int idx,
+                     colIndex *ix, int *nidx);
+void editorDrawMatches(int y, int filerow, erow *row);
+int editorPrompt(int fd, const char *prompt, char *buf, size_t size);
+void editorCursorAt(int filerow, int rx);
+void journalEdit(int op, int arg, const char *p, size_t len);
+int journalMark(void);
+void journalSaved(int mark, int modified);
+void journalClose(void);
+void updateWindowSize(void);
+int editorInputFill(int fd);
+int editorEventWait(int fd);
+int benchFeed(void);
+void statsInputArrived(void);
 
 /* =========================== Syntax highlights DB =========================
  *
@@ -191,12 +452,33 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//","/*","*/",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
+        NULL,0,0
     }
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB)/sizeof(HLDB[0]))
 
+/* ============================ Memory allocation =========================== */
+
+/* Wrappers of malloc() and friends counting the allocations, that are
+ * reported by the benchmark mode. They may be called by any thread. */
+void *kmalloc(size_t size) {
+    __atomic_add_fetch(&E.stats.allocs,1,__ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *kcalloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&E.stats.allocs,1,__ATOMIC_RELAXED);
+    return calloc(nmemb,size);
+}
+
+void *krealloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&E.stats.allocs,1,__ATOMIC_RELAXED);
+    __atomic_add_fetch(&E.stats.reallocs,1,__ATOMIC_RELAXED);
+    return realloc(ptr,size);
+}
+
 /* ======================= Low level terminal handling ====================== */
 
 static struct termios orig_termios; /* In order to restore at exit.*/
@@ -205,6 +487,9 @@ void disableRawMode(int fd) {
     /* Don't even check the return value as it's too late. */
     if (E.rawmode) {
         tcsetattr(fd,TCSAFLUSH,&orig_termios);
+        if (write(STDOUT_FILENO,"\x1b[?2004l",8) == -1) {
+            /* Nothing we can do. */
+        }
         E.rawmode = 0;
     }
 }
@@ -241,6 +526,12 @@ int enableRawMode(int fd) {
     /* put terminal in raw mode after flushing */
     if (tcsetattr(fd,TCSAFLUSH,&raw) < 0) goto fatal;
     E.rawmode = 1;
+
+    /* Ask the terminal to bracket pasted text between ESC[200~ and
+     * ESC[201~, so that it can be inserted at once. */
+    if (write(STDOUT_FILENO,"\x1b[?2004h",8) == -1) {
+        /* Not fatal: pasted text is just read as typed keys. */
+    }
     return 0;
 
 fatal:
@@ -248,57 +539,122 @@ fatal:
     return -1;
 }
 
+/* Read from the terminal all the input available, up to the size of
+ * the input queue, that must be empty. Returns the number of bytes read,
+ * zero on timeout. */
+int editorInputFill(int fd) {
+    int nread = read(fd,E.inbuf,KILO_INBUF);
+    if (nread == -1 && errno != EINTR && errno != EAGAIN) exit(1);
+    if (nread <= 0) return 0;
+    statsInputArrived();
+    E.inpos = 0;
+    E.inlen = nread;
+    return nread;
+}
+
+/* Get the next input byte in *c. Returns 0 on timeout. */
+int editorReadByte(int fd, char *c) {
+    if (E.inpos == E.inlen && editorInputFill(fd) == 0) return 0;
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+/* Return true if there is input ready to be processed, without blocking. */
+int editorInputPending(int fd) {
+    struct pollfd pfd;
+
+    if (E.inpos < E.inlen) return 1;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd,1,0) == 1;
+}
+
+/* Consume from the input queue, without blocking, the text that follows
+ * a key just read: bytes that are printable, tabs or newlines. Up to 'max'
+ * bytes are stored in 'buf', and the count is returned. */
+int editorInputTakeText(char *buf, int max) {
+    int n = 0;
+    while(n < max && E.inpos < E.inlen) {
+        unsigned char c = E.inbuf[E.inpos];
+        if ((c < 32 && c != TAB && c != ENTER) || c == 127) break;
+        buf[n++] = c;
+        E.inpos++;
+    }
+    return n;
+}
+
 /* Read a key from the terminal put in raw mode, trying to handle
  * escape sequences. */
 int editorReadKey(int fd) {
-    int nread;
     char c, seq[3];
-    while ((nread = read(fd,&c,1)) == 0);
-    if (nread == -1) exit(1);
-
-    while(1) {
-        switch(c) {
-        case ESC:    /* escape sequence */
-            /* If this is just an ESC, we'll timeout here. */
-            if (read(fd,seq,1) == 0) return ESC;
-            if (read(fd,seq+1,1) == 0) return ESC;
-
-            /* ESC [ sequences. */
-            if (seq[0] == '[') {
-                if (seq[1] >= '0' && seq[1] <= '9') {
-                    /* Extended escape, read additional byte. */
-                    if (read(fd,seq+2,1) == 0) return ESC;
-                    if (seq[2] == '~') {
-                        switch(seq[1]) {
-                        case '3': return DEL_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        }
-                    }
-                } else {
-                    switch(seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                    }
+    if (!editorEventWait(fd) || !editorReadByte(fd,&c)) return KEY_NULL;
+    E.stats.keys++;
+    if (c != ESC) return (unsigned char)c;
+
+    /* If this is just an ESC, we'll timeout here. */
+    if (!editorReadByte(fd,seq)) return ESC;
+    if (!editorReadByte(fd,seq+1)) return ESC;
+
+    /* ESC [ sequences. */
+    if (seq[0] == '[') {
+        if (seq[1] >= '0' && seq[1] <= '9') {
+            /* Extended escape: a number terminated by '~', optionally
+             * followed by ";<modifiers>", as in ESC [1;5H for Ctrl-Home. */
+            int n = seq[1]-'0', mod = 1;
+            while(1) {
+                if (!editorReadByte(fd,seq+2)) return ESC;
+                if (seq[2] < '0' || seq[2] > '9') break;
+                if (n < 1000) n = n*10+seq[2]-'0';
+            }
+            if (seq[2] == ';') {
+                mod = 0;
+                while(1) {
+                    if (!editorReadByte(fd,seq+2)) return ESC;
+                    if (seq[2] < '0' || seq[2] > '9') break;
+                    if (mod < 1000) mod = mod*10+seq[2]-'0';
                 }
             }
-
-            /* ESC O sequences. */
-            else if (seq[0] == 'O') {
-                switch(seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+            if (seq[2] == '~') {
+                switch(n) {
+                case 1: case 7: return HOME_KEY;
+                case 3: return DEL_KEY;
+                case 4: case 8: return END_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 200: return PASTE_START;
+                case 201: return PASTE_END;
+                }
+            } else if (n == 1) {
+                /* Modifier 5 is Ctrl, the others are ignored. */
+                switch(seq[2]) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'H': return mod == 5 ? CTRL_HOME : HOME_KEY;
+                case 'F': return mod == 5 ? CTRL_END : END_KEY;
                 }
             }
-            break;
-        default:
-            return c;
+        } else {
+            switch(seq[1]) {
+            case 'A': return ARROW_UP;
+            case 'B': return ARROW_DOWN;
+            case 'C': return ARROW_RIGHT;
+            case 'D': return ARROW_LEFT;
+            case 'H': return HOME_KEY;
+            case 'F': return END_KEY;
+            }
         }
     }
+
+    /* ESC O sequences. */
+    else if (seq[0] == 'O') {
+        switch(seq[1]) {
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        }
+    }
+    return KEY_NULL; /* Unknown sequence, ignored. */
 }
 
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
@@ -361,66 +717,353 @@ failed:
     return -1;
 }
 
+/* =============================== Event loop =============================== */
+
+/* The editor sleeps in poll(2) until there is something to do: input from
+ * the terminal, a signal, an expired timer, a watched file descriptor
+ * becoming readable, or an event posted by some background thread. Signal
+ * handlers and threads wake up the loop writing a byte into a pipe, so
+ * nothing is done inside signal handlers, and when idle the editor does not
+ * wake up at all.
+ *
+ * The loop runs inside editorReadKey(): when something requires the screen
+ * to be updated KEY_NULL is returned, so that every loop reading keys,
+ * including modal ones like find mode, just refreshes the screen. Posted
+ * events may modify the rows, so they only run from the main loop, see
+ * editorRunEvents(). */
+
+#define KILO_TIMERS 8           /* Max pending timers. */
+#define KILO_STATUS_TIMEOUT 5   /* Seconds a status message is shown. */
+
+typedef void editorEventProc(void *arg);
+
+typedef struct editorTimer {
+    long long when;             /* Deadline in milliseconds. */
+    editorEventProc *proc;      /* Callback, or NULL for a free slot. */
+    void *arg;
+} editorTimer;
+
+typedef struct editorEvent {
+    editorEventProc *proc;
+    void *arg;
+    struct editorEvent *next;
+} editorEvent;
+
+static struct eventLoop {
+    int pipe[2];                    /* Self pipe used to wake up poll(). */
+    volatile sig_atomic_t winch;    /* SIGWINCH received. */
+    int refresh;                    /* A thread asked for a refresh. */
+    pthread_mutex_t lock;           /* Protects the events list. */
+    editorEvent *head, *tail;       /* Events to run in the main loop. */
+    editorTimer timer[KILO_TIMERS];
+    int watch_fd;                   /* Watched fd, or -1, and the callback */
+    editorEventProc *watch_proc;    /* called when it is readable. */
+} EL = {{-1,-1},0,0,PTHREAD_MUTEX_INITIALIZER,NULL,NULL,{{0,NULL,NULL}},
+        -1,NULL};
+
+/* Return the time from an unspecified point in milliseconds. */
+long long mstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+/* Return the time from an unspecified point in microseconds. */
+long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+/* Wake up the event loop. Safe to call from signal handlers and threads. */
+static void editorWakeUp(void) {
+    int saved_errno = errno;
+    if (write(EL.pipe[1],"!",1) == -1) {
+        /* Pipe full: the loop will wake up anyway. */
+    }
+    errno = saved_errno;
+}
+
+/* Create the self pipe. Both sides are non blocking, so that a burst of
+ * wake ups never blocks the writer, and the reader can drain it. */
+void editorEventInit(void) {
+    if (pipe(EL.pipe) == -1) {
+        perror("Creating the event loop pipe");
+        exit(1);
+    }
+    for (int j = 0; j < 2; j++) {
+        fcntl(EL.pipe[j],F_SETFL,fcntl(EL.pipe[j],F_GETFL)|O_NONBLOCK);
+        fcntl(EL.pipe[j],F_SETFD,FD_CLOEXEC);
+    }
+}
+
+/* Post an event from any thread: 'proc' will be called with 'arg' by the
+ * main loop. */
+void editorPostEvent(editorEventProc *proc, void *arg) {
+    editorEvent *ev = kmalloc(sizeof(*ev));
+    if (ev == NULL) return;
+    ev->proc = proc;
+    ev->arg = arg;
+    ev->next = NULL;
+    pthread_mutex_lock(&EL.lock);
+    if (EL.tail) EL.tail->next = ev; else EL.head = ev;
+    EL.tail = ev;
+    pthread_mutex_unlock(&EL.lock);
+    editorWakeUp();
+}
+
+/* Ask the loop to refresh the screen, from any thread. Requests are
+ * coalesced until the loop handles them. */
+void editorPostRefresh(void) {
+    if (!__atomic_exchange_n(&EL.refresh,1,__ATOMIC_ACQ_REL))
+        editorWakeUp();
+}
+
+/* Run the events posted so far. Returns the number of events run. */
+int editorRunEvents(void) {
+    int count = 0;
+
+    pthread_mutex_lock(&EL.lock);
+    editorEvent *ev = EL.head;
+    EL.head = EL.tail = NULL;
+    pthread_mutex_unlock(&EL.lock);
+    while(ev) {
+        editorEvent *next = ev->next;
+        ev->proc(ev->arg);
+        free(ev);
+        ev = next;
+        count++;
+    }
+    return count;
+}
+
+/* Call 'proc' with 'arg' from the event loop after 'ms' milliseconds.
+ * Returns the timer id, or -1 if there are too many timers. */
+int editorAddTimer(int ms, editorEventProc *proc, void *arg) {
+    for (int j = 0; j < KILO_TIMERS; j++) {
+        if (EL.timer[j].proc) continue;
+        EL.timer[j].when = mstime()+ms;
+        EL.timer[j].proc = proc;
+        EL.timer[j].arg = arg;
+        return j;
+    }
+    return -1;
+}
+
+void editorDelTimer(int id) {
+    if (id >= 0 && id < KILO_TIMERS) EL.timer[id].proc = NULL;
+}
+
+/* Call 'proc' from the event loop every time 'fd' is readable: like timers,
+ * it must read what is pending, and post an event to modify the rows. */
+void editorWatchFd(int fd, editorEventProc *proc) {
+    EL.watch_fd = fd;
+    EL.watch_proc = proc;
+}
+
+/* Return the milliseconds to wait for the next timer, or -1 if there are
+ * no timers, that is the poll(2) timeout. */
+static int editorTimersTimeout(void) {
+    long long now = mstime(), min = -1;
+    for (int j = 0; j < KILO_TIMERS; j++) {
+        if (EL.timer[j].proc == NULL) continue;
+        long long left = EL.timer[j].when-now;
+        if (left < 0) left = 0;
+        if (min == -1 || left < min) min = left;
+    }
+    return min;
+}
+
+/* Run the expired timers. Returns the number of timers run. */
+static int editorRunTimers(void) {
+    long long now = mstime();
+    int count = 0;
+    for (int j = 0; j < KILO_TIMERS; j++) {
+        if (EL.timer[j].proc == NULL || EL.timer[j].when > now) continue;
+        editorEventProc *proc = EL.timer[j].proc;
+        EL.timer[j].proc = NULL;
+        proc(EL.timer[j].arg);
+        count++;
+    }
+    return count;
+}
+
+/* Wait until there is input to read from 'fd', handling everything else
+ * meanwhile. Returns 1 when there is input in the queue, 0 when the screen
+ * should be refreshed before waiting again. */
+int editorEventWait(int fd) {
+    while(1) {
+        struct pollfd pfd[3];
+        int refresh = 0;
+
+        if (E.inpos < E.inlen) return 1;
+        if (E.bench) return benchFeed();
+        pfd[0].fd = fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = EL.pipe[0];
+        pfd[1].events = POLLIN;
+        pfd[2].fd = EL.watch_fd;
+        pfd[2].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+        if (poll(pfd,EL.watch_fd == -1 ? 2 : 3,editorTimersTimeout()) == -1 &&
+            errno != EINTR) exit(1);
+
+        if (pfd[1].revents) {
+            char buf[64];
+            while(read(EL.pipe[0],buf,sizeof(buf)) > 0);
+            if (__atomic_exchange_n(&EL.refresh,0,__ATOMIC_ACQ_REL))
+                refresh = 1;
+            pthread_mutex_lock(&EL.lock);
+            if (EL.head) refresh = 1;
+            pthread_mutex_unlock(&EL.lock);
+        }
+        if (EL.winch) {
+            EL.winch = 0;
+            updateWindowSize();
+            refresh = 1;
+        }
+        if (editorRunTimers()) refresh = 1;
+        if (pfd[2].revents) EL.watch_proc(NULL);
+        if (pfd[0].revents) {
+            if (editorInputFill(fd)) return 1;
+            if (pfd[0].revents & (POLLERR|POLLHUP|POLLNVAL)) exit(1);
+        }
+        if (refresh) return 0;
+    }
+}
+
+void handleSigWinCh(int unused __attribute__((unused))) {
+    EL.winch = 1;
+    editorWakeUp();
+}
+
 /* ====================== Syntax highlight color scheme  ==================== */
 
 int is_separator(int c) {
     return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
 }
 
-/* Return true if the specified row last char is part of a multi line comment
- * that starts at this row or at one before, and does not end at the end
- * of the row but spawns to the next row. */
-int editorRowHasOpenComment(erow *row) {
-    if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
-        (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
-                            row->render[row->rsize-1] != '/'))) return 1;
-    return 0;
+/* Hash function used for the keywords table (FNV-1a with a seed). */
+unsigned int kwHash(const char *s, int len, unsigned int seed) {
+    unsigned int h = 2166136261U ^ seed;
+    for (int j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619U;
+    }
+    return h ^ (h >> 15);
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
+/* Compile the keywords of the syntax into a perfect hash table: we try
+ * seeds until every keyword has its own slot, doubling the table if no
+ * seed works, so that looking up a word costs just hashing it and a
+ * single compare. If a keyword is listed twice the first one wins. */
+void editorSyntaxCompile(struct editorSyntax *s) {
+    int count = 0;
+    unsigned int size = 16;
 
-    if (E.syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
+    if (s->kwtable) return;
+    while(s->keywords[count]) count++;
+    while(size < (unsigned int)count*2) size *= 2;
 
-    int i, prev_sep, in_string, in_comment;
-    char *p;
-    char **keywords = E.syntax->keywords;
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-
-    /* Point to the first non-space char. */
-    p = row->render;
-    i = 0; /* Current char offset */
-    while(*p && isspace(*p)) {
-        p++;
-        i++;
+    while(1) {
+        s->kwtable = kcalloc(size,sizeof(struct kwEntry));
+        s->kwmask = size-1;
+        for (s->kwseed = 0; s->kwseed < 256; s->kwseed++) {
+            int j;
+            memset(s->kwtable,0,sizeof(struct kwEntry)*size);
+            for (j = 0; j < count; j++) {
+                const char *kw = s->keywords[j];
+                int len = strlen(kw);
+                int hl = HL_KEYWORD1;
+                if (kw[len-1] == '|') {
+                    len--;
+                    hl = HL_KEYWORD2;
+                }
+                struct kwEntry *e =
+                    s->kwtable+(kwHash(kw,len,s->kwseed) & s->kwmask);
+                if (e->word) {
+                    if (e->len == len && !memcmp(e->word,kw,len)) continue;
+                    break; /* Collision, try the next seed. */
+                }
+                e->word = kw;
+                e->len = len;
+                e->hl = hl;
+            }
+            if (j == count) return;
+        }
+        free(s->kwtable);
+        size *= 2;
     }
-    prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
-    in_string = 0; /* Are we inside "" or '' ? */
-    in_comment = 0; /* Are we inside multi-line comment? */
+}
+
+/* Return the keyword class of the word 'p' of length 'len', or 0 if the
+ * word is not a keyword. */
+int editorSyntaxKeyword(struct editorSyntax *s, const char *p, int len) {
+    struct kwEntry *e = s->kwtable+(kwHash(p,len,s->kwseed) & s->kwmask);
+    if (e->word && e->len == len && !memcmp(e->word,p,len)) return e->hl;
+    return 0;
+}
 
-    /* If the previous line has an open comment, this line starts
-     * with an open comment state. */
-    if (row->idx > 0 && editorRowHasOpenComment(&E.row[row->idx-1]))
-        in_comment = 1;
+/* Set every byte of 'hl' (that corresponds to every character in the
+ * rendered line) from the offset st->pos to the end to the right syntax
+ * highlight type (HL_* defines), starting with the lexer state 'st'. The
+ * bytes of 'hl' before st->pos are the highlight of the row up to there.
+ *
+ * On return 'st' is set to the state at the last offset before 'limit'
+ * the lexer can be restarted from after the row is modified at 'limit' or
+ * after it: no token before it looks at the chars that follow. The state
+ * at the end of the row is returned. This function only looks at its
+ * arguments, so it is also called by the background highlighter thread. */
+int editorSyntaxLexFrom(struct editorSyntax *s, const char *render, int rsize,
+                        unsigned char *hl, lexState *st, int limit)
+{
+    memset(hl+st->pos,HL_NORMAL,rsize-st->pos);
+    if (s == NULL) return 0; /* No syntax, everything is HL_NORMAL. */
+
+    /* The rendered row may be the row content itself, that is not null
+     * terminated, so never look past 'end'. */
+    int i, prev_sep, in_string, in_comment;
+    const char *p, *end = render+rsize;
+#define NEXTCHAR (p+1 < end ? p[1] : '\0')
+    char *scs = s->singleline_comment_start;
+    char *mcs = s->multiline_comment_start;
+    char *mce = s->multiline_comment_end;
+
+    p = render+st->pos;
+    i = st->pos; /* Current char offset */
+    if (i == 0) {
+        /* Point to the first non-space char. */
+        while(p < end && isspace(*p)) {
+            p++;
+            i++;
+        }
+    }
+    prev_sep = st->prev_sep; /* Tell the parser if 'i' points to start of
+                                word. */
+    in_string = st->in_string; /* Are we inside "" or '' ? */
+    in_comment = st->in_comment;
+
+    while(p < end) {
+        /* At the start of a word every token before is complete. */
+        if (prev_sep && i < limit) {
+            st->pos = i;
+            st->in_comment = in_comment;
+            st->in_string = in_string;
+            st->prev_sep = prev_sep;
+        }
 
-    while(*p) {
         /* Handle // comments. */
-        if (prev_sep && *p == scs[0] && *(p+1) == scs[1]) {
+        if (prev_sep && !in_comment && *p == scs[0] && NEXTCHAR == scs[1]) {
             /* From here to end is a comment */
-            memset(row->hl+i,HL_COMMENT,row->size-i);
-            return;
+            memset(hl+i,HL_COMMENT,rsize-i);
+            return 0;
         }
 
         /* Handle multi line comments. */
         if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
-            if (*p == mce[0] && *(p+1) == mce[1]) {
-                row->hl[i+1] = HL_MLCOMMENT;
+            hl[i] = HL_MLCOMMENT;
+            if (*p == mce[0] && NEXTCHAR == mce[1]) {
+                hl[i+1] = HL_MLCOMMENT;
                 p += 2; i += 2;
                 in_comment = 0;
                 prev_sep = 1;
@@ -430,9 +1073,9 @@ void editorUpdateSyntax(erow *row) {
                 p++; i++;
                 continue;
             }
-        } else if (*p == mcs[0] && *(p+1) == mcs[1]) {
-            row->hl[i] = HL_MLCOMMENT;
-            row->hl[i+1] = HL_MLCOMMENT;
+        } else if (*p == mcs[0] && NEXTCHAR == mcs[1]) {
+            hl[i] = HL_MLCOMMENT;
+            hl[i+1] = HL_MLCOMMENT;
             p += 2; i += 2;
             in_comment = 1;
             prev_sep = 0;
@@ -441,9 +1084,9 @@ void editorUpdateSyntax(erow *row) {
 
         /* Handle "" and '' */
         if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (*p == '\\') {
-                row->hl[i+1] = HL_STRING;
+            hl[i] = HL_STRING;
+            if (*p == '\\' && p+1 < end) {
+                hl[i+1] = HL_STRING;
                 p += 2; i += 2;
                 prev_sep = 0;
                 continue;
@@ -454,49 +1097,43 @@ void editorUpdateSyntax(erow *row) {
         } else {
             if (*p == '"' || *p == '\'') {
                 in_string = *p;
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 p++; i++;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        /* Handle non printable chars. */
-        if (!isprint(*p)) {
-            row->hl[i] = HL_NONPRINT;
+        /* Handle non printable chars. Bytes >= 0x80 are UTF-8, see
+         * screenPutText(). */
+        if ((unsigned char)*p < 0x80 && !isprint(*p)) {
+            hl[i] = HL_NONPRINT;
             p++; i++;
             prev_sep = 0;
             continue;
         }
 
         /* Handle numbers */
-        if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (*p == '.' && i >0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
+        if ((isdigit(*p) && (prev_sep || hl[i-1] == HL_NUMBER)) ||
+            (*p == '.' && i >0 && hl[i-1] == HL_NUMBER)) {
+            hl[i] = HL_NUMBER;
             p++; i++;
             prev_sep = 0;
             continue;
         }
 
-        /* Handle keywords and lib calls */
+        /* Handle keywords and lib calls. Keywords never contain
+         * separators, so the word up to the next separator is looked up
+         * as a whole in the compiled keywords table. */
         if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!memcmp(p,keywords[j],klen) &&
-                    is_separator(*(p+klen)))
-                {
-                    /* Keyword */
-                    memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    p += klen;
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
+            int klen = 0;
+            while(p+klen < end && !is_separator(p[klen])) klen++;
+            int kw = klen ? editorSyntaxKeyword(s,p,klen) : 0;
+            if (kw) {
+                /* Keyword */
+                memset(hl+i,kw,klen);
+                p += klen;
+                i += klen;
                 prev_sep = 0;
                 continue; /* We had a keyword match */
             }
@@ -507,13 +1144,64 @@ void editorUpdateSyntax(erow *row) {
         p++; i++;
     }
 
-    /* Propagate syntax change to the next row if the open commen
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
-    int oc = editorRowHasOpenComment(row);
-    if (row->hl_oc != oc && row->idx+1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx+1]);
-    row->hl_oc = oc;
+    /* The row may end inside an open comment: the following rows depend
+     * on this state, see editorSyntaxResolve(). */
+    return in_comment;
+#undef NEXTCHAR
+}
+
+/* Highlight a whole row, see editorSyntaxLexFrom(). 'in_comment' tells if
+ * the row starts inside a multi line comment left open by the previous
+ * rows. */
+int editorSyntaxLex(struct editorSyntax *s, const char *render, int rsize,
+                    unsigned char *hl, int in_comment)
+{
+    lexState st = {0,in_comment,0,1};
+    return editorSyntaxLexFrom(s,render,rsize,hl,&st,0);
+}
+
+/* Store the highlight classes of the chars from 'from' to 'len'-1 of 'hl'
+ * in 'packed', two per byte: there are less than 16 of them. */
+void hlPack(unsigned char *packed, const unsigned char *hl, int from, int len) {
+    int j = from;
+    if (j & 1) {
+        packed[j/2] = (packed[j/2] & 0xf) | (hl[j] << 4);
+        j++;
+    }
+    for (; j+1 < len; j += 2)
+        packed[j/2] = hl[j] | (hl[j+1] << 4);
+    if (j < len) packed[j/2] = hl[j];
+}
+
+/* Unpack 'len' highlight classes starting at 'from' into 'hl'. */
+void hlUnpack(unsigned char *hl, const unsigned char *packed, int from,
+              int len)
+{
+    for (int j = 0; j < len; j++, from++)
+        hl[j] = (packed[from/2] >> ((from&1)*4)) & 0xf;
+}
+
+/* Highlight a row that was already rendered, given the state at the end
+ * of the previous row. The state at the end of the row is stored in
+ * row->hl_oc. */
+void editorUpdateSyntax(erow *row, int in_comment) {
+    static unsigned char *hl;
+    static int cap;
+    rowCache *c = row->cache;
+
+    if (c->rsize+1 > cap) {
+        cap = c->rsize+1;
+        hl = krealloc(hl,cap);
+    }
+    c->resume = (lexState){0,in_comment,0,1};
+    row->hl_oc = editorSyntaxLexFrom(E.syntax,c->render,c->rsize,hl,
+                                     &c->resume,c->rsize);
+    c->hl = (unsigned char*)c->buf+c->hloff;
+    hlPack(c->hl,hl,0,c->rsize);
+    /* Only a window of long rows is rendered, see editorRowLong(). */
+    if (editorRowIsLong(row)) row->hl_oc = in_comment;
+    E.stats.lexed++;
+    E.stats.frame_lexed++;
 }
 
 /* Maps syntax highlight token types to terminal colors. */
@@ -541,6 +1229,7 @@ void editorSelectSyntaxHighlight(char *filename) {
             int patlen = strlen(s->filematch[i]);
             if ((p = strstr(filename,s->filematch[i])) != NULL) {
                 if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
+                    editorSyntaxCompile(s);
                     E.syntax = s;
                     return;
                 }
@@ -550,715 +1239,6919 @@ void editorSelectSyntaxHighlight(char *filename) {
     }
 }
 
-/* ======================= Editor rows implementation ======================= */
+/* ============================== Rows tree ================================= */
 
-/* Update the rendered version and the syntax highlight of a row. */
-void editorUpdateRow(erow *row) {
-    unsigned int tabs = 0, nonprint = 0;
-    int j, idx;
-
-   /* Create a version of the row we can directly print on the screen,
-     * respecting tabs, substituting non printable characters with '?'. */
-    free(row->render);
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == TAB) tabs++;
-
-    unsigned long long allocsize =
-        (unsigned long long) row->size + tabs*8 + nonprint*9 + 1;
-    if (allocsize > UINT32_MAX) {
-        printf("Some line of the edited file is too long for kilo\n");
+static void *rowsAlloc(size_t size) {
+    void *p = kmalloc(size);
+    if (p == NULL) {
+        perror("Out of memory");
         exit(1);
     }
-
-    row->render = malloc(row->size + tabs*8 + nonprint*9 + 1);
-    idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == TAB) {
-            row->render[idx++] = ' ';
-            while((idx+1) % 8 != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
-    }
-    row->rsize = idx;
-    row->render[idx] = '\0';
-
-    /* Update the syntax highlighting attributes of the row. */
-    editorUpdateSyntax(row);
+    return p;
 }
 
-/* Insert a row at the specified position, shifting the other rows on the bottom
- * if required. */
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at > E.numrows) return;
-    E.row = realloc(E.row,sizeof(erow)*(E.numrows+1));
-    if (at != E.numrows) {
-        memmove(E.row+at+1,E.row+at,sizeof(E.row[0])*(E.numrows-at));
-        for (int j = at+1; j <= E.numrows; j++) E.row[j].idx++;
-    }
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len+1);
-    memcpy(E.row[at].chars,s,len+1);
-    E.row[at].hl = NULL;
-    E.row[at].hl_oc = 0;
-    E.row[at].render = NULL;
-    E.row[at].rsize = 0;
-    E.row[at].idx = at;
-    editorUpdateRow(E.row+at);
-    E.numrows++;
-    E.dirty++;
+/* Allocate a new empty node. Leaves don't need room for the children, so
+ * we only allocate the header for them, and the array of their rows. */
+rowsNode *rowsNewNode(int leaf) {
+    rowsNode *n = rowsAlloc(sizeof(rowsNode) +
+                            (leaf ? 0 : sizeof(rowsNode*)*ROWS_NODE_CAP));
+    n->parent = n->prev = n->next = NULL;
+    n->leaf = leaf;
+    n->count = 0;
+    n->numrows = 0;
+    n->row = leaf ? rowsAlloc(sizeof(erow)*ROWS_LEAF_CAP) : NULL;
+    n->text = NULL;
+    n->textlen = 0;
+    return n;
 }
 
-/* Free row's heap allocated stuff. */
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+/* Allocate a leaf for the 'count' lines in the 'len' bytes at 'text', that
+ * will become rows pointing inside it only when accessed. */
+rowsNode *rowsNewTextLeaf(char *text, size_t len, int count) {
+    rowsNode *n = rowsAlloc(sizeof(rowsNode));
+    n->parent = n->prev = n->next = NULL;
+    n->leaf = 1;
+    n->count = n->numrows = count;
+    n->row = NULL;
+    n->text = text;
+    n->textlen = len;
+    return n;
 }
 
-/* Remove the row at the specified position, shifting the remainign on the
- * top. */
-void editorDelRow(int at) {
-    erow *row;
+/* Create the rows of a leaf allocated by rowsNewTextLeaf(). The last line
+ * of the file may lack the newline counted in 'textlen', so lines are
+ * searched without looking at the last byte. The find index worker walks
+ * the rows too, so leaves are loaded under a lock and published with a
+ * release store, see rowsLeafRows(). */
+erow *rowsLoad(rowsNode *n) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&lock);
+    erow *rows = n->row;
+    if (rows == NULL) {
+        char *p = n->text, *end = n->text+n->textlen-1;
+        rows = rowsAlloc(sizeof(erow)*ROWS_LEAF_CAP);
+        for (int j = 0; j < n->count; j++) {
+            /* Newlines may be missing if the file was truncated under us
+             * (see handleSigBus()): the lines left become empty. */
+            char *nl = memchr(p,'\n',end-p);
+            erow *row = rows+j;
+            row->leaf = n;
+            row->chars = p;
+            row->cache = NULL;
+            row->ext = NULL;
+            row->size = nl ? nl-p : end-p;
+            row->hl_oc = HL_OC_UNKNOWN;
+            row->mapped = 1;
+            row->capbits = 0;
+            p = nl ? nl+1 : end;
+        }
+        __atomic_store_n(&n->row,rows,__ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lock);
+    return rows;
+}
 
-    if (at >= E.numrows) return;
-    row = E.row+at;
-    editorFreeRow(row);
-    memmove(E.row+at,E.row+at+1,sizeof(E.row[0])*(E.numrows-at-1));
-    for (int j = at; j < E.numrows-1; j++) E.row[j].idx++;
-    E.numrows--;
-    E.dirty++;
+/* Return the rows of the leaf 'n', loading them if needed. */
+static erow *rowsLeafRows(rowsNode *n) {
+    erow *rows = __atomic_load_n(&n->row,__ATOMIC_ACQUIRE);
+    return rows ? rows : rowsLoad(n);
 }
 
-/* Turn the editor rows into a single heap-allocated string.
- * Returns the pointer to the heap-allocated string and populate the
- * integer pointed by 'buflen' with the size of the string, escluding
- * the final nulterm. */
-char *editorRowsToString(int *buflen) {
-    char *buf = NULL, *p;
-    int totlen = 0;
+/* Return the position of the child 'n' inside its parent. */
+int rowsChildPos(rowsNode *n) {
+    rowsNode *p = n->parent;
     int j;
+    for (j = 0; j < p->count; j++) if (p->child[j] == n) break;
+    return j;
+}
 
-    /* Compute count of bytes */
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size+1; /* +1 is for "\n" at end of every row */
-    *buflen = totlen;
-    totlen++; /* Also make space for nulterm */
-
-    p = buf = malloc(totlen);
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p,E.row[j].chars,E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+/* Add 'delta' to the row count of 'n' and of all its ancestors. */
+void rowsAdjustCount(rowsNode *n, int delta) {
+    while(n) {
+        n->numrows += delta;
+        n = n->parent;
     }
-    *p = '\0';
-    return buf;
 }
 
-/* Insert a character at the specified position in a row, moving the remaining
- * chars on the right if needed. */
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at > row->size) {
-        /* Pad the string with spaces if the insert location is outside the
-         * current length by more than a single character. */
-        int padlen = at-row->size;
-        /* In the next line +2 means: new char and null term. */
-        row->chars = realloc(row->chars,row->size+padlen+2);
-        memset(row->chars+row->size,' ',padlen);
-        row->chars[row->size+padlen+1] = '\0';
-        row->size += padlen+1;
-    } else {
-        /* If we are in the middle of the string just make space for 1 new
-         * char plus the (already existing) null term. */
-        row->chars = realloc(row->chars,row->size+2);
-        memmove(row->chars+at+1,row->chars+at,row->size-at+1);
-        row->size++;
+/* Return the leaf holding the row at index 'at', storing in *off the
+ * offset of the row inside the leaf. If 'at' is equal to the number of
+ * rows, the last leaf is returned with *off set to its count, that is
+ * the position where a row should be appended. The leaf rows are loaded. */
+rowsNode *rowsFindLeaf(int at, int *off) {
+    rowsNode *n = E.rows;
+    while(!n->leaf) {
+        int j;
+        for (j = 0; j < n->count-1; j++) {
+            if (at < n->child[j]->numrows) break;
+            at -= n->child[j]->numrows;
+        }
+        n = n->child[j];
     }
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    *off = at;
+    rowsLeafRows(n);
+    return n;
 }
 
-/* Append the string 's' at the end of a row */
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars,row->size+len+1);
-    memcpy(row->chars+row->size,s,len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/* Return the first leaf, without loading its rows. */
+rowsNode *rowsFirstLeaf(void) {
+    rowsNode *n = E.rows;
+    while(!n->leaf) n = n->child[0];
+    return n;
 }
 
-/* Delete the character at offset 'at' from the specified row. */
-void editorRowDelChar(erow *row, int at) {
-    if (row->size <= at) return;
-    memmove(row->chars+at,row->chars+at+1,row->size-at);
-    editorUpdateRow(row);
-    row->size--;
-    E.dirty++;
+rowsNode *rowsLastLeaf(void) {
+    rowsNode *n = E.rows;
+    while(!n->leaf) n = n->child[n->count-1];
+    return n;
 }
 
-/* Insert the specified char at the current prompt position. */
-void editorInsertChar(int c) {
-    int filerow = E.rowoff+E.cy;
-    int filecol = E.coloff+E.cx;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+/* Return the row at the specified index, or NULL if out of range. */
+erow *editorRowAt(int at) {
+    int off;
+    if (at < 0 || at >= E.numrows) return NULL;
+    rowsNode *leaf = rowsFindLeaf(at,&off);
+    return leaf->row+off;
+}
 
-    /* If the row where the cursor is currently located does not exist in our
-     * logical representaion of the file, add enough empty rows as needed. */
-    if (!row) {
-        while(E.numrows <= filerow)
-            editorInsertRow(E.numrows,"",0);
-    }
-    row = &E.row[filerow];
-    editorRowInsertChar(row,filecol,c);
-    if (E.cx == E.screencols-1)
-        E.coloff++;
-    else
-        E.cx++;
-    E.dirty++;
+/* Return the row following / preceding 'row' in the file, or NULL. */
+erow *editorRowNext(erow *row) {
+    rowsNode *leaf = row->leaf;
+    if (row+1 < leaf->row+leaf->count) return row+1;
+    return leaf->next ? rowsLeafRows(leaf->next) : NULL;
 }
 
-/* Inserting a newline is slightly complex as we have to handle inserting a
- * newline in the middle of a line, splitting the line as needed. */
-void editorInsertNewline(void) {
-    int filerow = E.rowoff+E.cy;
-    int filecol = E.coloff+E.cx;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+erow *editorRowPrev(erow *row) {
+    rowsNode *leaf = row->leaf;
+    if (row > leaf->row) return row-1;
+    return leaf->prev ? rowsLeafRows(leaf->prev)+leaf->prev->count-1 : NULL;
+}
 
-    if (!row) {
-        if (filerow == E.numrows) {
-            editorInsertRow(filerow,"",0);
-            goto fixcursor;
-        }
-        return;
+/* Return the index of the row in the file, zero-based. This is derived
+ * walking the tree from the row leaf up to the root. */
+int editorRowIdx(erow *row) {
+    rowsNode *n = row->leaf;
+    int idx = row - n->row;
+
+    while(n->parent) {
+        rowsNode *p = n->parent;
+        for (int j = 0; p->child[j] != n; j++)
+            idx += p->child[j]->numrows;
+        n = p;
     }
-    /* If the cursor is over the current line size, we want to conceptually
-     * think it's just over the last character. */
-    if (filecol >= row->size) filecol = row->size;
-    if (filecol == 0) {
-        editorInsertRow(filerow,"",0);
-    } else {
-        /* We are in the middle of a line. Split it between two rows. */
-        editorInsertRow(filerow+1,row->chars+filecol,row->size-filecol);
-        row = &E.row[filerow];
-        row->chars[filecol] = '\0';
-        row->size = filecol;
-        editorUpdateRow(row);
+    return idx;
+}
+
+/* Insert the node 'n' in the parent of 'sibling', just after it. If the
+ * parent is full it is split, recursively up to the root. */
+void rowsInsertAfter(rowsNode *sibling, rowsNode *n) {
+    rowsNode *p = sibling->parent;
+
+    if (p == NULL) {
+        /* Splitting the root: the tree grows by one level. */
+        p = rowsNewNode(0);
+        p->child[0] = sibling;
+        p->count = 1;
+        p->numrows = sibling->numrows;
+        sibling->parent = p;
+        E.rows = p;
     }
-fixcursor:
-    if (E.cy == E.screenrows-1) {
-        E.rowoff++;
-    } else {
-        E.cy++;
+
+    if (p->count == ROWS_NODE_CAP) {
+        /* Move the second half of the children to a new node. */
+        rowsNode *new = rowsNewNode(0);
+        int half = ROWS_NODE_CAP/2;
+        memcpy(new->child,p->child+half,sizeof(rowsNode*)*half);
+        new->count = half;
+        p->count = half;
+        for (int j = 0; j < half; j++) {
+            new->child[j]->parent = new;
+            new->numrows += new->child[j]->numrows;
+        }
+        rowsAdjustCount(p,-new->numrows);
+        rowsInsertAfter(p,new);
+        if (sibling->parent == new) p = new;
     }
-    E.cx = 0;
-    E.coloff = 0;
+
+    int pos = rowsChildPos(sibling)+1;
+    memmove(p->child+pos+1,p->child+pos,
+            sizeof(rowsNode*)*(p->count-pos));
+    p->child[pos] = n;
+    p->count++;
+    n->parent = p;
+    rowsAdjustCount(p,n->numrows);
 }
 
-/* Delete the char at the current prompt position. */
-void editorDelChar(void) {
-    int filerow = E.rowoff+E.cy;
-    int filecol = E.coloff+E.cx;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+/* Move the rows of 'src' starting at 'from' to the end of 'dst', fixing
+ * the leaf back pointers. Counts of the ancestors are not touched. */
+void rowsMoveRows(rowsNode *dst, rowsNode *src, int from) {
+    int n = src->count-from;
+    memcpy(dst->row+dst->count,src->row+from,sizeof(erow)*n);
+    for (int j = 0; j < n; j++) dst->row[dst->count+j].leaf = dst;
+    dst->count += n;
+    dst->numrows += n;
+    src->count -= n;
+    src->numrows -= n;
+}
 
-    if (!row || (filecol == 0 && filerow == 0)) return;
-    if (filecol == 0) {
-        /* Handle the case of column 0, we need to move the current line
-         * on the right of the previous one. */
-        filecol = E.row[filerow-1].size;
-        editorRowAppendString(&E.row[filerow-1],row->chars,row->size);
-        editorDelRow(filerow);
-        row = NULL;
-        if (E.cy == 0)
-            E.rowoff--;
-        else
-            E.cy--;
-        E.cx = filecol;
-        if (E.cx >= E.screencols) {
-            int shift = (E.screencols-E.cx)+1;
-            E.cx -= shift;
-            E.coloff += shift;
+/* Split a full leaf, returning the new leaf that follows 'leaf'. When
+ * 'append' is true the new leaf is left empty, so that loading a file
+ * row after row fills the leaves completely. */
+rowsNode *rowsSplitLeaf(rowsNode *leaf, int append) {
+    rowsNode *new = rowsNewNode(1);
+    int moved = append ? 0 : leaf->count/2;
+
+    if (moved) {
+        rowsMoveRows(new,leaf,leaf->count-moved);
+        rowsAdjustCount(leaf->parent,-moved);
+    }
+    new->prev = leaf;
+    new->next = leaf->next;
+    if (leaf->next) leaf->next->prev = new;
+    leaf->next = new;
+    rowsInsertAfter(leaf,new);
+    return new;
+}
+
+/* Make room for a new row at index 'at' and return a pointer to the
+ * (uninitialized, except for the leaf pointer) row. Pointers to other
+ * rows may be invalidated by this call. */
+erow *rowsInsert(int at) {
+    int off;
+    rowsNode *leaf = rowsFindLeaf(at,&off);
+
+    if (leaf->count == ROWS_LEAF_CAP) {
+        rowsNode *new = rowsSplitLeaf(leaf,off == leaf->count &&
+                                           leaf->next == NULL);
+        if (off >= leaf->count) {
+            off -= leaf->count;
+            leaf = new;
         }
-    } else {
-        editorRowDelChar(row,filecol-1);
-        if (E.cx == 0 && E.coloff)
-            E.coloff--;
-        else
-            E.cx--;
     }
-    if (row) editorUpdateRow(row);
-    E.dirty++;
+    memmove(leaf->row+off+1,leaf->row+off,
+            sizeof(erow)*(leaf->count-off));
+    leaf->count++;
+    rowsAdjustCount(leaf,1);
+    leaf->row[off].leaf = leaf;
+    return leaf->row+off;
 }
 
-/* Load the specified program in the editor memory and returns 0 on success
+/* Remove the (empty) node 'n' from the tree, removing its ancestors as
+ * well if they remain without children. */
+void rowsUnlink(rowsNode *n) {
+    rowsNode *p = n->parent;
+
+    if (n->leaf) {
+        if (n->prev) n->prev->next = n->next;
+        if (n->next) n->next->prev = n->prev;
+    }
+    int pos = rowsChildPos(n);
+    memmove(p->child+pos,p->child+pos+1,
+            sizeof(rowsNode*)*(p->count-pos-1));
+    p->count--;
+    free(n->row);
+    free(n);
+    if (p->count == 0 && p->parent) rowsUnlink(p);
+}
+
+/* Remove the row at index 'at' from the tree. The row content must be
+ * already released by the caller. */
+void rowsRemove(int at) {
+    int off;
+    rowsNode *leaf = rowsFindLeaf(at,&off);
+
+    memmove(leaf->row+off,leaf->row+off+1,
+            sizeof(erow)*(leaf->count-off-1));
+    leaf->count--;
+    rowsAdjustCount(leaf,-1);
+
+    if (leaf->count == 0 && leaf->parent) {
+        rowsUnlink(leaf);
+    } else if (leaf->next && leaf->next->parent == leaf->parent &&
+               leaf->count+leaf->next->count <= ROWS_LEAF_CAP/2)
+    {
+        /* Merge with the next leaf when both are mostly empty. The two
+         * leaves share the same parent, so no count changes up there. */
+        rowsNode *next = leaf->next;
+        rowsLeafRows(next);
+        rowsMoveRows(leaf,next,0);
+        rowsUnlink(next);
+    }
+
+    /* Shrink the tree when the root remains with a single child. */
+    while(!E.rows->leaf && E.rows->count == 1) {
+        rowsNode *root = E.rows;
+        E.rows = root->child[0];
+        E.rows->parent = NULL;
+        free(root);
+    }
+}
+
+/* ========================= Render and highlight cache ===================== */
+
+/* The rendered version of a row and its syntax highlight are computed only
+ * when a row is displayed or searched, and are cached in the row itself.
+ * When the memory used by the cache exceeds KILO_CACHE_BUDGET the rows out
+ * of the screen are released, sweeping the file like a clock. */
+#define KILO_CACHE_BUDGET (32*1024*1024)
+#define KILO_COL_INDEX_STEP 128     /* Bytes between column index entries. */
+
+/* Allocate the cache of a row that renders to at most 'rsize' chars, with
+ * room for 'nidx' column index entries. If 'alias' is true the rendered
+ * row is the row content itself. */
+rowCache *editorRowCacheNew(erow *row, size_t rsize, int alias, int nidx) {
+    size_t rspace = alias ? 0 : rsize+1;
+    size_t ixoff = (rspace+rsize/2+1+3) & ~(size_t)3;
+    size_t bytes = sizeof(rowCache)+ixoff+nidx*sizeof(colIndex);
+    rowCache *c = kmalloc(bytes);
+
+    c->render = alias ? row->chars : c->buf;
+    c->hl = NULL;
+    c->rsize = 0;
+    c->hloff = rspace;
+    c->bytes = bytes;
+    c->resume.pos = 0;
+    c->ixoff = ixoff;
+    c->nidx = 0;
+    row->cache = c;
+    E.cache_bytes += bytes;
+    return c;
+}
+
+/* Return the last entry of the column index of the cache whose field at
+ * offset 'field' (see colIndex) is <= 'v'. The entries are sorted by all
+ * the fields, and the first one is the start of the rendered row. */
+colIndex *colIndexFind(rowCache *c, size_t field, int v) {
+    colIndex *ix = (colIndex*)(c->buf+c->ixoff);
+    int lo = 0, hi = c->nidx-1;
+    while(lo < hi) {
+        int mid = (lo+hi+1)/2;
+        if (*(int*)((char*)(ix+mid)+field) <= v) lo = mid; else hi = mid-1;
+    }
+    return ix+lo;
+}
+
+/* Release the rendered row and its highlight. */
+void editorRowFreeCache(erow *row) {
+    if (row->cache == NULL) return;
+    E.cache_bytes -= row->cache->bytes;
+    free(row->cache);
+    row->cache = NULL;
+}
+
+/* Forget the highlight of the row, keeping the rendered row. */
+void editorRowFreeHl(erow *row) {
+    if (row->cache) row->cache->hl = NULL;
+}
+
+/* Release cached rows out of the screen until the cache is back at 3/4
+ * of its budget. */
+void editorCacheEvict(void) {
+    if (E.cache_bytes <= KILO_CACHE_BUDGET || E.numrows == 0) return;
+    if (E.cache_clock >= E.numrows) E.cache_clock = 0;
+
+    erow *row = editorRowAt(E.cache_clock);
+    for (int j = 0; j < E.numrows; j++) {
+        if (E.cache_bytes <= KILO_CACHE_BUDGET/4*3) break;
+        if (E.cache_clock < E.rowoff || E.cache_clock >= E.rowoff+E.screenrows)
+            editorRowFreeCache(row);
+        E.cache_clock++;
+        row = editorRowNext(row);
+        if (row == NULL) {
+            E.cache_clock = 0;
+            row = editorRowAt(0);
+        }
+    }
+}
+
+/* ======================== Incremental syntax state ======================== */
+
+/* The highlight of a row depends on the rows before it because of multi
+ * line comments. The lexer state at the end of every row is checkpointed
+ * in row->hl_oc, and it is the state the next row starts with.
+ *
+ * Instead of re-highlighting everything after an edit, the rows whose
+ * checkpoint may be wrong are kept in the sorted E.hl_pending list: every
+ * row not in the list has a checkpoint consistent with the one of the
+ * previous row. Checking a pending row means running the lexer on it: if
+ * the state at its end did not change, the following rows are fine and
+ * propagation stops there, otherwise the next row becomes pending.
+ *
+ * Pending rows are only checked up to the rows that are displayed (see
+ * editorRowReady()), so an edit costs at most a screenful of rows even
+ * when it opens a comment, and the rest is done when scrolling there.
+ * Rows never highlighted have a HL_OC_UNKNOWN checkpoint, so that they
+ * always propagate: this way loading a file needs just a single pending
+ * entry for the first row. Similarly, the rows before E.hl_force always
+ * propagate when checked: this is how a full list is made room in. */
+
+/* Add row 'at' to the pending list, if not already there. */
+static void editorSyntaxAddPending(int at) {
+    int j;
+
+    /* If the list is full, collapse it into its first entry: checking
+     * goes on from there up to the last entry, instead of stopping at the
+     * first row that converges. Just more rows to check, later and within
+     * the usual budget. This is very unlikely to happen. */
+    if (E.hl_npending == KILO_HL_PENDING) {
+        int last = E.hl_pending[E.hl_npending-1];
+        if (at > last) last = at;
+        if (E.hl_force <= last) E.hl_force = last+1;
+        if (at < E.hl_pending[0]) E.hl_pending[0] = at;
+        E.hl_npending = 1;
+        return;
+    }
+
+    for (j = 0; j < E.hl_npending; j++) {
+        if (E.hl_pending[j] == at) return;
+        if (E.hl_pending[j] > at) break;
+    }
+    memmove(E.hl_pending+j+1,E.hl_pending+j,
+            sizeof(int)*(E.hl_npending-j));
+    E.hl_pending[j] = at;
+    E.hl_npending++;
+}
+
+/* The row 'at' was modified: it must be highlighted again. */
+void editorSyntaxInvalidate(int at) {
+    if (at < E.hl_edit_min) E.hl_edit_min = at;
+    editorSyntaxAddPending(at);
+}
+
+/* Rows were inserted (delta > 0) or deleted (delta < 0) at index 'at':
+ * fix the pending rows indexes. For deletions the pending rows that
+ * were deleted are dropped, the ones at 'at' stay there since the row
+ * after the deleted ones needs to be checked anyway. */
+void editorSyntaxShift(int at, int delta) {
+    int j, k = 0;
+    if (at < E.hl_edit_min) E.hl_edit_min = at;
+    if (E.hl_force > at)
+        E.hl_force = E.hl_force+delta > at ? E.hl_force+delta : at;
+    for (j = 0; j < E.hl_npending; j++) {
+        int p = E.hl_pending[j];
+        if (delta > 0 && p >= at) p += delta;
+        if (delta < 0 && p > at) {
+            if (p < at-delta) continue;
+            p += delta;
+        }
+        if (p >= E.numrows) continue;
+        if (k && E.hl_pending[k-1] == p) continue;
+        E.hl_pending[k++] = p;
+    }
+    E.hl_npending = k;
+    if (k == 0) E.hl_force = 0;
+}
+
+/* Check the pending rows up to row 'at' included, so that all the
+ * checkpoints up to that row are correct. At most *budget rows are
+ * checked, and the budget is decremented accordingly: if it runs out
+ * before reaching 'at' 0 is returned, otherwise 1. Rows that were not
+ * cached are released again once done. */
+int editorSyntaxResolve(int at, int *budget) {
+    erow *row = NULL, *prev = NULL;
+    int idx = -1;
+
+    while(E.hl_npending && E.hl_pending[0] <= at) {
+        if (*budget <= 0) return 0;
+        (*budget)--;
+
+        int p = E.hl_pending[0];
+        if (p != idx) {
+            prev = editorRowAt(p-1);
+            row = editorRowAt(p);
+        }
+        int cached = row->cache != NULL;
+        int oc = row->hl_oc;
+        editorRowRender(row);
+        editorUpdateSyntax(row,prev ? prev->hl_oc : 0);
+        if (!cached) editorRowFreeCache(row);
+
+        /* Remove the entry, and if the state changed propagate it to the
+         * next row unless it is already pending. */
+        E.hl_npending--;
+        memmove(E.hl_pending,E.hl_pending+1,sizeof(int)*E.hl_npending);
+        if ((oc != row->hl_oc || p+1 < E.hl_force) && p+1 < E.numrows &&
+            (E.hl_npending == 0 || E.hl_pending[0] != p+1))
+        {
+            memmove(E.hl_pending+1,E.hl_pending,sizeof(int)*E.hl_npending);
+            E.hl_pending[0] = p+1;
+            E.hl_npending++;
+        }
+        if (E.hl_npending == 0) E.hl_force = 0;
+        idx = p+1;
+        prev = row;
+        row = editorRowNext(row);
+    }
+    return 1;
+}
+
+/* Checking the pending rows is cheap when the edit is near the displayed
+ * rows, but after jumping far away in a big file, or opening a comment
+ * at the top of it, millions of rows may need to be checked before the
+ * screen can be highlighted. In order for input latency to never depend
+ * on the file size, the screen only checks up to KILO_HL_SYNC_ROWS rows
+ * per refresh, and the rest of the work is handed to a background thread.
+ *
+ * The thread works on a snapshot: a copy of the content of the rows
+ * starting at the first pending one, together with the lexer state
+ * before them. It computes the state at the end of every row, and the
+ * highlight of the rows that were displayed when the job was issued.
+ * Meanwhile the editor keeps running, and E.hl_edit_min remembers the
+ * lowest row modified, inserted or deleted since the snapshot was taken:
+ * when the job is done, the results are published in the main thread only
+ * for the rows before that one, which are still the same rows the thread
+ * saw. The screen is refreshed, and rows whose highlight is still not
+ * ready are drawn as plain text meanwhile. */
+#define KILO_HL_SYNC_ROWS 1000              /* Rows checked per refresh. */
+#define KILO_HL_JOB_ROWS 65536              /* Max rows of a job. */
+#define KILO_HL_JOB_BYTES (4*1024*1024)     /* Max bytes copied by a job. */
+
+struct hlJob {
+    struct editorSyntax *syntax;
+    int start, count;       /* Rows start ... start+count-1 are processed. */
+    int state;              /* Lexer state before the first row. */
+    char *text;             /* Content of the rows, one after the other. */
+    size_t *off;            /* Row j is text+off[j] ... text+off[j+1]. */
+    int vis_from, vis_to;   /* Rows we want the highlight of, relative
+                               to 'start'. */
+    unsigned char **hl;     /* Packed highlight of rows vis_from...vis_to-1 */
+    int *rsize;             /* and the rendered size they refer to. */
+    int *oc;                /* State at the end of every row. */
+    int done;               /* Set by the thread once the job is done. */
+    int running;            /* Thread started and not yet joined. */
+    pthread_t thread;
+};
+
+void hlJobFree(struct hlJob *job) {
+    for (int j = 0; j < job->vis_to-job->vis_from; j++) free(job->hl[j]);
+    free(job->hl);
+    free(job->rsize);
+    free(job->oc);
+    free(job->off);
+    free(job->text);
+    free(job);
+}
+
+static void *hlWorker(void *arg) {
+    struct hlJob *job = arg;
+    char *render = NULL;
+    unsigned char *hl = NULL;
+    size_t cap = 0;
+    int state = job->state;
+
+    for (int j = 0; j < job->count; j++) {
+        const char *chars = job->text+job->off[j];
+        int size = job->off[j+1]-job->off[j];
+        size_t need = editorRenderSize(chars,size);
+        if (need > cap) {
+            render = krealloc(render,need);
+            hl = krealloc(hl,need);
+            cap = need;
+        }
+        int rsize = editorRenderText(chars,size,render,0,NULL,NULL);
+        state = editorSyntaxLex(job->syntax,render,rsize,hl,state);
+        if (j >= job->vis_from && j < job->vis_to) {
+            unsigned char *rowhl = kmalloc(rsize/2+1);
+            hlPack(rowhl,hl,0,rsize);
+            job->hl[j-job->vis_from] = rowhl;
+            job->rsize[j-job->vis_from] = rsize;
+        }
+        job->oc[j] = state;
+    }
+    free(render);
+    free(hl);
+    __atomic_add_fetch(&E.stats.lexed_bg,job->count,__ATOMIC_RELAXED);
+    __atomic_store_n(&job->done,1,__ATOMIC_RELEASE);
+    editorPostRefresh();
+    return NULL;
+}
+
+/* Hand the pending rows up to the end of the screen to the background
+ * thread, unless a job is already in progress. */
+void editorSyntaxSchedule(void) {
+    if (E.hl_job || E.hl_npending == 0) return;
+
+    int start = E.hl_pending[0];
+    int end = E.rowoff+E.screenrows;
+    if (end > E.numrows) end = E.numrows;
+    if (start >= end) return;
+
+    /* Snapshot the rows. */
+    struct hlJob *job = kcalloc(1,sizeof(*job));
+    erow *row = editorRowAt(start), *prev = editorRowAt(start-1);
+    size_t bytes = 0;
+    int count = 0;
+    for (erow *r = row; r && start+count < end; r = editorRowNext(r)) {
+        if (count == KILO_HL_JOB_ROWS ||
+            (count && bytes+r->size > KILO_HL_JOB_BYTES)) break;
+        if (!editorRowIsLong(r)) bytes += r->size;
+        count++;
+    }
+    job->syntax = E.syntax;
+    job->start = start;
+    job->count = count;
+    job->state = prev ? prev->hl_oc : 0;
+    job->text = kmalloc(bytes ? bytes : 1);
+    job->off = kmalloc(sizeof(size_t)*(count+1));
+    job->off[0] = 0;
+    for (int j = 0; j < count; j++, row = editorRowNext(row)) {
+        /* Long rows are copied as empty rows: the state passes through
+         * them unchanged, and their window is highlighted in place. */
+        int len = editorRowIsLong(row) ? 0 : row->size;
+        memcpy(job->text+job->off[j],row->chars,len);
+        job->off[j+1] = job->off[j]+len;
+    }
+    job->vis_from = E.rowoff-start;
+    if (job->vis_from < 0) job->vis_from = 0;
+    job->vis_to = E.rowoff+E.screenrows-start;
+    if (job->vis_to > count) job->vis_to = count;
+    if (job->vis_to < job->vis_from) job->vis_to = job->vis_from;
+    job->hl = kcalloc(job->vis_to-job->vis_from+1,sizeof(unsigned char*));
+    job->rsize = kmalloc(sizeof(int)*(job->vis_to-job->vis_from+1));
+    job->oc = kmalloc(sizeof(int)*count);
+
+    E.hl_job = job;
+    E.hl_edit_min = INT_MAX;
+    if (pthread_create(&job->thread,NULL,hlWorker,job) == 0)
+        job->running = 1;
+    else
+        hlWorker(job);
+}
+
+/* If the background job is done, publish its results for the rows that
+ * were not modified meanwhile. Called before every screen refresh. */
+void editorSyntaxPoll(void) {
+    struct hlJob *job = E.hl_job;
+    if (job == NULL || !__atomic_load_n(&job->done,__ATOMIC_ACQUIRE)) return;
+    if (job->running) pthread_join(job->thread,NULL);
+    E.hl_job = NULL;
+
+    int n = job->count;
+    if (E.hl_edit_min < job->start+n) n = E.hl_edit_min-job->start;
+    if (n <= 0) {
+        hlJobFree(job);
+        return;
+    }
+
+    /* Store the new checkpoints. The highlight cached in a row is stale
+     * if the state it starts with changed, or if the row was pending. */
+    erow *row = editorRowAt(job->start);
+    int changed = 0, pi = 0;
+    for (int j = 0; j < n; j++, row = editorRowNext(row)) {
+        int p = job->start+j;
+        while(pi < E.hl_npending && E.hl_pending[pi] < p) pi++;
+        if (pi < E.hl_npending && E.hl_pending[pi] == p) changed = 1;
+        if (p < E.hl_force) changed = 1;
+
+        int oc = row->hl_oc;
+        row->hl_oc = job->oc[j];
+        int v = j-job->vis_from;
+        if (j >= job->vis_from && j < job->vis_to) {
+            editorRowRender(row);
+            rowCache *c = row->cache;
+            if (c->rsize == job->rsize[v]) {
+                c->hl = (unsigned char*)c->buf+c->hloff;
+                memcpy(c->hl,job->hl[v],c->rsize/2+1);
+                c->resume.pos = 0;  /* Restart from the row start. */
+                changed = 0;
+            }
+        }
+        if (changed) editorRowFreeHl(row);
+        changed = oc != row->hl_oc;
+    }
+
+    /* Drop the pending rows we just checked. If the state at the end of
+     * the last one changed, the row after it must be checked. */
+    int j, k = 0, end = job->start+n;
+    for (j = 0; j < E.hl_npending; j++) {
+        int p = E.hl_pending[j];
+        if (p < job->start || p >= end) E.hl_pending[k++] = p;
+    }
+    E.hl_npending = k;
+    if ((changed || end < E.hl_force) && end < E.numrows)
+        editorSyntaxAddPending(end);
+    if (E.hl_npending == 0) E.hl_force = 0;
+    hlJobFree(job);
+}
+
+/* Return true if the first pending row before 'at' is one the background
+ * job is checking, so there is no point in checking it again. */
+static int editorSyntaxBusy(int at) {
+    struct hlJob *job = E.hl_job;
+    if (job == NULL || E.hl_npending == 0) return 0;
+    int p = E.hl_pending[0];
+    return p <= at && p >= job->start && p < job->start+job->count &&
+           p < E.hl_edit_min;
+}
+
+/* Return the row at index 'at' with its rendered version and, if the
+ * pending rows before it can be checked with the given budget, its syntax
+ * highlight computed and up to date, or NULL if out of range. When the
+ * highlight is not ready, row->cache->hl is NULL and the background thread is
+ * asked to do the work. */
+erow *editorRowReady(int at, int *budget) {
+    erow *row = editorRowAt(at);
+    if (row == NULL) return NULL;
+    if (!editorRowWindowValid(row)) editorRowFreeCache(row);
+    editorRowRender(row);
+    if (editorSyntaxBusy(at) || !editorSyntaxResolve(at,budget)) {
+        editorRowFreeHl(row);
+        editorSyntaxSchedule();
+        return row;
+    }
+    if (row->cache->hl) return row;
+
+    erow *prev = editorRowAt(at-1);
+    editorUpdateSyntax(row,prev ? prev->hl_oc : 0);
+    return row;
+}
+
+/* ================================= UTF-8 ================================== */
+
+/* Rows are byte strings: offsets in a row, like E.cx or the position of a
+ * search match, are byte offsets. But UTF-8 sequences are displayed as a
+ * single glyph taking zero (combining marks), one, or two (east asian wide
+ * chars and emoji) screen columns, like wcwidth() would report, except that
+ * here the tables are fixed and do not depend on the locale. Bytes that are
+ * not part of a valid sequence are shown as '?' and take one column.
+ *
+ * Most rows are plain ASCII, so the code mapping offsets to columns first
+ * looks for bytes >= 0x80 with utf8AsciiPrefix(), 16 bytes at a time, and
+ * only the rows that have some are decoded. */
+typedef struct utf8Range {
+    int from, to;
+} utf8Range;
+
+/* Combining marks and other zero width code points. */
+static const utf8Range utf8ZeroWidth[] = {
+    {0x0300,0x036F},{0x0483,0x0489},{0x0591,0x05BD},{0x05BF,0x05BF},
+    {0x05C1,0x05C2},{0x05C4,0x05C5},{0x05C7,0x05C7},{0x0610,0x061A},
+    {0x064B,0x065F},{0x0670,0x0670},{0x06D6,0x06DC},{0x06DF,0x06E4},
+    {0x06E7,0x06E8},{0x06EA,0x06ED},{0x0711,0x0711},{0x0730,0x074A},
+    {0x07A6,0x07B0},{0x0900,0x0902},{0x093A,0x093A},{0x093C,0x093C},
+    {0x0941,0x0948},{0x094D,0x094D},{0x0951,0x0957},{0x0962,0x0963},
+    {0x0981,0x0981},{0x09BC,0x09BC},{0x09C1,0x09C4},{0x09CD,0x09CD},
+    {0x0A01,0x0A02},{0x0A3C,0x0A3C},{0x0A41,0x0A51},{0x0A70,0x0A71},
+    {0x0A81,0x0A82},{0x0ABC,0x0ABC},{0x0AC1,0x0AC8},{0x0ACD,0x0ACD},
+    {0x0B01,0x0B01},{0x0B3C,0x0B3C},{0x0B3F,0x0B3F},{0x0B41,0x0B44},
+    {0x0B4D,0x0B4D},{0x0BC0,0x0BC0},{0x0BCD,0x0BCD},{0x0C3E,0x0C40},
+    {0x0C46,0x0C56},{0x0CBC,0x0CBC},{0x0CCC,0x0CCD},{0x0D41,0x0D44},
+    {0x0D4D,0x0D4D},{0x0DCA,0x0DCA},{0x0DD2,0x0DD6},{0x0E31,0x0E31},
+    {0x0E34,0x0E3A},{0x0E47,0x0E4E},{0x0EB1,0x0EB1},{0x0EB4,0x0EBC},
+    {0x0EC8,0x0ECD},{0x0F18,0x0F19},{0x0F35,0x0F35},{0x0F37,0x0F37},
+    {0x0F39,0x0F39},{0x0F71,0x0F7E},{0x0F80,0x0F84},{0x0F86,0x0F87},
+    {0x0F8D,0x0FBC},{0x102D,0x1030},{0x1032,0x1037},{0x1039,0x103A},
+    {0x1160,0x11FF},{0x135D,0x135F},{0x1712,0x1714},{0x17B4,0x17B5},
+    {0x17B7,0x17BD},{0x17C6,0x17C6},{0x17C9,0x17D3},{0x180B,0x180F},
+    {0x1AB0,0x1AFF},{0x1DC0,0x1DFF},{0x200B,0x200F},{0x202A,0x202E},
+    {0x2060,0x2064},{0x20D0,0x20F0},{0x2CEF,0x2CF1},{0x2DE0,0x2DFF},
+    {0x302A,0x302D},{0x3099,0x309A},{0xA66F,0xA672},{0xA674,0xA67D},
+    {0xA69E,0xA69F},{0xA6F0,0xA6F1},{0xA8E0,0xA8F1},{0xFB1E,0xFB1E},
+    {0xFE00,0xFE0F},{0xFE20,0xFE2F},{0xFEFF,0xFEFF},{0x1D167,0x1D169},
+    {0x1D173,0x1D182},{0xE0001,0xE007F},{0xE0100,0xE01EF}
+};
+
+/* Double width code points. */
+static const utf8Range utf8Wide[] = {
+    {0x1100,0x115F},{0x231A,0x231B},{0x2329,0x232A},{0x23E9,0x23EC},
+    {0x23F0,0x23F0},{0x23F3,0x23F3},{0x25FD,0x25FE},{0x2614,0x2615},
+    {0x2648,0x2653},{0x267F,0x267F},{0x2693,0x2693},{0x26A1,0x26A1},
+    {0x26AA,0x26AB},{0x26BD,0x26BE},{0x26C4,0x26C5},{0x26CE,0x26CE},
+    {0x26D4,0x26D4},{0x26EA,0x26EA},{0x26F2,0x26F3},{0x26F5,0x26F5},
+    {0x26FA,0x26FA},{0x26FD,0x26FD},{0x2705,0x2705},{0x270A,0x270B},
+    {0x2728,0x2728},{0x274C,0x274C},{0x274E,0x274E},{0x2753,0x2755},
+    {0x2757,0x2757},{0x2795,0x2797},{0x27B0,0x27B0},{0x27BF,0x27BF},
+    {0x2B1B,0x2B1C},{0x2B50,0x2B50},{0x2B55,0x2B55},{0x2E80,0x303E},
+    {0x3041,0x33FF},{0x3400,0x4DBF},{0x4E00,0x9FFF},{0xA000,0xA4CF},
+    {0xA960,0xA97F},{0xAC00,0xD7A3},{0xF900,0xFAFF},{0xFE10,0xFE19},
+    {0xFE30,0xFE6F},{0xFF00,0xFF60},{0xFFE0,0xFFE6},{0x16FE0,0x16FE4},
+    {0x17000,0x18AFF},{0x1B000,0x1B2FF},{0x1F004,0x1F004},
+    {0x1F0CF,0x1F0CF},{0x1F18E,0x1F18E},{0x1F191,0x1F19A},
+    {0x1F200,0x1F202},{0x1F210,0x1F23B},{0x1F240,0x1F248},
+    {0x1F250,0x1F251},{0x1F260,0x1F265},{0x1F300,0x1F320},
+    {0x1F32D,0x1F335},{0x1F337,0x1F37C},{0x1F37E,0x1F393},
+    {0x1F3A0,0x1F3CA},{0x1F3CF,0x1F3D3},{0x1F3E0,0x1F3F0},
+    {0x1F3F4,0x1F3F4},{0x1F3F8,0x1F43E},{0x1F440,0x1F440},
+    {0x1F442,0x1F4FC},{0x1F4FF,0x1F53D},{0x1F54B,0x1F54E},
+    {0x1F550,0x1F567},{0x1F57A,0x1F57A},{0x1F595,0x1F596},
+    {0x1F5A4,0x1F5A4},{0x1F5FB,0x1F64F},{0x1F680,0x1F6C5},
+    {0x1F6CC,0x1F6CC},{0x1F6D0,0x1F6D2},{0x1F6D5,0x1F6D7},
+    {0x1F6EB,0x1F6EC},{0x1F6F4,0x1F6FC},{0x1F7E0,0x1F7EB},
+    {0x1F90C,0x1F93A},{0x1F93C,0x1F945},{0x1F947,0x1F9FF},
+    {0x1FA70,0x1FAFF},{0x20000,0x2FFFD},{0x30000,0x3FFFD}
+};
+
+static int utf8InRanges(const utf8Range *r, int count, int cp) {
+    int lo = 0, hi = count-1;
+    while(lo <= hi) {
+        int mid = (lo+hi)/2;
+        if (cp < r[mid].from) hi = mid-1;
+        else if (cp > r[mid].to) lo = mid+1;
+        else return 1;
+    }
+    return 0;
+}
+
+/* Return the number of columns taken by the code point 'cp' on screen.
+ * Invalid sequences (cp == -1) are shown as a single '?'. */
+int utf8Width(int cp) {
+    if (cp < 0x300) return 1;
+    if (utf8InRanges(utf8ZeroWidth,
+        sizeof(utf8ZeroWidth)/sizeof(utf8ZeroWidth[0]),cp)) return 0;
+    if (cp >= 0x1100 && utf8InRanges(utf8Wide,
+        sizeof(utf8Wide)/sizeof(utf8Wide[0]),cp)) return 2;
+    return 1;
+}
+
+/* Decode the UTF-8 sequence at 's', of at most 'len' bytes, setting *cp to
+ * the code point, or to -1 if the sequence is not valid. Returns the length
+ * of the sequence: a lead byte followed by the right number of continuation
+ * bytes is always consumed as a whole, even if it encodes something invalid
+ * like an overlong form, a surrogate or a C1 control char. Any other byte
+ * >= 0x80 is an invalid sequence of one byte. */
+int utf8Decode(const char *s, int len, int *cp) {
+    static const int min[5] = {0,0,0x80,0x800,0x10000};
+    const unsigned char *p = (const unsigned char*)s;
+    int n, c;
+
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    }
+    if (p[0] >= 0xC0 && p[0] < 0xE0) { n = 2; c = p[0] & 0x1F; }
+    else if (p[0] >= 0xE0 && p[0] < 0xF0) { n = 3; c = p[0] & 0x0F; }
+    else if (p[0] >= 0xF0 && p[0] < 0xF8) { n = 4; c = p[0] & 0x07; }
+    else n = 0;
+    if (n == 0 || n > len) {
+        *cp = -1;
+        return 1;
+    }
+    for (int j = 1; j < n; j++) {
+        if ((p[j] & 0xC0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        c = (c << 6) | (p[j] & 0x3F);
+    }
+    if (c < min[n] || c < 0xA0 || (c >= 0xD800 && c <= 0xDFFF) ||
+        c > 0x10FFFF) c = -1;
+    *cp = c;
+    return n;
+}
+
+/* Return the number of ASCII bytes 's' starts with. */
+size_t utf8AsciiPrefix(const char *s, size_t len) {
+    size_t j = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    for (; j+16 <= len; j += 16) {
+        unsigned int mask =
+            _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s+j)));
+        if (mask) return j+__builtin_ctz(mask);
+    }
+#else
+    for (; j+8 <= len; j += 8) {
+        uint64_t w;
+        memcpy(&w,s+j,8);
+        if (w & 0x8080808080808080ULL) break;
+    }
+#endif
+    while(j < len && (unsigned char)s[j] < 0x80) j++;
+    return j;
+}
+
+/* =============================== Long rows ================================ */
+
+/* Rows of megabytes, like minified JSON or single line logs, can't be
+ * handled like the others: moving all the bytes after the cursor, and
+ * rendering and highlighting the whole row at every keystroke, would make
+ * typing slower the longer the row is. So rows of KILO_LONG_ROW bytes or
+ * more get some extra state, allocated the first time it is needed:
+ *
+ * 1. When edited, their content becomes a gap buffer: the free space of
+ *    the allocation is kept where the last edit happened, so typing or
+ *    deleting there only moves the bytes between the old and the new
+ *    position of the gap. Code that wants the row as a single string calls
+ *    editorRowFlatten() first, that moves the gap back at the end.
+ *
+ * 2. Only a window of KILO_ROW_WINDOW columns around E.coloff is rendered
+ *    and highlighted. In order to map render columns to offsets without
+ *    scanning the row from the start, the render column of every
+ *    KILO_ROW_CHUNK bytes is checkpointed. An edit only invalidates the
+ *    checkpoints after it, and they are computed again only up to where
+ *    they are needed.
+ *
+ * The window is highlighted starting with the state the row starts with,
+ * and long rows pass this state to the next row unchanged: the multi line
+ * comment state at the end of the row would depend on the whole row. */
+#define KILO_LONG_ROW (256*1024)
+#define KILO_ROW_WINDOW (16*1024)
+#define KILO_ROW_CHUNK (8*1024)
+#define KILO_ROW_GAP (64*1024)      /* Min size of a new gap. */
+
+struct rowLong {
+    int gap, gaplen;    /* If gaplen > 0, bytes from gap to gap+gaplen-1 of
+                           'chars' are unused and the content continues
+                           after them. */
+    int wfrom, wto;     /* Offsets of the rendered chars. */
+    int wrx, wrxto;     /* Render columns of the chars at wfrom and wto. */
+    int *rx;            /* rx[k] is the render column of offset k*CHUNK. */
+    int nrx;            /* Number of valid checkpoints. */
+    int rxcap;          /* Allocated checkpoints. */
+};
+
+int editorRowIsLong(erow *row) {
+    return row->ext != NULL || row->size >= KILO_LONG_ROW;
+}
+
+/* Return the long row state of the row, creating it if needed. */
+struct rowLong *editorRowLong(erow *row) {
+    if (row->ext == NULL) {
+        struct rowLong *l = kcalloc(1,sizeof(*l));
+        l->rx = kmalloc(sizeof(int));
+        l->rx[0] = 0;
+        l->nrx = l->rxcap = 1;
+        row->ext = l;
+    }
+    return row->ext;
+}
+
+void editorRowFreeLong(erow *row) {
+    if (row->ext == NULL) return;
+    free(row->ext->rx);
+    free(row->ext);
+    row->ext = NULL;
+}
+
+/* Set *p to the content of the row at offset 'at', and return how many
+ * bytes are contiguous in memory from there. */
+int editorRowSpan(erow *row, int at, const char **p) {
+    struct rowLong *l = row->ext;
+    if (l && l->gaplen) {
+        if (at < l->gap) {
+            *p = row->chars+at;
+            return l->gap-at;
+        }
+        *p = row->chars+at+l->gaplen;
+    } else {
+        *p = row->chars+at;
+    }
+    return row->size-at;
+}
+
+/* Return the char at offset 'at' of the row. */
+int editorRowChar(erow *row, int at) {
+    struct rowLong *l = row->ext;
+    if (l && l->gaplen && at >= l->gap) at += l->gaplen;
+    return (unsigned char)row->chars[at];
+}
+
+/* Decode the UTF-8 sequence at offset 'at' of the row, that may span the
+ * gap of a long row. Returns its length and sets *width to its columns. */
+static int editorRowGlyph(erow *row, int at, int *width) {
+    char buf[4];
+    int n = 0, cp;
+    while(n < 4 && at+n < row->size) {
+        buf[n] = editorRowChar(row,at+n);
+        n++;
+    }
+    n = utf8Decode(buf,n,&cp);
+    *width = utf8Width(cp);
+    return n;
+}
+
+/* If the offset 'at' of the row is inside a UTF-8 sequence, return the
+ * offset after the sequence, otherwise 'at'. */
+static int editorRowGlyphSkip(erow *row, int at) {
+    if (at >= row->size || (editorRowChar(row,at) & 0xC0) != 0x80) return at;
+    for (int j = 1; j <= 3 && at-j >= 0; j++) {
+        int c = editorRowChar(row,at-j);
+        if ((c & 0xC0) == 0x80) continue;
+        if (c < 0x80) break;
+        int w, len = editorRowGlyph(row,at-j,&w);
+        return len > j ? at-j+len : at;
+    }
+    return at;
+}
+
+/* Return the offset of the glyph after the one at 'cx', skipping the zero
+ * width marks combining with it. */
+int editorRowNextGlyph(erow *row, int cx) {
+    int w;
+    if (cx >= row->size) return row->size;
+    cx += editorRowChar(row,cx) < 0x80 ? 1 : editorRowGlyph(row,cx,&w);
+    while(cx < row->size && editorRowChar(row,cx) >= 0x80) {
+        int len = editorRowGlyph(row,cx,&w);
+        if (w != 0) break;
+        cx += len;
+    }
+    return cx;
+}
+
+/* Return the offset of the glyph before the one at 'cx', including the
+ * zero width marks combining with it. */
+int editorRowPrevGlyph(erow *row, int cx) {
+    while(cx > 0) {
+        int at = cx-1, w = 1;
+        while(at > 0 && cx-at < 4 && (editorRowChar(row,at) & 0xC0) == 0x80)
+            at--;
+        if (editorRowChar(row,at) < 0x80 || at+editorRowGlyph(row,at,&w) != cx)
+        {
+            /* Not a sequence ending at cx: the previous byte alone. */
+            at = cx-1;
+            if (editorRowChar(row,at) >= 0x80) editorRowGlyph(row,at,&w);
+        }
+        cx = at;
+        if (w != 0) break;
+    }
+    return cx;
+}
+
+/* Given that the character at offset 'cx' of the row is at render column
+ * 'rx', return the render column of the character at 'to', that must be
+ * >= cx. Tabs are expanded like editorRowRender() does, and UTF-8 sequences
+ * take the columns of their width. The columns of a sequence are counted at
+ * its first byte: if 'cx' is inside one its remaining bytes are skipped,
+ * and if 'to' is, the sequence is counted. */
+int editorRowAdvanceRx(erow *row, int cx, int rx, int to) {
+    if (to > row->size) to = row->size;
+    if (cx > 0 && cx < to) cx = editorRowGlyphSkip(row,cx);
+    while(cx < to) {
+        const char *p;
+        int len = editorRowSpan(row,cx,&p);
+        if (len > to-cx) len = to-cx;
+
+        /* ASCII bytes: only TABs are special. */
+        int ascii = utf8AsciiPrefix(p,len);
+        const char *end = p+ascii, *tab;
+        while((tab = memchr(p,TAB,end-p)) != NULL) {
+            rx += tab-p+1;
+            while((rx+1) % 8 != 0) rx++;
+            p = tab+1;
+        }
+        rx += end-p;
+        cx += ascii;
+        if (ascii < len) {
+            int w;
+            cx += editorRowGlyph(row,cx,&w);
+            rx += w;
+        }
+    }
+    return rx;
+}
+
+/* Make sure the checkpoints up to number 'k' are valid. */
+static void editorRowCheckpoint(erow *row, int k) {
+    struct rowLong *l = editorRowLong(row);
+    if (k > row->size/KILO_ROW_CHUNK) k = row->size/KILO_ROW_CHUNK;
+    if (k >= l->rxcap) {
+        l->rxcap = k+1 > l->rxcap*2 ? k+1 : l->rxcap*2;
+        l->rx = krealloc(l->rx,sizeof(int)*l->rxcap);
+    }
+    for (; l->nrx <= k; l->nrx++) {
+        int j = l->nrx;
+        l->rx[j] = editorRowAdvanceRx(row,(j-1)*KILO_ROW_CHUNK,l->rx[j-1],
+                                      j*KILO_ROW_CHUNK);
+    }
+}
+
+/* Convert an offset of the row into the render column of the char. Long
+ * rows use their checkpoints, the others the column index of their cache,
+ * if they are not ASCII. */
+int editorRowCxToRx(erow *row, int cx) {
+    if (!editorRowIsLong(row)) {
+        if (row->cache == NULL) editorRowRender(row);
+        if (row->cache->nidx == 0) return editorRowAdvanceRx(row,0,0,cx);
+        colIndex *e = colIndexFind(row->cache,offsetof(colIndex,cx),cx);
+        return editorRowAdvanceRx(row,e->cx,e->col,cx);
+    }
+    int k = cx/KILO_ROW_CHUNK;
+    editorRowCheckpoint(row,k);
+    k = k < row->ext->nrx ? k : row->ext->nrx-1;
+    return editorRowAdvanceRx(row,k*KILO_ROW_CHUNK,row->ext->rx[k],cx);
+}
+
+/* Return the offset of the char at render column 'rx' of the row (the tab
+ * 'rx' is part of, for tabs), or the row size if the row is shorter. */
+int editorRowRxToCx(erow *row, int rx) {
+    int cx = 0, cur = 0;
+
+    if (editorRowIsLong(row)) {
+        struct rowLong *l = editorRowLong(row);
+        int last = row->size/KILO_ROW_CHUNK;
+
+        /* Compute checkpoints until one is past 'rx', then start from the
+         * last one before it. */
+        while(l->nrx-1 < last && l->rx[l->nrx-1] <= rx)
+            editorRowCheckpoint(row,l->nrx);
+        int lo = 0, hi = l->nrx-1;
+        while(lo < hi) {
+            int mid = (lo+hi+1)/2;
+            if (l->rx[mid] <= rx) lo = mid; else hi = mid-1;
+        }
+        cx = editorRowGlyphSkip(row,lo*KILO_ROW_CHUNK);
+        cur = l->rx[lo];
+    } else {
+        if (row->cache == NULL) editorRowRender(row);
+        if (row->cache->nidx) {
+            colIndex *e = colIndexFind(row->cache,offsetof(colIndex,col),rx);
+            cx = e->cx;
+            cur = e->col;
+        }
+    }
+    while(cx < row->size) {
+        const char *p;
+        int len = editorRowSpan(row,cx,&p), j = 0;
+        while(j < len) {
+            unsigned char c = p[j];
+            int n = 1, w = 1;
+            if (c == TAB) w = ((cur+1) | 7)-cur; /* See editorRowAdvanceRx() */
+            else if (c >= 0x80) n = editorRowGlyph(row,cx+j,&w);
+            if (cur+w > rx) return cx+j;
+            cur += w;
+            j += n;
+        }
+        cx += j;
+    }
+    return row->size;
+}
+
+/* Render the window of a long row around E.coloff. The window is at most
+ * KILO_ROW_WINDOW columns, and bytes, long. */
+void editorRowRenderWindow(erow *row) {
+    struct rowLong *l = editorRowLong(row);
+    int from = E.coloff-KILO_ROW_WINDOW/4;
+
+    l->wfrom = editorRowRxToCx(row,from > 0 ? from : 0);
+    l->wrx = editorRowCxToRx(row,l->wfrom);
+    rowCache *c = editorRowCacheNew(row,KILO_ROW_WINDOW+8,0,
+                                    KILO_ROW_WINDOW/KILO_COL_INDEX_STEP+2);
+    char *render = c->render;
+    colIndex *ix = (colIndex*)(c->buf+c->ixoff);
+
+    int cx = l->wfrom, rx = l->wrx, n = 0, next = cx, utf8 = 0;
+    while(cx < row->size && rx-l->wrx < KILO_ROW_WINDOW &&
+          n < KILO_ROW_WINDOW)
+    {
+        const char *p;
+        int len = editorRowSpan(row,cx,&p), j = 0;
+        while(j < len && rx-l->wrx < KILO_ROW_WINDOW && n < KILO_ROW_WINDOW) {
+            unsigned char ch = p[j];
+            if (cx+j >= next) {
+                ix[c->nidx++] = (colIndex){cx+j,n,rx};
+                next = cx+j+KILO_COL_INDEX_STEP;
+            }
+            if (ch == TAB) {
+                render[n++] = ' ';
+                rx++;
+                while((rx+1) % 8 != 0) {
+                    render[n++] = ' ';
+                    rx++;
+                }
+                j++;
+            } else if (ch < 0x80) {
+                render[n++] = ch;
+                rx++;
+                j++;
+            } else {
+                int w, glen = editorRowGlyph(row,cx+j,&w);
+                for (int k = 0; k < glen; k++)
+                    render[n++] = editorRowChar(row,cx+j+k);
+                rx += w;
+                j += glen;
+                utf8 = 1;
+            }
+        }
+        cx += j;
+    }
+    if (!utf8) c->nidx = 0;
+    l->wto = cx;
+    l->wrxto = rx;
+    render[n] = '\0';
+    c->rsize = n;
+}
+
+/* Return true if the rendered window of the row covers the screen columns,
+ * or if the row is not a long one. */
+int editorRowWindowValid(erow *row) {
+    struct rowLong *l = row->ext;
+    if (l == NULL || row->cache == NULL) return 1;
+    return E.coloff >= l->wrx &&
+           (E.coloff+E.screencols <= l->wrxto || l->wto == row->size);
+}
+
+/* Move the gap of a long row at offset 'at', growing it to at least 'len'
+ * bytes if needed. The row must be writable. */
+static void editorRowGapMove(erow *row, int at, int len) {
+    struct rowLong *l = editorRowLong(row);
+
+    if (l->gaplen == 0) l->gap = row->size;
+    if (l->gaplen < len) {
+        int grow = row->size/16;
+        if (grow < KILO_ROW_GAP) grow = KILO_ROW_GAP;
+        if (grow < len) grow = len;
+        row->chars = krealloc(row->chars,row->size+l->gaplen+grow+1);
+        row->capbits = 0;
+        /* The part after the gap goes at the end, with the null term. */
+        memmove(row->chars+l->gap+l->gaplen+grow,row->chars+l->gap+l->gaplen,
+                row->size-l->gap+1);
+        l->gaplen += grow;
+    }
+    if (l->gaplen && at < l->gap)
+        memmove(row->chars+at+l->gaplen,row->chars+at,l->gap-at);
+    else if (l->gaplen && at > l->gap)
+        memmove(row->chars+l->gap,row->chars+l->gap+l->gaplen,at-l->gap);
+    l->gap = at;
+    E.row_gaps = 1;
+}
+
+/* Insert the char 'c' at offset 'at' of a long row, padding the row with
+ * spaces if 'at' is past its end. */
+void editorRowGapInsert(erow *row, int at, int c) {
+    int pad = at > row->size ? at-row->size : 0;
+    editorRowGapMove(row,at-pad,pad+1);
+
+    struct rowLong *l = row->ext;
+    memset(row->chars+l->gap,' ',pad);
+    row->chars[l->gap+pad] = c;
+    l->gap += pad+1;
+    l->gaplen -= pad+1;
+    row->size += pad+1;
+}
+
+/* Delete the char at offset 'at' of a long row. */
+void editorRowGapDelete(erow *row, int at) {
+    editorRowGapMove(row,at,0);
+    row->ext->gaplen++;
+    row->size--;
+}
+
+/* Move the gap of the row, if any, at the end: the row content is now a
+ * null terminated string. */
+void editorRowFlatten(erow *row) {
+    struct rowLong *l = row->ext;
+    if (l == NULL || l->gaplen == 0) return;
+    memmove(row->chars+l->gap,row->chars+l->gap+l->gaplen,row->size-l->gap);
+    row->chars[row->size] = '\0';
+    l->gaplen = 0;
+}
+
+/* Flatten all the rows, before code that reads them from another thread
+ * or as memory regions. */
+void editorRowsFlatten(void) {
+    if (!E.row_gaps) return;
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row))
+        if (row->ext) editorRowFlatten(row);
+    E.row_gaps = 0;
+}
+
+/* ======================= Editor rows implementation ======================= */
+
+/* Return the size of the buffer needed to render 'size' bytes of 'chars'
+ * with editorRenderText(), including the null term. */
+size_t editorRenderSize(const char *chars, int size) {
+    size_t tabs = 0;
+    for (int j = 0; j < size; j++)
+        if (chars[j] == TAB) tabs++;
+    return (size_t)size + tabs*8 + 1;
+}
+
+/* Create a version of the row we can directly print on the screen,
+ * respecting tabs, into 'out', starting at the render offset 'idx' (the
+ * chars before are already rendered, and are ASCII). Returns the rendered
+ * size.
+ *
+ * TABs are expanded according to the screen columns, so the width of the
+ * UTF-8 sequences before them is taken into account. If 'ix' is not NULL
+ * a column index entry is stored there every KILO_COL_INDEX_STEP bytes,
+ * and their number in *nidx. */
+int editorRenderText(const char *chars, int size, char *out, int idx,
+                     colIndex *ix, int *nidx)
+{
+    int col = idx, n = 0, next = 0;
+    for (int j = 0; j < size; ) {
+        unsigned char c = chars[j];
+        if (ix && j >= next) {
+            ix[n++] = (colIndex){j,idx,col};
+            next = j+KILO_COL_INDEX_STEP;
+        }
+        if (c == TAB) {
+            out[idx++] = ' ';
+            col++;
+            while((col+1) % 8 != 0) {
+                out[idx++] = ' ';
+                col++;
+            }
+            j++;
+        } else if (c < 0x80) {
+            out[idx++] = c;
+            col++;
+            j++;
+        } else {
+            int cp, len = utf8Decode(chars+j,size-j,&cp);
+            memcpy(out+idx,chars+j,len);
+            idx += len;
+            j += len;
+            col += utf8Width(cp);
+        }
+    }
+    out[idx] = '\0';
+    if (nidx) *nidx = n;
+    return idx;
+}
+
+/* Update the rendered version of a row, if not already cached. Most rows
+ * are ASCII and have no TABs: their rendered version is the row content
+ * itself, so only the space for the highlight is allocated. Rows with
+ * UTF-8 sequences also get a column index, so that offsets and columns
+ * can be mapped without scanning the row from the start. */
+void editorRowRender(erow *row) {
+    if (row->cache) return;
+    editorCacheEvict();
+
+    if (editorRowIsLong(row)) {
+        editorRowRenderWindow(row);
+        return;
+    }
+    int ascii = utf8AsciiPrefix(row->chars,row->size) == (size_t)row->size;
+    if (ascii && memchr(row->chars,TAB,row->size) == NULL) {
+        editorRowCacheNew(row,row->size,1,0)->rsize = row->size;
+    } else {
+        size_t rsize = editorRenderSize(row->chars,row->size)-1;
+        int nidx = ascii ? 0 : row->size/KILO_COL_INDEX_STEP+1;
+        rowCache *c = editorRowCacheNew(row,rsize,0,nidx);
+        c->rsize = editorRenderText(row->chars,row->size,c->render,0,
+            nidx ? (colIndex*)(c->buf+c->ixoff) : NULL,&c->nidx);
+    }
+}
+
+/* Called every time the content of a row changes from offset 'at': the
+ * cached render and highlight are no longer valid. */
+void editorRowModified(erow *row, int at) {
+    struct rowLong *l = row->ext;
+    if (l && l->nrx > at/KILO_ROW_CHUNK+1) l->nrx = at/KILO_ROW_CHUNK+1;
+    editorRowFreeCache(row);
+    editorSyntaxInvalidate(editorRowIdx(row));
+}
+
+void editorUpdateRow(erow *row) {
+    editorRowModified(row,0);
+}
+
+/* Make sure the heap allocated content of the row has room for 'len'
+ * bytes plus the null term. The room is doubled every time it is not
+ * enough, so typing in a row does not realloc it at every char. */
+void editorRowReserve(erow *row, size_t len) {
+    if (row->capbits && len < (1ULL<<row->capbits)) return;
+    int bits = 4;
+    while((1ULL<<bits) <= len) bits++;
+    row->chars = krealloc(row->chars,1ULL<<bits);
+    row->capbits = bits;
+}
+
+/* Make sure the cache of the row has room for a rendered row of 'rsize'
+ * chars and its highlight, moving it in a bigger allocation if needed. */
+static rowCache *editorRowCacheReserve(erow *row, int rsize) {
+    rowCache *c = row->cache;
+    int alias = c->render != c->buf;
+    int hlcap = c->bytes-(int)sizeof(rowCache)-c->hloff;
+    if ((alias || rsize < c->hloff) && rsize/2+1 <= hlcap) return c;
+
+    rowCache *n = editorRowCacheNew(row,rsize*2,alias,0);
+    if (!alias) memcpy(n->buf,c->buf,c->hloff);
+    memcpy(n->buf+n->hloff,c->buf+c->hloff,hlcap);
+    n->hl = (unsigned char*)n->buf+n->hloff;
+    n->rsize = c->rsize;
+    n->resume = c->resume;
+    E.cache_bytes -= c->bytes;
+    free(c);
+    return n;
+}
+
+/* Called when the content of a short row changed from offset 'at': a char
+ * was inserted or deleted there. When the row is displayed with an up to
+ * date highlight, only the part of the rendered row after the change is
+ * updated, and the lexer is restarted from the last point before it that
+ * does not depend on the chars that follow, so typing at the cursor does
+ * not render and highlight the whole row at every key. Otherwise, or if
+ * the row is not ASCII, the cache is just invalidated. */
+void editorRowEdited(erow *row, int at) {
+    rowCache *c = row->cache;
+    int idx = editorRowIdx(row);
+
+    if (c == NULL || c->hl == NULL || row->hl_oc == HL_OC_UNKNOWN ||
+        editorRowIsLong(row) || c->nidx ||
+        (unsigned char)row->chars[at] >= 0x80 ||
+        (E.hl_npending && E.hl_pending[0] <= idx) ||
+        (c->render != c->buf && memchr(row->chars+at,TAB,row->size-at)))
+    {
+        editorUpdateRow(row);
+        return;
+    }
+
+    /* Render again the chars from 'at', that start at column 'rx'. */
+    int rx;
+    if (c->render != c->buf) {
+        rx = at;
+        c = editorRowCacheReserve(row,row->size);
+        c->render = row->chars;
+        c->rsize = row->size;
+    } else {
+        rx = editorRowAdvanceRx(row,0,0,at);
+        c = editorRowCacheReserve(row,
+                rx+editorRenderSize(row->chars+at,row->size-at)-1);
+        c->rsize = editorRenderText(row->chars+at,row->size-at,c->render,rx,
+                                    NULL,NULL);
+    }
+
+    /* Highlight again from the restart point, that must be before the
+     * change. The next change is likely at the cursor, that is now at
+     * most one char before it. */
+    static unsigned char *hl;
+    static int cap;
+    if (c->rsize+1 > cap) {
+        cap = c->rsize+1;
+        hl = krealloc(hl,cap);
+    }
+    if (c->resume.pos == 0 || c->resume.pos >= rx) {
+        erow *prev = editorRowAt(idx-1);
+        c->resume = (lexState){0,prev ? prev->hl_oc : 0,0,1};
+    }
+    int from = c->resume.pos;
+    if (from) hlUnpack(hl+from-1,c->hl,from-1,1); /* Numbers look back. */
+    int oc = editorSyntaxLexFrom(E.syntax,c->render,c->rsize,hl,&c->resume,
+                                 rx-1);
+    hlPack(c->hl,hl,from,c->rsize);
+    E.stats.lexed++;
+    E.stats.frame_lexed++;
+
+    /* Results of the background highlighter for this row are stale, and
+     * if the state at the end changed the next row must be checked. */
+    if (idx < E.hl_edit_min) E.hl_edit_min = idx;
+    if (oc != row->hl_oc) {
+        row->hl_oc = oc;
+        if (idx+1 < E.numrows) editorSyntaxAddPending(idx+1);
+    }
+}
+
+/* Insert a row at the specified position, shifting the other rows on the bottom
+ * if required. */
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at > E.numrows) return;
+    char *chars = kmalloc(len+1);
+    memcpy(chars,s,len);
+    chars[len] = '\0';
+    editorInsertRowChars(at,chars,len,0);
+}
+
+/* Insert a row at the specified position using 'chars' as content without
+ * copying it. If 'mapped' is true 'chars' points inside the backing store
+ * E.map, otherwise it is an heap allocated null terminated string that is
+ * now owned by the row. */
+void editorInsertRowChars(int at, char *chars, size_t len, int mapped) {
+    erow *row = rowsInsert(at);
+    E.numrows++;
+    row->size = len;
+    row->chars = chars;
+    row->mapped = mapped;
+    row->capbits = 0;
+    row->hl_oc = HL_OC_UNKNOWN;
+    row->cache = NULL;
+    row->ext = NULL;
+    editorSyntaxShift(at,1);
+    /* A row after a never highlighted one will be checked anyway. */
+    erow *prev = editorRowAt(at-1);
+    if (!prev || prev->hl_oc != HL_OC_UNKNOWN) editorSyntaxInvalidate(at);
+    E.dirty++;
+}
+
+/* Make sure the row content is on the heap so that it can be modified.
+ * Rows loaded from a mapped file point directly inside the mapping until
+ * they are edited for the first time. */
+void editorRowMakeWritable(erow *row) {
+    if (!row->mapped) return;
+    char *chars = kmalloc(row->size+1);
+    memcpy(chars,row->chars,row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->mapped = 0;
+    row->capbits = 0;
+}
+
+/* Replace the content of the row 'row', at index 'idx', with the heap
+ * allocated, null terminated string 'chars' of length 'len', that is now
+ * owned by the row. Used for bulk edits, see editorReplaceAll(): unlike
+ * editorUpdateRow() the row is added to the pending syntax rows only if
+ * it matters. Without a syntax the state at the end of rows is always 0,
+ * and rows never highlighted are checked anyway once the rows before them
+ * are, so a replace in a file just loaded does not add any pending row. */
+void editorRowSetChars(erow *row, int idx, char *chars, size_t len) {
+    if (!row->mapped) free(row->chars);
+    row->chars = chars;
+    row->size = len;
+    row->mapped = 0;
+    row->capbits = 0;
+    if (row->ext) row->ext->nrx = 1;
+    editorRowFreeCache(row);
+    if (E.syntax && row->hl_oc != HL_OC_UNKNOWN)
+        editorSyntaxInvalidate(idx);
+    else if (idx < E.hl_edit_min)
+        E.hl_edit_min = idx;
+}
+
+/* Free row's heap allocated stuff. */
+void editorFreeRow(erow *row) {
+    editorRowFreeCache(row);
+    if (!row->mapped) free(row->chars);
+    editorRowFreeLong(row);
+}
+
+/* Remove the row at the specified position, shifting the remainign on the
+ * top. */
+void editorDelRow(int at) {
+    erow *row;
+
+    if (at >= E.numrows) return;
+    row = editorRowAt(at);
+    editorRowFreeCache(row);
+    editorFreeRow(row);
+    rowsRemove(at);
+    E.numrows--;
+    editorSyntaxShift(at,-1);
+    if (at < E.numrows) editorSyntaxInvalidate(at);
+    E.dirty++;
+}
+
+/* Insert a character at the specified position in a row, moving the remaining
+ * chars on the right if needed. */
+void editorRowInsertChar(erow *row, int at, int c) {
+    editorRowMakeWritable(row);
+    if (editorRowIsLong(row)) {
+        editorRowGapInsert(row,at,c);
+        editorRowModified(row,at);
+        E.dirty++;
+        return;
+    }
+    int from = at;
+    if (at > row->size) {
+        /* Pad the string with spaces if the insert location is outside the
+         * current length by more than a single character. */
+        int padlen = at-row->size;
+        editorRowReserve(row,row->size+padlen+1);
+        memset(row->chars+row->size,' ',padlen);
+        row->chars[row->size+padlen+1] = '\0';
+        from = row->size;
+        row->size += padlen+1;
+    } else {
+        /* If we are in the middle of the string just make space for 1 new
+         * char plus the (already existing) null term. */
+        editorRowReserve(row,row->size+1);
+        memmove(row->chars+at+1,row->chars+at,row->size-at+1);
+        row->size++;
+    }
+    row->chars[at] = c;
+    editorRowEdited(row,from);
+    E.dirty++;
+}
+
+/* Append the string 's' at the end of a row */
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowMakeWritable(row);
+    editorRowFlatten(row);
+    editorRowReserve(row,row->size+len);
+    memcpy(row->chars+row->size,s,len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/* Delete the character at offset 'at' from the specified row. */
+void editorRowDelChar(erow *row, int at) {
+    if (row->size <= at) return;
+    editorRowMakeWritable(row);
+    if (editorRowIsLong(row)) {
+        editorRowGapDelete(row,at);
+        editorRowModified(row,at);
+        E.dirty++;
+        return;
+    }
+    memmove(row->chars+at,row->chars+at+1,row->size-at);
+    row->size--;
+    editorRowEdited(row,at);
+    E.dirty++;
+}
+
+/* Insert the specified char at the current prompt position. */
+void editorInsertChar(int c) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.cx;
+    erow *row = editorRowAt(filerow);
+
+    /* Plain chars are journaled as text, so that typing is merged. */
+    if (c >= 0 && c < 256 && c != '\n' && c != '\r') {
+        char ch = c;
+        journalEdit(JOURNAL_TEXT,0,&ch,1);
+    } else {
+        journalEdit(JOURNAL_CHAR,c,NULL,0);
+    }
+
+    /* If the row where the cursor is currently located does not exist in our
+     * logical representaion of the file, add enough empty rows as needed. */
+    if (!row) {
+        while(E.numrows <= filerow)
+            editorInsertRow(E.numrows,"",0);
+    }
+    row = editorRowAt(filerow);
+    editorRowInsertChar(row,filecol,c);
+    E.cx++;
+    E.dirty++;
+}
+
+/* Inserting a newline is slightly complex as we have to handle inserting a
+ * newline in the middle of a line, splitting the line as needed. */
+void editorInsertNewline(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.cx;
+    erow *row = editorRowAt(filerow);
+
+    journalEdit(JOURNAL_NEWLINE,0,NULL,0);
+    if (!row) {
+        if (filerow == E.numrows) {
+            editorInsertRow(filerow,"",0);
+            goto fixcursor;
+        }
+        return;
+    }
+    /* If the cursor is over the current line size, we want to conceptually
+     * think it's just over the last character. */
+    if (filecol >= row->size) filecol = row->size;
+    if (filecol == 0) {
+        editorInsertRow(filerow,"",0);
+    } else {
+        /* We are in the middle of a line. Split it between two rows. */
+        editorRowFlatten(row);
+        editorInsertRow(filerow+1,row->chars+filecol,row->size-filecol);
+        row = editorRowAt(filerow);
+        editorRowMakeWritable(row);
+        row->chars[filecol] = '\0';
+        row->size = filecol;
+        editorUpdateRow(row);
+    }
+fixcursor:
+    E.cy++;
+    E.cx = 0;
+}
+
+/* Move the cursor to the specified file position. The view is scrolled
+ * by editorScroll() only if the position is not already visible. */
+void editorScrollTo(int filerow, int filecol) {
+    E.cy = filerow-E.rowoff;
+    E.cx = filecol;
+}
+
+/* Scroll the view so that the cursor is visible, and return the render
+ * column of the cursor. The editing and movement commands just set the
+ * cursor file position, so E.cy may be outside the screen here, and
+ * E.coloff depends on the TABs of the cursor row: it is fixed only here,
+ * before the screen is drawn. */
+int editorScroll(void) {
+    if (E.cy < 0) {
+        E.rowoff += E.cy;
+        E.cy = 0;
+    } else if (E.cy >= E.screenrows) {
+        E.rowoff += E.cy-E.screenrows+1;
+        E.cy = E.screenrows-1;
+    }
+    if (E.rowoff > E.numrows) {
+        E.cy = 0;
+        E.rowoff = E.numrows;
+    }
+
+    erow *row = editorRowAt(E.rowoff+E.cy);
+    int rowlen = row ? row->size : 0;
+    if (E.cx > rowlen) E.cx = rowlen;
+    int rx = row ? editorRowCxToRx(row,E.cx) : 0;
+    if (rx < E.coloff)
+        E.coloff = rx;
+    else if (rx >= E.coloff+E.screencols)
+        E.coloff = rx-E.screencols+1;
+    return rx;
+}
+
+/* Return the end of the line starting at 'p', that is the first newline
+ * or 'end'. Like terminals send them, newlines may be "\n", "\r\n" or
+ * just "\r". */
+static const char *textLineEnd(const char *p, const char *end) {
+    while(p < end && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+/* Skip the newline at 'p', that can be two bytes long. */
+static const char *textSkipNewline(const char *p, const char *end) {
+    if (*p == '\r' && p+1 < end && p[1] == '\n') return p+2;
+    return p+1;
+}
+
+/* Insert the text 's' of length 'len', that may span multiple lines, at
+ * the cursor position, and move the cursor after it. This is done as a
+ * single mutation instead of a key at a time: the current row is updated
+ * once, and the other lines are inserted directly as new rows. */
+void editorInsertText(const char *s, size_t len) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.cx;
+    const char *end = s+len, *nl = textLineEnd(s,end);
+    erow *row;
+
+    journalEdit(JOURNAL_TEXT,0,s,len);
+    while(E.numrows <= filerow) editorInsertRow(E.numrows,"",0);
+    row = editorRowAt(filerow);
+    editorRowMakeWritable(row);
+    editorRowFlatten(row);
+    if (filecol > row->size) {
+        /* Pad with spaces up to the cursor. */
+        editorRowReserve(row,filecol);
+        memset(row->chars+row->size,' ',filecol-row->size);
+        row->size = filecol;
+        row->chars[row->size] = '\0';
+    }
+
+    if (nl == end) {
+        /* Single line: just splice the text into the row. */
+        editorRowReserve(row,row->size+len);
+        memmove(row->chars+filecol+len,row->chars+filecol,
+                row->size-filecol+1);
+        memcpy(row->chars+filecol,s,len);
+        row->size += len;
+        editorUpdateRow(row);
+        E.dirty++;
+        editorScrollTo(filerow,filecol+len);
+        return;
+    }
+
+    /* The part of the row after the cursor goes after the last line. */
+    size_t taillen = row->size-filecol;
+    char *tail = kmalloc(taillen);
+    memcpy(tail,row->chars+filecol,taillen);
+    editorRowReserve(row,filecol+(nl-s));
+    memcpy(row->chars+filecol,s,nl-s);
+    row->size = filecol+(nl-s);
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+
+    const char *p = textSkipNewline(nl,end);
+    while(1) {
+        nl = textLineEnd(p,end);
+        filerow++;
+        if (nl == end) break;
+        editorInsertRow(filerow,(char*)p,nl-p);
+        p = textSkipNewline(nl,end);
+    }
+    size_t lastlen = end-p;
+    char *chars = kmalloc(lastlen+taillen+1);
+    memcpy(chars,p,lastlen);
+    memcpy(chars+lastlen,tail,taillen);
+    chars[lastlen+taillen] = '\0';
+    editorInsertRowChars(filerow,chars,lastlen+taillen,0);
+    free(tail);
+    editorScrollTo(filerow,lastlen);
+}
+
+/* Delete the char at the current prompt position. */
+void editorDelChar(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.cx;
+    erow *row = editorRowAt(filerow);
+
+    if (!row || (filecol == 0 && filerow == 0)) return;
+    journalEdit(JOURNAL_DEL,0,NULL,0);
+    if (filecol == 0) {
+        /* Handle the case of column 0, we need to move the current line
+         * on the right of the previous one. */
+        erow *prev = editorRowAt(filerow-1);
+        filecol = prev->size;
+        editorRowFlatten(row);
+        editorRowAppendString(prev,row->chars,row->size);
+        editorDelRow(filerow);
+        row = NULL;
+        E.cy--;
+        E.cx = filecol;
+    } else {
+        /* Delete the whole glyph before the cursor. */
+        E.cx = editorRowPrevGlyph(row,filecol);
+        while(filecol > E.cx) editorRowDelChar(row,--filecol);
+    }
+    E.dirty++;
+}
+
+/* The backing store is a MAP_PRIVATE mapping of the file, whose pages keep
+ * showing what is on disk. If another program truncates the file, reading
+ * the pages past its new end raises SIGBUS, that would kill kilo together
+ * with the edits not yet saved. The SIGBUS handler replaces those pages
+ * with zeroed memory instead, so the lines there become empty or NUL bytes,
+ * and the main loop tells the user. At most once a second, before drawing,
+ * the file is also checked with fstat(2): a truncation is handled the same
+ * way before the pages are read, and a file rewritten in place by another
+ * program is reported, since it can silently change the lines not yet
+ * modified. */
+
+#define KILO_MAP_CHECK_MS 1000
+
+static struct mapGuard {
+    int fd;                 /* The file mapped as E.map, or -1. */
+    off_t size;             /* Its size and modification time, in */
+    long long mtime;        /* nanoseconds, when it was mapped. */
+    long long checked;      /* Time of the last check. */
+    size_t pagesize;
+    volatile sig_atomic_t truncated; /* Pages were replaced with zeros. */
+    int warned;             /* Already told the user, and what. */
+} M = {-1,0,0,0,0,0,0};
+
+/* Replace the pages of the backing store from the one at offset 'off' up
+ * to the end with zeroed memory. Safe to call from the SIGBUS handler. */
+static int editorMapZero(size_t off) {
+    off &= ~(M.pagesize-1);
+    if (off >= E.mapsize) return 0;
+    char *p = mmap(E.map+off,E.mapsize-off,PROT_READ,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0);
+    return p == MAP_FAILED ? -1 : 0;
+}
+
+void handleSigBus(int sig, siginfo_t *si, void *context) {
+    char *addr = si->si_addr;
+    (void)context;
+
+    if (M.fd != -1 && addr >= E.map && addr < E.map+E.mapsize &&
+        editorMapZero(addr-E.map) == 0)
+    {
+        M.truncated = 1;
+        editorWakeUp();
+        return;
+    }
+    /* Not a page of the file: fault again, this time for real. */
+    signal(sig,SIG_DFL);
+}
+
+/* Remember the file descriptor the backing store maps, that is now owned
+ * by the guard, with its current size and modification time. */
+void editorMapGuard(int fd) {
+    struct stat sb;
+
+    if (M.fd != -1) close(M.fd);
+    M.fd = fd;
+    M.truncated = M.warned = 0;
+    if (fstat(fd,&sb) == -1) sb.st_size = E.mapsize;
+    M.size = sb.st_size;
+    M.mtime = (long long)sb.st_mtim.tv_sec*1000000000+sb.st_mtim.tv_nsec;
+    M.checked = mstime();
+    M.pagesize = sysconf(_SC_PAGESIZE);
+}
+
+/* Check if the mapped file was changed by another program. Called before
+ * every screen refresh. */
+void editorMapCheck(void) {
+    struct stat sb;
+    long long now;
+
+    if (M.fd == -1 || M.warned == 2) return;
+    if (!M.truncated && (now = mstime())-M.checked >= KILO_MAP_CHECK_MS) {
+        M.checked = now;
+        if (fstat(M.fd,&sb) == 0) {
+            long long mtime = (long long)sb.st_mtim.tv_sec*1000000000+
+                              sb.st_mtim.tv_nsec;
+            if (sb.st_size < M.size) {
+                /* The partial page past the end already reads zeros. */
+                if (editorMapZero(sb.st_size+M.pagesize-1) == 0)
+                    M.truncated = 1;
+            } else if (!M.warned &&
+                       (sb.st_size != M.size || mtime != M.mtime))
+            {
+                editorSetStatusMessage("%s was changed by another program",
+                    E.filename);
+                M.warned = 1;
+            }
+        }
+    }
+    if (M.truncated) {
+        editorSetStatusMessage("%s was truncated by another program: the "
+                               "lines past its end are lost",E.filename);
+        M.warned = 2;
+    }
+}
+
+/* Release the backing store, that must no longer be referenced by rows. */
+void editorFreeMap(void) {
+    if (E.map == NULL) return;
+    if (M.fd != -1) {
+        close(M.fd);
+        M.fd = -1;
+    }
+    munmap(E.map,E.mapsize);
+    E.map = NULL;
+    E.mapsize = 0;
+    E.maploaded = 0;
+}
+
+/* Use 'map', that must contain exactly the rows of the file each followed
+ * by a newline, as the new backing store: every row becomes a view inside
+ * it, releasing the heap copies of the modified rows and the old store.
+ * Leaves not loaded yet just move to their text in the new store. */
+void editorRowsRebase(char *map, size_t mapsize) {
+    char *p = map;
+    for (rowsNode *leaf = rowsFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->row == NULL) {
+            leaf->text = p;
+            p += leaf->textlen;
+            continue;
+        }
+        for (int j = 0; j < leaf->count; j++) {
+            erow *row = leaf->row+j;
+            /* The rendered row may point to the old content. */
+            editorRowFreeCache(row);
+            if (!row->mapped) free(row->chars);
+            row->chars = p;
+            row->mapped = 1;
+            p += row->size+1;
+        }
+    }
+    editorFreeMap();
+    E.map = map;
+    E.mapsize = E.maploaded = mapsize;
+}
+
+/* Replace a backing store mapping a file with a copy of it in anonymous
+ * memory, so that the rows no longer change if the file is rewritten in
+ * place. Returns 0 on success, -1 on out of memory. */
+int editorMapDetach(void) {
+    if (M.fd == -1) return 0; /* No file mapped. */
+    char *map = mmap(NULL,E.mapsize,PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (map == MAP_FAILED) return -1;
+    memcpy(map,E.map,E.mapsize);
+    for (rowsNode *leaf = rowsFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->row == NULL) {
+            leaf->text = map+(leaf->text-E.map);
+            continue;
+        }
+        for (int j = 0; j < leaf->count; j++) {
+            erow *row = leaf->row+j;
+            if (!row->mapped) continue;
+            editorRowFreeCache(row);
+            row->chars = map+(row->chars-E.map);
+        }
+    }
+    size_t mapsize = E.mapsize, loaded = E.maploaded;
+    editorFreeMap();
+    E.map = map;
+    E.mapsize = mapsize;
+    E.maploaded = loaded;
+    return 0;
+}
+
+/* Create a row for every line of the 'size' bytes at 'p', that are part of
+ * the backing store E.map, after the existing rows, pointing inside it
+ * instead of copying the line. Here we just find the newlines: every
+ * ROWS_LEAF_CAP lines become a leaf that creates its rows when first
+ * accessed, so only the rows actually visited use memory. Stops at the
+ * first leaf boundary after 'max' bytes, returning the bytes used. */
+static size_t editorMapLeaves(char *p, size_t size, size_t max) {
+    char *start = p, *end = p+size;
+    int first = E.numrows;
+
+    while(p < end && (size_t)(p-start) < max) {
+        char *text = p;
+        int count = 0;
+        while(p < end && count < ROWS_LEAF_CAP) {
+            char *nl = memchr(p,'\n',end-p);
+            size_t linelen = nl ? (size_t)(nl-p) : (size_t)(end-p);
+            /* Like in the getline() path, a final line without newline
+             * loses a trailing CR, unless more of it may come, see kilo
+             * -f. The newline counted in the leaf text takes its place. */
+            if (!nl && !E.follow && linelen && p[linelen-1] == '\r')
+                linelen--;
+            p += linelen+1;
+            count++;
+        }
+
+        rowsNode *leaf = rowsNewTextLeaf(text,p-text,count);
+        if (E.numrows == 0) {
+            /* Replace the empty root. */
+            free(E.rows->row);
+            free(E.rows);
+            E.rows = leaf;
+        } else {
+            rowsNode *last = rowsLastLeaf();
+            leaf->prev = last;
+            last->next = leaf;
+            rowsInsertAfter(last,leaf);
+        }
+        E.numrows += count;
+    }
+    if (E.numrows > first) editorSyntaxAddPending(first);
+    return p > end ? size : (size_t)(p-start);
+}
+
+/* Create the rows of the 'size' bytes at 'map', that is the backing store
+ * E.map, that must have no rows yet. */
+void editorMapRows(char *map, size_t size) {
+    editorMapLeaves(map,size,size);
+    E.maploaded = E.mapsize;
+}
+
+/* Finding the newlines of a file of some GB still takes seconds, so when
+ * a file is opened only its first KILO_MAP_LOAD bytes get rows before the
+ * first frame is drawn, and the rows of the rest are created in the main
+ * loop, KILO_MAP_LOAD bytes at a time, between keys. Meanwhile the file
+ * can be viewed and edited: the rows not created yet come after all the
+ * existing ones, that are the start of the file. Code that needs all the
+ * rows, like saving and searching, calls editorMapFinish() first. */
+#define KILO_MAP_LOAD (16*1024*1024)
+
+/* Create the rows of the next 'max' bytes, or a bit more, of the backing
+ * store. Returns 1 if there are more rows to create. */
+int editorMapLoad(size_t max) {
+    size_t size = E.mapsize;
+    struct stat sb;
+
+    /* Past the end of a truncated file there are only zeros. */
+    if (M.truncated && fstat(M.fd,&sb) == 0 && (size_t)sb.st_size < size)
+        size = sb.st_size;
+    if (E.maploaded < size)
+        E.maploaded += editorMapLeaves(E.map+E.maploaded,size-E.maploaded,
+                                       max);
+    if (E.maploaded >= size) E.maploaded = E.mapsize;
+    return E.maploaded < E.mapsize;
+}
+
+static void editorMapLoadNext(void *unused) {
+    (void)unused;
+    if (editorMapLoad(KILO_MAP_LOAD)) editorPostEvent(editorMapLoadNext,NULL);
+}
+
+/* Create the rows of the whole file, if still loading it. */
+void editorMapFinish(void) {
+    if (E.maploaded < E.mapsize) editorMapLoad(E.mapsize);
+}
+
+/* Map the file content in memory and create a row for every line of it,
+ * at first only for its start, see editorMapLoad(). Returns 0 on success,
+ * and 'fd' is then kept open by the mapping guard, or -1 if the file can't
+ * be mapped. */
+int editorOpenMapped(int fd) {
+    struct stat sb;
+
+    if (fstat(fd,&sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+        return -1;
+    char *map = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (map == MAP_FAILED) return -1;
+    E.map = map;
+    E.mapsize = sb.st_size;
+    E.maploaded = 0;
+    editorMapGuard(fd);
+    if (editorMapLoad(KILO_MAP_LOAD)) editorPostEvent(editorMapLoadNext,NULL);
+    return 0;
+}
+
+/* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int editorOpen(char *filename) {
     FILE *fp;
 
-    E.dirty = 0;
-    free(E.filename);
-    size_t fnlen = strlen(filename)+1;
-    E.filename = malloc(fnlen);
-    memcpy(E.filename,filename,fnlen);
+    E.dirty = 0;
+    free(E.filename);
+    size_t fnlen = strlen(filename)+1;
+    E.filename = kmalloc(fnlen);
+    memcpy(E.filename,filename,fnlen);
+
+    int fd = open(filename,O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror("Opening file");
+            exit(1);
+        }
+        return 1;
+    }
+
+    /* Regular files are mapped in memory, so that no line is copied
+     * until it gets modified. Otherwise fall back to read them. */
+    if (editorOpenMapped(fd) == 0) {
+        E.dirty = 0;
+        return 0;
+    }
+
+    fp = fdopen(fd,"r");
+    if (!fp) {
+        perror("Opening file");
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while((linelen = getline(&line,&linecap,fp)) != -1) {
+        if (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
+            line[--linelen] = '\0';
+        editorInsertRow(E.numrows,line,linelen);
+    }
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    return 0;
+}
+
+/* ============================ Saving the file ============================= */
+
+/* The file is never rewritten in place: its new content is written to a
+ * temporary file in the same directory, that is synced on disk and then
+ * renamed over the original one. A crash or a full disk in the middle of
+ * the save leaves the original file untouched. Only when the temporary
+ * file can't be created, because the directory is not writable, the file
+ * is truncated and rewritten in place, without this protection. Since
+ * the unmodified rows are read from the file, they are first moved to a
+ * copy of it in memory, see editorMapDetach().
+ *
+ * The content is taken as a snapshot of the rows: a list of memory
+ * segments pointing to the unmodified rows inside the backing store,
+ * where runs of consecutive lines become a single segment, and to a copy
+ * of just the modified rows. The snapshot is streamed with writev(2), so
+ * the file is never assembled in memory. Since the snapshot does not
+ * reference the rows, big files are saved by a background thread while
+ * the user keeps editing. */
+
+#define KILO_SAVE_BATCH (1024*1024) /* Max bytes per writev() call. */
+#define KILO_SAVE_IOV 64            /* Max segments per writev() call. */
+#define KILO_SAVE_ASYNC (4*1024*1024) /* Bigger files are saved in bg. */
+
+struct saveJob {
+    struct iovec *seg;  /* File content as a list of memory segments. */
+    int nseg;
+    char *copy;         /* Copy of the modified rows, segments point here. */
+    size_t total;       /* Bytes to write. */
+    size_t written;     /* Bytes written so far. */
+    char *path;         /* The file to replace, with symlinks resolved. */
+    char *tmp;          /* Temporary file in the same directory, or NULL
+                           if the file is rewritten in place. */
+    int fd;             /* Temporary file descriptor, or the file's one. */
+    int err;            /* errno of the failed operation, or 0. */
+    int dirty;          /* E.dirty when the snapshot was taken. */
+    int mark;           /* Swap journal mark of the snapshot. */
+    int running;        /* Worker thread started and not yet joined. */
+    pthread_t thread;
+};
+
+/* Free a save job, removing the temporary file if still there. */
+void saveFree(struct saveJob *job) {
+    if (job->fd != -1) close(job->fd);
+    if (job->tmp && job->err) unlink(job->tmp);
+    free(job->seg);
+    free(job->copy);
+    free(job->path);
+    free(job->tmp);
+    free(job);
+}
+
+/* Append a segment to the snapshot, merging it with the previous one when
+ * contiguous in memory. */
+static void saveAddSeg(struct saveJob *job, const char *p, size_t len) {
+    struct iovec *last = job->nseg ? job->seg+job->nseg-1 : NULL;
+    if (last && (char*)last->iov_base+last->iov_len == p) {
+        last->iov_len += len;
+    } else {
+        job->seg[job->nseg].iov_base = (char*)p;
+        job->seg[job->nseg].iov_len = len;
+        job->nseg++;
+    }
+    job->total += len;
+}
+
+/* Create the temporary file, with the same permissions and owner of the
+ * file it will replace, or open the file itself if it must be rewritten
+ * in place, and take a snapshot of the rows. Returns NULL on error, with
+ * errno set. */
+struct saveJob *saveSnapshot(void) {
+    static const char *newline = "\n";
+    struct saveJob *job = kcalloc(1,sizeof(*job));
+    size_t copylen = 0;
+    int nseg = 0;
+    rowsNode *leaf;
+    erow *row;
+
+    if (job == NULL) return NULL;
+    job->fd = -1;
+    job->dirty = E.dirty;
+    editorRowsFlatten();
+
+    /* Resolve symlinks, so that the link target is the file replaced. */
+    struct stat sb;
+    int exists = 0;
+    job->path = realpath(E.filename,NULL);
+    if (job->path == NULL) {
+        if (errno != ENOENT) goto err;
+        job->path = strdup(E.filename);
+        if (job->path == NULL) goto err;
+    } else if (stat(job->path,&sb) == 0) {
+        exists = 1;
+    }
+
+    /* The temporary file is "dir/.name.XXXXXX". */
+    char *slash = strrchr(job->path,'/');
+    int dirlen = slash ? slash-job->path+1 : 0;
+    size_t tmplen = strlen(job->path)+9;
+    job->tmp = kmalloc(tmplen);
+    if (job->tmp == NULL) goto err;
+    snprintf(job->tmp,tmplen,"%.*s.%s.XXXXXX",dirlen,job->path,
+        job->path+dirlen);
+    job->fd = mkstemp(job->tmp);
+    if (job->fd == -1) {
+        free(job->tmp);
+        job->tmp = NULL;
+        if (errno != EACCES && errno != EPERM && errno != EROFS) goto err;
+        /* The directory is not writable: rewrite the file in place. */
+        job->fd = open(job->path,O_WRONLY|O_CREAT,0644);
+        if (job->fd == -1 || editorMapDetach() == -1) goto err;
+    } else if (exists) {
+        if (fchown(job->fd,sb.st_uid,sb.st_gid) == -1) {
+            /* Not allowed to give the file away: it stays ours. */
+        }
+        if (fchmod(job->fd,sb.st_mode & 07777) == -1) goto err;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        if (fchmod(job->fd,0644 & ~mask) == -1) goto err;
+    }
+
+    /* First pass: size the segments table and the copy of the modified
+     * rows, so that both are allocated once and never moved. The leaves
+     * never loaded are just their text, that is in the backing store. */
+    for (leaf = rowsFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->row == NULL) {
+            nseg += 2;
+            continue;
+        }
+        for (row = leaf->row; row < leaf->row+leaf->count; row++) {
+            if (row->mapped) {
+                nseg += 2;
+            } else {
+                nseg++;
+                copylen += row->size+1;
+            }
+        }
+    }
+    job->seg = kmalloc(sizeof(struct iovec)*(nseg+1));
+    job->copy = kmalloc(copylen+1);
+    if (job->seg == NULL || job->copy == NULL) goto err;
+
+    /* Second pass: rows inside the backing store are referenced together
+     * with their newline when it is there, modified rows are copied. */
+    char *p = job->copy;
+    for (leaf = rowsFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->row == NULL) {
+            const char *end = leaf->text+leaf->textlen-1;
+            int nl = end < E.map+E.mapsize && *end == '\n';
+            saveAddSeg(job,leaf->text,leaf->textlen-!nl);
+            if (!nl) saveAddSeg(job,newline,1);
+            continue;
+        }
+        for (row = leaf->row; row < leaf->row+leaf->count; row++) {
+            if (row->mapped) {
+                int nl = row->chars+row->size < E.map+E.mapsize &&
+                         row->chars[row->size] == '\n';
+                saveAddSeg(job,row->chars,row->size+nl);
+                if (!nl) saveAddSeg(job,newline,1);
+            } else {
+                memcpy(p,row->chars,row->size);
+                p[row->size] = '\n';
+                saveAddSeg(job,p,row->size+1);
+                p += row->size+1;
+            }
+        }
+    }
+
+    return job;
+
+err:
+    job->err = errno;
+    nseg = job->err;
+    saveFree(job);
+    errno = nseg;
+    return NULL;
+}
+
+/* Write the snapshot to the temporary file, sync it and rename it over
+ * the original file. Returns 0 on success, otherwise -1 with job->err
+ * set. Called by the worker thread for background saves. */
+int saveWrite(struct saveJob *job) {
+    struct iovec iov[KILO_SAVE_IOV];
+    int seg = 0;
+    size_t off = 0; /* Offset inside the current segment. */
+
+    if (job->tmp == NULL && ftruncate(job->fd,job->total) == -1) goto err;
+    while(seg < job->nseg) {
+        /* Fill a batch starting at the current position. */
+        int cnt = 0;
+        size_t batch = 0;
+        for (int j = seg; j < job->nseg && cnt < KILO_SAVE_IOV &&
+                          batch < KILO_SAVE_BATCH; j++)
+        {
+            size_t skip = j == seg ? off : 0;
+            size_t len = job->seg[j].iov_len - skip;
+            if (len > KILO_SAVE_BATCH-batch) len = KILO_SAVE_BATCH-batch;
+            iov[cnt].iov_base = (char*)job->seg[j].iov_base+skip;
+            iov[cnt].iov_len = len;
+            batch += len;
+            cnt++;
+        }
+
+        ssize_t nwritten = writev(job->fd,iov,cnt);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            goto err;
+        }
+
+        /* Advance by what was actually written, that may be less than
+         * the batch. */
+        size_t adv = nwritten;
+        while(adv) {
+            size_t left = job->seg[seg].iov_len - off;
+            if (adv < left) {
+                off += adv;
+                break;
+            }
+            adv -= left;
+            seg++;
+            off = 0;
+        }
+        size_t written = job->written;
+        __atomic_store_n(&job->written,written+nwritten,__ATOMIC_RELAXED);
+        if ((written+nwritten)*100/job->total != written*100/job->total)
+            editorPostRefresh();
+    }
+
+    if (fsync(job->fd) == -1) goto err;
+    if (close(job->fd) == -1) {
+        job->fd = -1;
+        goto err;
+    }
+    job->fd = -1;
+    if (job->tmp == NULL) return 0;
+    if (rename(job->tmp,job->path) == -1) goto err;
+
+    /* Make the rename itself durable. */
+    char *slash = strrchr(job->path,'/');
+    if (slash) *slash = '\0';
+    int dirfd = open(slash ? (*job->path ? job->path : "/") : ".",O_RDONLY);
+    if (slash) *slash = '/';
+    if (dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    return 0;
+
+err:
+    job->err = errno;
+    return -1;
+}
+
+/* Complete a save job, waiting for the worker if still running, report
+ * the result and release the job. If the rows were not modified in the
+ * meantime they now match the file on disk: map it and use it as backing
+ * store, so that the rows no longer need the heap copies. Returns 0 on
+ * success, 1 on error. */
+int saveFinish(struct saveJob *job) {
+    int retval = 1;
+
+    if (job->running) pthread_join(job->thread,NULL);
+    if (E.save == job) E.save = NULL;
+    if (job->err) {
+        editorSetStatusMessage("Can't save! I/O error: %s",
+            strerror(job->err));
+        goto done;
+    }
+
+    retval = 0;
+    if (E.dirty != job->dirty) {
+        editorSetStatusMessage("%zu bytes written on disk "
+                               "(modified while saving)", job->total);
+        journalSaved(job->mark,1);
+        goto done;
+    }
+    /* Use the new file as backing store, unless it may be truncated by
+     * someone else while we map it, see kilo -f. */
+    int fd = job->total && !E.follow ? open(job->path,O_RDONLY) : -1;
+    if (fd != -1) {
+        char *map = mmap(NULL,job->total,PROT_READ,MAP_PRIVATE,fd,0);
+        if (map != MAP_FAILED) {
+            editorRowsRebase(map,job->total);
+            editorMapGuard(fd);
+        } else {
+            close(fd);
+        }
+    }
+    E.dirty = 0;
+    journalSaved(job->mark,0);
+    editorSetStatusMessage("%zu bytes written on disk", job->total);
+
+done:
+    saveFree(job);
+    return retval;
+}
+
+/* Main loop event posted by the worker when done. */
+static void editorSaveDone(void *unused) {
+    (void)unused;
+    if (E.save) saveFinish(E.save);
+}
+
+static void *saveWorker(void *arg) {
+    struct saveJob *job = arg;
+    saveWrite(job);
+    editorPostEvent(editorSaveDone,NULL);
+    return NULL;
+}
+
+/* Save the current file on disk. Return 0 on success, 1 on error. Big
+ * files are saved in background: in that case 0 means the save was
+ * started: the progress is shown in the status bar, and the result is
+ * reported when the worker posts its completion to the main loop. */
+int editorSave(void) {
+    if (E.save) {
+        editorSetStatusMessage("A save is already in progress");
+        return 1;
+    }
+
+    editorMapFinish();
+    struct saveJob *job = saveSnapshot();
+    if (job == NULL) {
+        editorSetStatusMessage("Can't save! I/O error: %s",strerror(errno));
+        return 1;
+    }
+    job->mark = journalMark();
+    if (job->total >= KILO_SAVE_ASYNC &&
+        pthread_create(&job->thread,NULL,saveWorker,job) == 0)
+    {
+        job->running = 1;
+        E.save = job;
+        return 0;
+    }
+    saveWrite(job);
+    return saveFinish(job);
+}
+
+/* ============================= Instrumentation ============================ */
+
+/* Counters and histograms of the hot paths are kept in E.stats, and can
+ * be seen with Ctrl-T or dumped to the file named by the KILO_STATS
+ * environment variable at exit. Counters updated by background threads
+ * are only accessed with atomic operations.
+ *
+ * Histograms are log-linear, like HDR histograms: values are grouped by
+ * their power of two, and every group is split into STATS_SUB buckets,
+ * so the error is at most 1/STATS_SUB of the value whatever its
+ * magnitude, and recording a value is just a few instructions. */
+#define STATS_LINES 6   /* Lines of the overlay. */
+
+/* Return the bucket of the value 'v'. */
+static int statsBucket(long long v) {
+    if (v < STATS_SUB) return v < 0 ? 0 : v;
+    int e = 63-__builtin_clzll(v);
+    return (e-STATS_SUB_BITS+1)*STATS_SUB +
+           ((v >> (e-STATS_SUB_BITS)) & (STATS_SUB-1));
+}
+
+/* Return the lowest value of bucket 'b'. */
+static long long statsBucketLow(int b) {
+    if (b < STATS_SUB) return b;
+    int e = b/STATS_SUB+STATS_SUB_BITS-1;
+    return (long long)(STATS_SUB+b%STATS_SUB) << (e-STATS_SUB_BITS);
+}
+
+void statsRecord(statsHist *h, long long v) {
+    h->bucket[statsBucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* Return the value below which 'pct' percent of the values are, with
+ * the resolution of the buckets. */
+long long statsPercentile(statsHist *h, double pct) {
+    double t = h->count*pct/100;
+    long long seen = 0, target = t;
+    if (target < t) target++;
+    if (h->count == 0) return 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= target) {
+            long long high = b+1 < STATS_BUCKETS ? statsBucketLow(b+1)-1 :
+                                                   h->max;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Input was read from the terminal: start the input to frame clock,
+ * unless it is already running for input not yet answered. */
+void statsInputArrived(void) {
+    if (E.stats.input_time == 0) E.stats.input_time = ustime();
+}
+
+/* Called after every screen refresh. */
+void statsFrameDone(void) {
+    struct editorStats *st = &E.stats;
+    if (st->input_time) {
+        statsRecord(&st->latency,ustime()-st->input_time);
+        st->input_time = 0;
+    }
+    if (st->frame_dirty != E.dirty) {
+        statsRecord(&st->edit_lexed,st->frame_lexed);
+        st->frame_dirty = E.dirty;
+    }
+    st->frame_lexed = 0;
+}
+
+static void statsDumpHist(FILE *fp, const char *name, statsHist *h) {
+    fprintf(fp,"%s: count %lld mean %lld p50 %lld p90 %lld p99 %lld "
+               "p99.9 %lld max %lld\n", name, h->count,
+               h->count ? h->sum/h->count : 0, statsPercentile(h,50),
+               statsPercentile(h,90), statsPercentile(h,99),
+               statsPercentile(h,99.9), h->max);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (h->bucket[b] == 0) continue;
+        fprintf(fp,"  %lld %lld\n",statsBucketLow(b),h->bucket[b]);
+    }
+}
+
+/* Write the stats to the file named by KILO_STATS. Called at exit. */
+void statsDump(void) {
+    struct editorStats *st = &E.stats;
+    FILE *fp = fopen(getenv("KILO_STATS"),"w");
+    if (fp == NULL) return;
+    fprintf(fp,"keys: %lld\n",st->keys);
+    fprintf(fp,"frames: %lld\n",st->frames);
+    fprintf(fp,"bytes: %lld\n",st->bytes);
+    fprintf(fp,"allocs: %lld\n",__atomic_load_n(&st->allocs,__ATOMIC_RELAXED));
+    fprintf(fp,"reallocs: %lld\n",
+        __atomic_load_n(&st->reallocs,__ATOMIC_RELAXED));
+    fprintf(fp,"rows_lexed: %lld\n",st->lexed);
+    fprintf(fp,"rows_lexed_bg: %lld\n",
+        __atomic_load_n(&st->lexed_bg,__ATOMIC_RELAXED));
+    fprintf(fp,"search_bytes: %lld\n",
+        __atomic_load_n(&st->search_bytes,__ATOMIC_RELAXED));
+    statsDumpHist(fp,"input_to_frame_us",&st->latency);
+    statsDumpHist(fp,"frame_write_us",&st->write_time);
+    statsDumpHist(fp,"frame_bytes",&st->frame_size);
+    statsDumpHist(fp,"rows_lexed_per_edit",&st->edit_lexed);
+    fclose(fp);
+}
+
+/* ============================= Terminal update ============================ */
+
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated string where we can append to. This is useful in order to
+ * write all the escape sequences in a buffer and flush them to the standard
+ * output in a single call, to avoid flickering effects. The buffer grows
+ * geometrically, and the one used for frames is reused across refreshes
+ * so that in steady state no allocation happens at all. */
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL,0,0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (len == 0) return;
+    if (ab->len+len > ab->cap) {
+        int cap = ab->cap ? ab->cap*2 : 4096;
+        while(cap < ab->len+len) cap *= 2;
+        char *new = krealloc(ab->b,cap);
+        if (new == NULL) return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(ab->b+ab->len,s,len);
+    ab->len += len;
+}
+
+/* Append the decimal representation of 'n', that must be >= 0. */
+void abAppendInt(struct abuf *ab, int n) {
+    char buf[16];
+    int j = sizeof(buf);
+    do {
+        buf[--j] = '0'+n%10;
+        n /= 10;
+    } while(n);
+    abAppend(ab,buf+j,sizeof(buf)-j);
+}
+
+/* Append the sequence moving the cursor at row 'y' column 'x' (0-based). */
+void abAppendMove(struct abuf *ab, int y, int x) {
+    abAppend(ab,"\x1b[",2);
+    abAppendInt(ab,y+1);
+    abAppend(ab,";",1);
+    abAppendInt(ab,x+1);
+    abAppend(ab,"H",1);
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/* The screen is composed in a back buffer holding the character and the
+ * attribute of every cell, and compared with the front buffer, that is
+ * what the terminal is currently showing: only the cells that changed are
+ * written, with the minimum cursor moves and SGR changes. */
+#define ATTR_REVERSE 0x80   /* Attribute flag: reverse video. */
+#define SCREEN_MAX_GAP 6    /* Unchanged cells we rewrite to avoid a move. */
+
+/* Cells holding ASCII chars store them directly. The others are marked
+ * with one of these, that can't be ASCII chars: a glyph has its UTF-8
+ * bytes (plus the ones of the combining marks following it, as long as
+ * they fit) in the 'glyphs' array, and when it is double width the next
+ * cell is CELL_WIDE. */
+#define CELL_GLYPH '\x80'
+#define CELL_WIDE '\x81'
+
+/* Resize the screen buffers if the terminal size changed. A resize (and
+ * the first frame) forces a full redraw. */
+void screenResize(void) {
+    int rows = E.screenrows+2, cols = E.screencols;
+
+    if (E.back.rows == rows && E.back.cols == cols) return;
+    for (int j = 0; j < 2; j++) {
+        screenBuf *sb = j ? &E.back : &E.front;
+        sb->rows = rows;
+        sb->cols = cols;
+        sb->chars = krealloc(sb->chars,rows*cols);
+        sb->attrs = krealloc(sb->attrs,rows*cols);
+        sb->glyphs = krealloc(sb->glyphs,rows*cols*sizeof(uint64_t));
+    }
+    E.front_valid = 0;
+}
+
+/* Write the rendered text 's' of 'len' bytes at row 'y' of the back buffer
+ * from column 'x', after skipping its first 'skip' columns, and clipping
+ * at the right margin. Every glyph gets the attribute in 'hl' of its first
+ * byte, or 'attr' if 'hl' is NULL. Non printable chars and invalid UTF-8
+ * are shown as a symbol in reverse video. */
+void screenPutText(int y, int x, const char *s, int len,
+                   const unsigned char *hl, int attr, int skip)
+{
+    screenBuf *b = &E.back;
+    char *c = b->chars+y*b->cols;
+    unsigned char *a = b->attrs+y*b->cols;
+    uint64_t *g = b->glyphs+y*b->cols;
+    int x0 = x, j = 0;
+
+    /* Don't leave half of a double width glyph. */
+    if (x < b->cols && c[x] == CELL_WIDE) c[x-1] = ' ';
+    while(j < len && x < b->cols) {
+        unsigned char uc = s[j];
+        int at = hl ? hl[j] : attr;
+        int cp = uc, n = 1, w = 1;
+
+        if (uc >= 0x80) {
+            n = utf8Decode(s+j,len-j,&cp);
+            w = utf8Width(cp);
+        }
+        if (skip > 0) {
+            /* A double width glyph cut by the left edge is a space. */
+            if (w > skip) {
+                c[x] = ' ';
+                a[x++] = at;
+            }
+            skip = w > skip ? 0 : skip-w;
+        } else if (uc < 0x80 || cp == -1) {
+            if (uc >= 0x80) {
+                c[x] = '?';
+                a[x] = HL_NONPRINT|ATTR_REVERSE;
+            } else if (uc < 32 || uc == 127) {
+                c[x] = uc <= 26 ? '@'+uc : '?';
+                a[x] = HL_NONPRINT|ATTR_REVERSE;
+            } else {
+                c[x] = uc;
+                a[x] = at;
+            }
+            x++;
+        } else if (w == 0) {
+            /* Combining mark: add it to the previous glyph. */
+            int p = x-1;
+            if (p > x0 && c[p] == CELL_WIDE) p--;
+            if (p >= x0) {
+                char *cell = (char*)(g+p);
+                int used = 0;
+                if (c[p] != CELL_GLYPH) {
+                    g[p] = 0;
+                    cell[0] = c[p];
+                    c[p] = CELL_GLYPH;
+                }
+                while(used < 8 && cell[used]) used++;
+                if (used+n <= 8) memcpy(cell+used,s+j,n);
+            }
+        } else if (x+w > b->cols) {
+            /* A double width glyph not fitting at the right edge. */
+            c[x] = ' ';
+            a[x++] = at;
+        } else {
+            c[x] = CELL_GLYPH;
+            g[x] = 0;
+            memcpy(g+x,s+j,n);
+            a[x++] = at;
+            if (w == 2) {
+                c[x] = CELL_WIDE;
+                a[x++] = at;
+            }
+        }
+        j += n;
+    }
+    if (x < b->cols && c[x] == CELL_WIDE) c[x] = ' ';
+}
+
+/* Write 'len' chars at row 'y' column 'x' of the back buffer, clipping
+ * at the right margin. */
+void screenPut(int y, int x, const char *s, int len, int attr) {
+    if (utf8AsciiPrefix(s,len) < (size_t)len) {
+        screenPutText(y,x,s,len,NULL,attr,0);
+        return;
+    }
+    if (x+len > E.back.cols) len = E.back.cols-x;
+    if (len <= 0) return;
+    char *c = E.back.chars+y*E.back.cols;
+    if (c[x] == CELL_WIDE) c[x-1] = ' ';
+    if (x+len < E.back.cols && c[x+len] == CELL_WIDE) c[x+len] = ' ';
+    memcpy(c+x,s,len);
+    memset(E.back.attrs+y*E.back.cols+x,attr,len);
+}
+
+/* Foreground color sequence for every syntax highlight class, computed
+ * once by screenInitColors() so that frames need no formatting. */
+#define HL_CLASSES 16
+static char screenColorSeq[HL_CLASSES][6];
+
+void screenInitColors(void) {
+    for (int hl = 0; hl < HL_CLASSES; hl++) {
+        int color = (hl == HL_NORMAL || hl == HL_NONPRINT) ? 39 :
+                    editorSyntaxToColor(hl);
+        snprintf(screenColorSeq[hl],sizeof(screenColorSeq[hl]),
+            "\x1b[%dm",color);
+    }
+}
+
+/* The frame output buffer, reused across refreshes. */
+static struct abuf screenOut = ABUF_INIT;
+
+/* Append to 'ab' the SGR sequence to switch from attribute 'from' (or
+ * -1 if unknown) to attribute 'to'. */
+void screenSetAttr(struct abuf *ab, int from, int to) {
+    if (from == -1 || ((from & ATTR_REVERSE) && !(to & ATTR_REVERSE))) {
+        abAppend(ab,"\x1b[0m",4);
+        from = 0;
+    }
+    if ((to & ATTR_REVERSE) && !(from & ATTR_REVERSE))
+        abAppend(ab,"\x1b[7m",4);
+    if ((to & ~ATTR_REVERSE) != (from & ~ATTR_REVERSE))
+        abAppend(ab,screenColorSeq[to & ~ATTR_REVERSE],5);
+}
+
+/* Append the content of the cells 'from' to 'to'-1 of a row. */
+static void screenAppendCells(struct abuf *ab, const char *c,
+                              const uint64_t *g, int from, int to)
+{
+    while(from < to) {
+        int j = from;
+        while(j < to && (unsigned char)c[j] < 0x80) j++;
+        abAppend(ab,c+from,j-from);
+        if (j == to) break;
+        if (c[j] == CELL_GLYPH) {
+            const char *cell = (const char*)(g+j);
+            int n = 0;
+            while(n < 8 && cell[n]) n++;
+            abAppend(ab,cell,n);
+        }
+        from = j+1; /* The terminal already moved past CELL_WIDE cells. */
+    }
+}
+
+/* Emit the escape sequences to turn the front buffer into the back
+ * buffer, then make the back buffer the new front buffer. */
+void screenFlush(struct abuf *ab) {
+    screenBuf *f = &E.front, *b = &E.back;
+    int cols = b->cols;
+    int ty = -1, tx = -1;   /* Terminal cursor position, -1 if unknown. */
+    int attr = -1;          /* Terminal current attribute, -1 if unknown. */
+
+    if (!E.front_valid) {
+        /* Start from a clear screen. */
+        abAppend(ab,"\x1b[0m\x1b[2J",8);
+        memset(f->chars,' ',f->rows*cols);
+        memset(f->attrs,0,f->rows*cols);
+        attr = 0;
+        E.front_valid = 1;
+    }
+
+#define CHANGED(j) (fc[j] != bc[j] || fa[j] != ba[j] || \
+                    (bc[j] == CELL_GLYPH && fg[j] != bg[j]))
+    for (int y = 0; y < b->rows; y++) {
+        char *fc = f->chars+y*cols, *bc = b->chars+y*cols;
+        unsigned char *fa = f->attrs+y*cols, *ba = b->attrs+y*cols;
+        uint64_t *fg = f->glyphs+y*cols, *bg = b->glyphs+y*cols;
+        int x = 0;
+
+        while(x < cols) {
+            if (!CHANGED(x)) {
+                x++;
+                continue;
+            }
+
+            /* Find the end of the changed span, including short runs of
+             * unchanged cells that are cheaper to rewrite than to skip
+             * with a cursor move, and the right half of a double width
+             * glyph ending it. */
+            int end = x+1, j;
+            for (j = x+1; j < cols && j-end < SCREEN_MAX_GAP; j++)
+                if (CHANGED(j)) end = j+1;
+            if (end < cols && bc[end] == CELL_WIDE) end++;
+
+            /* If the rest of the row is blank just erase it. */
+            for (j = x; j < cols; j++)
+                if (bc[j] != ' ' || ba[j] != 0) break;
+            int blank = j == cols;
+
+            if (ty != y || tx != x) abAppendMove(ab,y,x);
+            if (blank) {
+                if (attr != 0) screenSetAttr(ab,attr,0);
+                attr = 0;
+                abAppend(ab,"\x1b[0K",4);
+                ty = y;
+                tx = x;
+                break;
+            }
+            /* Emit the span as runs of cells with the same attribute,
+             * each with a single copy. */
+            for (j = x; j < end; ) {
+                int run = j+1;
+                while(run < end && ba[run] == ba[j]) run++;
+                if (ba[j] != attr) {
+                    screenSetAttr(ab,attr,ba[j]);
+                    attr = ba[j];
+                }
+                screenAppendCells(ab,bc,bg,j,run);
+                j = run;
+            }
+            ty = y;
+            /* After writing the last column the cursor position depends
+             * on the terminal, so consider it unknown. */
+            tx = end < cols ? end : -1;
+            x = end;
+        }
+    }
+#undef CHANGED
+    if (attr != 0 && attr != -1) abAppend(ab,"\x1b[0m",4);
+
+    screenBuf tmp = E.front;
+    E.front = E.back;
+    E.back = tmp;
+}
+
+/* Replace the non printable chars of 'len' cells of the back buffer, whose
+ * attributes are the highlight classes, with a symbol in reverse video. */
+void editorDrawNonprint(char *c, unsigned char *a, int len) {
+    unsigned char *np = a;
+    while((np = memchr(np,HL_NONPRINT,len-(np-a))) != NULL) {
+        unsigned char uc = c[np-a];
+        c[np-a] = uc <= 26 ? '@'+uc : '?';
+        *np++ = HL_NONPRINT|ATTR_REVERSE;
+    }
+}
+
+/* Draw at screen row 'y' a rendered row containing UTF-8, starting from
+ * the column index entry before E.coloff. */
+void editorDrawUtf8(int y, rowCache *rc) {
+    static unsigned char *hl;
+    static int cap;
+    colIndex *e = colIndexFind(rc,offsetof(colIndex,col),E.coloff);
+    int skip = E.coloff-e->col;
+
+    /* A column takes up to 8 bytes (TABs take one per column, but zero
+     * width chars none), rows going further are cut. */
+    int len = rc->rsize-e->rb;
+    if (len > (skip+E.screencols)*8) len = (skip+E.screencols)*8;
+    if (len > cap) {
+        cap = len;
+        hl = krealloc(hl,cap);
+    }
+    if (rc->hl) hlUnpack(hl,rc->hl,e->rb,len);
+    screenPutText(y,0,rc->render+e->rb,len,rc->hl ? hl : NULL,HL_NORMAL,skip);
+}
+
+/* Draw the rows of the file in the back buffer. */
+void editorDrawRows(void) {
+    int budget = KILO_HL_SYNC_ROWS;
+
+    for (int y = 0; y < E.screenrows; y++) {
+        int filerow = E.rowoff+y;
+        erow *r = editorRowReady(filerow,&budget);
+
+        if (r == NULL) {
+            if (E.numrows == 0 && y == E.screenrows/3) {
+                char welcome[80];
+                int welcomelen = snprintf(welcome,sizeof(welcome),
+                    "Kilo editor -- verison %s", KILO_VERSION);
+                int padding = (E.screencols-welcomelen)/2;
+                if (padding < 1) padding = 1;
+                screenPut(y,0,"~",1,0);
+                screenPut(y,padding,welcome,welcomelen,0);
+            } else {
+                screenPut(y,0,"~",1,0);
+            }
+            continue;
+        }
+
+        /* Long rows are rendered starting from column wrx. */
+        rowCache *rc = r->cache;
+        if (rc->nidx) {
+            editorDrawUtf8(y,rc);
+            if (E.find.active) editorDrawMatches(y,filerow,r);
+            continue;
+        }
+        int off = E.coloff - (r->ext ? r->ext->wrx : 0);
+        int len = rc->rsize - off;
+        if (len <= 0) continue;
+        if (len > E.screencols) len = E.screencols;
+
+        /* The highlight classes are directly the cell attributes, so the
+         * visible part of the row is copied as it is and its highlight
+         * unpacked, then non printable characters are replaced by a symbol
+         * in reverse video. */
+        char *c = E.back.chars+y*E.back.cols;
+        unsigned char *a = E.back.attrs+y*E.back.cols;
+        memcpy(c,rc->render+off,len);
+        if (rc->hl) {
+            hlUnpack(a,rc->hl,off,len);
+            editorDrawNonprint(c,a,len);
+        } else {
+            /* Highlight not ready yet: plain text. */
+            for (int j = 0; j < len; j++) {
+                unsigned char uc = c[j];
+                if (isprint(uc)) continue;
+                c[j] = uc <= 26 ? '@'+uc : '?';
+                a[j] = HL_NONPRINT|ATTR_REVERSE;
+            }
+        }
+        if (E.find.active) editorDrawMatches(y,filerow,r);
+    }
+}
+
+/* Draw the two status rows in the back buffer. */
+void editorDrawStatus(void) {
+    int y = E.screenrows;
+    char status[80], rstatus[80];
+    char loading[32] = "";
+    if (E.maploaded < E.mapsize)
+        snprintf(loading,sizeof(loading),"+ (loading %d%%)",
+                 (int)(E.maploaded*100/E.mapsize));
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s",
+        E.filename, E.numrows, loading, E.dirty ? "(modified)" : "");
+    int rlen;
+    if (E.pager) {
+        pagerStatus(status,sizeof(status),rstatus,sizeof(rstatus));
+        len = strlen(status);
+        rlen = strlen(rstatus);
+    } else if (E.save) {
+        size_t written = __atomic_load_n(&E.save->written,__ATOMIC_RELAXED);
+        rlen = snprintf(rstatus, sizeof(rstatus), "saving %d%% | %d/%d",
+            (int)(written*100/E.save->total),E.rowoff+E.cy+1,E.numrows);
+    } else {
+        rlen = snprintf(rstatus, sizeof(rstatus),
+            "%d/%d",E.rowoff+E.cy+1,E.numrows);
+    }
+    if (len > E.screencols) len = E.screencols;
+
+    /* First row: file info in reverse video. */
+    memset(E.back.attrs+y*E.screencols,ATTR_REVERSE,E.screencols);
+    screenPut(y,0,status,len,ATTR_REVERSE);
+    if (len+rlen <= E.screencols)
+        screenPut(y,E.screencols-rlen,rstatus,rlen,ATTR_REVERSE);
+
+    /* Second row: the status message, cleared by a timer. */
+    int msglen = strlen(E.statusmsg);
+    if (msglen) screenPut(y+1,0,E.statusmsg,msglen,0);
+}
+
+/* Draw the stats overlay just above the status bar, see Ctrl-T. */
+void editorDrawStats(void) {
+    struct editorStats *st = &E.stats;
+    statsHist *hist[] = {&st->latency,&st->write_time,&st->frame_size,
+                         &st->edit_lexed};
+    const char *name[] = {"input to frame us","frame write us",
+                          "frame bytes","rows lexed per edit"};
+    char line[STATS_LINES][128];
+    int n = 0;
+
+    snprintf(line[n++],sizeof(line[0]),
+        " keys %lld  frames %lld  bytes %lld  allocs %lld (reallocs %lld)",
+        st->keys, st->frames, st->bytes,
+        __atomic_load_n(&st->allocs,__ATOMIC_RELAXED),
+        __atomic_load_n(&st->reallocs,__ATOMIC_RELAXED));
+    snprintf(line[n++],sizeof(line[0]),
+        " rows lexed %lld + %lld in background  search bytes %lld",
+        st->lexed, __atomic_load_n(&st->lexed_bg,__ATOMIC_RELAXED),
+        __atomic_load_n(&st->search_bytes,__ATOMIC_RELAXED));
+    for (int j = 0; j < 4; j++) {
+        statsHist *h = hist[j];
+        snprintf(line[n++],sizeof(line[0]),
+            " %-20s p50 %-7lld p90 %-7lld p99 %-7lld max %lld",name[j],
+            statsPercentile(h,50),statsPercentile(h,90),
+            statsPercentile(h,99),h->max);
+    }
+
+    int y = E.screenrows-n;
+    if (y < 0) return;
+    for (int j = 0; j < n; j++, y++) {
+        int len = strlen(line[j]);
+        if (len > E.screencols) len = E.screencols;
+        memset(E.back.chars+y*E.back.cols,' ',E.back.cols);
+        memset(E.back.attrs+y*E.back.cols,ATTR_REVERSE,E.back.cols);
+        screenPut(y,0,line[j],len,ATTR_REVERSE);
+    }
+}
+
+/* This function updates the screen using VT100 escape characters
+ * starting from the logical state of the editor in the global state 'E'. */
+void editorRefreshScreen(void) {
+    struct abuf *ab = &screenOut;
+
+    editorSyntaxPoll();
+    editorMapCheck();
+    screenResize();
+    int cx = E.pager ? 1 : editorScroll()-E.coloff+1;
+    memset(E.back.chars,' ',E.back.rows*E.back.cols);
+    memset(E.back.attrs,0,E.back.rows*E.back.cols);
+    if (E.pager)
+        pagerDrawRows();
+    else
+        editorDrawRows();
+    editorDrawStatus();
+    if (E.stats_overlay) editorDrawStats();
+
+    /* Put cursor at its current position. */
+    ab->len = 0;
+    abAppend(ab,"\x1b[?25l",6); /* Hide cursor. */
+    screenFlush(ab);
+    if (ab->len == 6 && E.cursor_y == E.cy && E.cursor_x == cx) {
+        /* Nothing changed on screen. */
+        statsFrameDone();
+        return;
+    }
+    abAppendMove(ab,E.cy,cx-1);
+    abAppend(ab,"\x1b[?25h",6); /* Show cursor. */
+    E.cursor_y = E.cy;
+    E.cursor_x = cx;
+    E.stats.frames++;
+    E.stats.frame_bytes = ab->len;
+    E.stats.bytes += ab->len;
+    statsRecord(&E.stats.frame_size,ab->len);
+
+    /* Flush the whole frame with a single write(2) when possible. In
+     * benchmark mode the frame is only measured. */
+    long long start = ustime();
+    char *p = ab->b;
+    int left = E.bench ? 0 : ab->len;
+    while(left) {
+        ssize_t nwritten = write(STDOUT_FILENO,p,left);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        p += nwritten;
+        left -= nwritten;
+    }
+    statsRecord(&E.stats.write_time,ustime()-start);
+    statsFrameDone();
+}
+
+/* Timer callback: the status message is shown for a few seconds. */
+void editorStatusExpired(void *unused) {
+    (void)unused;
+    E.statusmsg[0] = '\0';
+    E.statusmsg_timer = -1;
+}
+
+/* Set an editor status message for the second line of the status, at the
+ * end of the screen. */
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap,fmt);
+    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
+    va_end(ap);
+    editorDelTimer(E.statusmsg_timer);
+    E.statusmsg_timer = editorAddTimer(KILO_STATUS_TIMEOUT*1000,
+                                       editorStatusExpired,NULL);
+}
+
+/* ============================= Search engine ============================== */
+
+/* The search kernel scans a memory region for the query using the
+ * technique of filtering candidates by their first and last byte: with
+ * SIMD registers we compare 16 or 32 positions at once against the first
+ * byte of the query, and the same positions shifted by len-1 against the
+ * last byte. Only the positions where both match are verified byte by
+ * byte, which for real text is a tiny fraction of the haystack.
+ *
+ * In case insensitive mode the query is stored lowercase and the first
+ * and last bytes are compared against both the lowercase and uppercase
+ * versions. The kernel is selected at runtime the first time a query is
+ * set, depending on what the CPU supports. */
+
+typedef size_t searchKernel(const searchQuery *q, const char *hay,
+                            size_t hlen, size_t pos);
+static searchKernel *searchFind = NULL;
+
+int searchIsWordChar(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static size_t searchScalar(const searchQuery *q, const char *hay,
+                           size_t hlen, size_t pos);
+#if defined(__x86_64__) && defined(__GNUC__)
+static size_t searchSSE2(const searchQuery *q, const char *hay, size_t hlen,
+                         size_t pos);
+static size_t searchAVX2(const searchQuery *q, const char *hay, size_t hlen,
+                         size_t pos);
+#endif
+
+/* Set the query string and flags, precomputing what the kernels need,
+ * or compiling it if it is a regex. The first call also selects the kernel
+ * to use. Returns -1 if the regex is invalid: the query is then empty. */
+int searchSetQuery(searchQuery *q, const char *s, int flags) {
+    size_t j;
+
+    if (searchFind == NULL) {
+        searchFind = searchScalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+        __builtin_cpu_init();
+        searchFind = __builtin_cpu_supports("avx2") ? searchAVX2 : searchSSE2;
+#endif
+    }
+
+    q->len = strlen(s);
+    q->flags = flags;
+    regexFree(q->re);
+    q->re = NULL;
+    if (flags & SEARCH_REGEX) {
+        memcpy(q->s,s,q->len+1);
+        if (q->len && (q->re = regexCompile(s,flags)) == NULL) {
+            q->len = 0;
+            return -1;
+        }
+        return 0;
+    }
+    for (j = 0; j < q->len; j++) {
+        unsigned char c = s[j];
+        q->s[j] = (flags & SEARCH_ICASE) ? tolower(c) : c;
+    }
+    q->s[j] = '\0';
+    if (q->len == 0) return 0;
+    q->first[0] = q->first[1] = q->s[0];
+    q->last[0] = q->last[1] = q->s[q->len-1];
+    if (flags & SEARCH_ICASE) {
+        q->first[1] = toupper(q->first[0]);
+        q->last[1] = toupper(q->last[0]);
+    }
+    return 0;
+}
+
+/* Make 'dst' a copy of the query 'src'. Regexes are compiled again, since
+ * the DFA cache can't be shared between threads. */
+void searchCopyQuery(searchQuery *dst, const searchQuery *src) {
+    regexFree(dst->re);
+    *dst = *src;
+    if (src->re) dst->re = regexCompile(src->s,src->flags);
+    if (src->re && dst->re == NULL) dst->len = 0;
+}
+
+void searchFreeQuery(searchQuery *q) {
+    regexFree(q->re);
+    q->re = NULL;
+    q->len = 0;
+}
+
+/* Verify a candidate match at 'pos', given that the first and last bytes
+ * already matched. Returns 1 if it is a match, 0 otherwise. */
+static int searchVerify(const searchQuery *q, const char *hay, size_t hlen,
+                        size_t pos)
+{
+    const char *p = hay+pos;
+    size_t j;
+
+    if (q->flags & SEARCH_ICASE) {
+        for (j = 1; j+1 < q->len; j++)
+            if (tolower((unsigned char)p[j]) != (unsigned char)q->s[j])
+                return 0;
+    } else if (q->len > 2 && memcmp(p+1,q->s+1,q->len-2) != 0) {
+        return 0;
+    }
+    if (q->flags & SEARCH_WORD) {
+        if (pos > 0 && searchIsWordChar((unsigned char)p[-1])) return 0;
+        if (pos+q->len < hlen &&
+            searchIsWordChar((unsigned char)p[q->len])) return 0;
+    }
+    return 1;
+}
+
+/* Portable kernel: memchr() is already vectorized by most libc
+ * implementations, so use it to skip to the first byte candidates. */
+static size_t searchScalar(const searchQuery *q, const char *hay, size_t hlen,
+                           size_t pos)
+{
+    if (q->len == 0 || hlen < q->len) return SEARCH_NONE;
+    size_t last = hlen - q->len; /* Last valid match position. */
+
+    if (q->first[0] == q->first[1]) {
+        while(pos <= last) {
+            const char *p = memchr(hay+pos,q->first[0],last-pos+1);
+            if (p == NULL) break;
+            pos = p-hay;
+            if ((unsigned char)hay[pos+q->len-1] == q->last[0] ||
+                (unsigned char)hay[pos+q->len-1] == q->last[1])
+            {
+                if (searchVerify(q,hay,hlen,pos)) return pos;
+            }
+            pos++;
+        }
+        return SEARCH_NONE;
+    }
+
+    for (; pos <= last; pos++) {
+        unsigned char f = hay[pos], l = hay[pos+q->len-1];
+        if ((f == q->first[0] || f == q->first[1]) &&
+            (l == q->last[0] || l == q->last[1]) &&
+            searchVerify(q,hay,hlen,pos)) return pos;
+    }
+    return SEARCH_NONE;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* SSE2 is part of the x86-64 baseline, so this kernel is always
+ * available on such systems. */
+static size_t searchSSE2(const searchQuery *q, const char *hay, size_t hlen,
+                         size_t pos)
+{
+    if (q->len == 0 || hlen < q->len) return SEARCH_NONE;
+    const __m128i f0 = _mm_set1_epi8(q->first[0]);
+    const __m128i f1 = _mm_set1_epi8(q->first[1]);
+    const __m128i l0 = _mm_set1_epi8(q->last[0]);
+    const __m128i l1 = _mm_set1_epi8(q->last[1]);
+    size_t k = q->len-1;
+
+    for (; pos+k+16 <= hlen; pos += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(hay+pos));
+        __m128i b = _mm_loadu_si128((const __m128i*)(hay+pos+k));
+        __m128i fa = _mm_or_si128(_mm_cmpeq_epi8(a,f0),_mm_cmpeq_epi8(a,f1));
+        __m128i lb = _mm_or_si128(_mm_cmpeq_epi8(b,l0),_mm_cmpeq_epi8(b,l1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(fa,lb));
+        while(mask) {
+            size_t cand = pos+__builtin_ctz(mask);
+            if (searchVerify(q,hay,hlen,cand)) return cand;
+            mask &= mask-1;
+        }
+    }
+    return searchScalar(q,hay,hlen,pos);
+}
+
+__attribute__((target("avx2")))
+static size_t searchAVX2(const searchQuery *q, const char *hay, size_t hlen,
+                         size_t pos)
+{
+    if (q->len == 0 || hlen < q->len) return SEARCH_NONE;
+    const __m256i f0 = _mm256_set1_epi8(q->first[0]);
+    const __m256i f1 = _mm256_set1_epi8(q->first[1]);
+    const __m256i l0 = _mm256_set1_epi8(q->last[0]);
+    const __m256i l1 = _mm256_set1_epi8(q->last[1]);
+    size_t k = q->len-1;
+
+    for (; pos+k+32 <= hlen; pos += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(hay+pos));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(hay+pos+k));
+        __m256i fa = _mm256_or_si256(_mm256_cmpeq_epi8(a,f0),
+                                     _mm256_cmpeq_epi8(a,f1));
+        __m256i lb = _mm256_or_si256(_mm256_cmpeq_epi8(b,l0),
+                                     _mm256_cmpeq_epi8(b,l1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(fa,lb));
+        while(mask) {
+            size_t cand = pos+__builtin_ctz(mask);
+            if (searchVerify(q,hay,hlen,cand)) return cand;
+            mask &= mask-1;
+        }
+    }
+    return searchSSE2(q,hay,hlen,pos);
+}
+#endif
+
+/* Return the offset of the first match of the query in 'hay' at or after
+ * 'pos', or SEARCH_NONE. If 'mlen' is not NULL it is set to the length of
+ * the match. */
+size_t searchMemory(const searchQuery *q, const char *hay, size_t hlen,
+                    size_t pos, size_t *mlen)
+{
+    size_t len = q->len;
+    size_t found = q->re ? regexSearch(q->re,hay,hlen,pos,&len) :
+                           searchFind(q,hay,hlen,pos);
+    size_t end = found == SEARCH_NONE ? hlen : found+len;
+    if (end > pos)
+        __atomic_add_fetch(&E.stats.search_bytes,end-pos,__ATOMIC_RELAXED);
+    if (mlen) *mlen = len;
+    return found;
+}
+
+/* Return the offset where to look for the match after the one at 'pos' of
+ * length 'len'. Literal matches may overlap, regex matches don't. */
+size_t searchNextPos(const searchQuery *q, size_t pos, size_t len) {
+    return q->re ? pos+len : pos+1;
+}
+
+/* Max size of a run of rows scanned at once. Rows are walked to find the
+ * run before scanning it, so this also bounds the work done before a
+ * match near the start position is found. */
+#define SEARCH_RUN_BYTES (64*1024)
+
+/* Find the run of rows starting at 'row' that are views of consecutive
+ * lines of the mapped file, of at most SEARCH_RUN_BYTES and 'maxrows'
+ * rows. Leaves whose rows were never created join the run as a whole,
+ * without creating them, so searching a file just opened creates only
+ * the rows around the matches. Returns the size of the run, setting
+ * *count to its rows, and *next to the row following it, or NULL. */
+static size_t editorRowsRun(erow *row, int maxrows, int *count, erow **next) {
+    const char *end = row->chars+row->size;
+    erow *last = row;       /* Last row of the run, or NULL if the run */
+    rowsNode *leaf = NULL;  /* ends with the whole text of 'leaf'. */
+    int rows = 1;
+
+    while(1) {
+        rowsNode *lf = last ? last->leaf : leaf;
+        erow *n = NULL;
+        if (last && last < lf->row+lf->count-1) {
+            n = last+1;
+        } else if (lf->next) {
+            rowsNode *t = lf->next;
+            n = __atomic_load_n(&t->row,__ATOMIC_ACQUIRE);
+            if (n == NULL && row->mapped && t->text == end+1 &&
+                rows+t->count <= maxrows &&
+                (t->text+t->textlen-1) - row->chars <= SEARCH_RUN_BYTES)
+            {
+                end = t->text+t->textlen-1;
+                rows += t->count;
+                last = NULL;
+                leaf = t;
+                continue;
+            }
+            if (n == NULL) n = rowsLoad(t);
+        }
+        *next = n;
+        if (n == NULL || rows == maxrows || !row->mapped || !n->mapped ||
+            n->chars != end+1 ||
+            (n->chars+n->size) - row->chars > SEARCH_RUN_BYTES) break;
+        last = n;
+        end = n->chars+n->size;
+        rows++;
+    }
+    *count = rows;
+    return end - row->chars;
+}
+
+/* Return the row holding the byte at offset *pos of the run starting at
+ * 'row', see editorRowsRun(), setting *pos to the offset inside the row
+ * and adding to *idx the rows skipped. The leaves never loaded that the
+ * offset is past are skipped without creating their rows. */
+static erow *editorRowsRunLocate(erow *row, size_t *pos, int *idx) {
+    size_t off = *pos;
+
+    while(off > (size_t)row->size) {
+        rowsNode *lf = row->leaf;
+        off -= row->size+1;
+        (*idx)++;
+        if (row < lf->row+lf->count-1) {
+            row++;
+            continue;
+        }
+        lf = lf->next;
+        while(__atomic_load_n(&lf->row,__ATOMIC_ACQUIRE) == NULL &&
+              off >= lf->textlen)
+        {
+            off -= lf->textlen;
+            *idx += lf->count;
+            lf = lf->next;
+        }
+        row = rowsLeafRows(lf);
+    }
+    *pos = off;
+    return row;
+}
+
+/* Search the query forward starting at row '*at', column '*col' (an
+ * offset in 'chars'), included. The search wraps around at the end of
+ * the file, and stops after scanning the starting row again. On match 1
+ * is returned and *at, *col, *len are set to the match position and
+ * length, otherwise 0 is returned.
+ *
+ * Runs of rows that are views of consecutive lines of the mapped file
+ * are scanned as a single memory region, so that the kernel can work on
+ * large blocks instead of a line at a time. */
+int editorSearchForward(const searchQuery *q, int *at, int *col, int *len) {
+    int idx = *at, from = *col, wrapped = 0;
+    erow *row = editorRowAt(idx);
+
+    if (row == NULL) return 0;
+    while(1) {
+        /* Find the run of contiguous rows starting at 'row'. */
+        erow *next;
+        int count;
+        size_t runlen = editorRowsRun(row,wrapped ? *at-idx+1 : INT_MAX,
+                                      &count,&next), mlen;
+        size_t pos = searchMemory(q,row->chars,runlen,from,&mlen);
+        if (pos != SEARCH_NONE) {
+            /* Locate the row of the match inside the run. */
+            editorRowsRunLocate(row,&pos,&idx);
+            *at = idx;
+            *col = pos;
+            *len = mlen;
+            return 1;
+        }
+        if (wrapped && idx+count > *at) return 0;
+        idx += count;
+        row = next;
+        from = 0;
+        if (row == NULL) {
+            row = editorRowAt(0);
+            idx = 0;
+            wrapped = 1;
+        }
+    }
+}
+
+/* Search the query backward: find the last match that starts before
+ * row '*at', column '*col', wrapping around at the start of the file.
+ * Returns 1 on match setting *at, *col and *len, otherwise 0. */
+int editorSearchBackward(const searchQuery *q, int *at, int *col, int *len) {
+    int idx = *at, limit = *col, j;
+    erow *row = editorRowAt(idx);
+
+    if (row == NULL) return 0;
+    for (j = 0; j <= E.numrows; j++) {
+        size_t pos = 0, found = SEARCH_NONE, mlen, flen = 0;
+        while((pos = searchMemory(q,row->chars,row->size,pos,&mlen)) !=
+              SEARCH_NONE && (limit == -1 || pos < (size_t)limit))
+        {
+            found = pos;
+            flen = mlen;
+            pos = searchNextPos(q,pos,mlen);
+        }
+        if (found != SEARCH_NONE) {
+            *at = idx;
+            *col = found;
+            *len = flen;
+            return 1;
+        }
+        row = editorRowPrev(row);
+        idx--;
+        if (row == NULL) {
+            idx = E.numrows-1;
+            row = editorRowAt(idx);
+        }
+        limit = -1;
+    }
+    return 0;
+}
+
+/* ========================== Regular expressions =========================== */
+
+/* With CTRL-E find mode searches regular expressions, in this subset of
+ * the POSIX extended syntax:
+ *
+ *   .  [abc]  [^a-z]  ^  $  *  +  ?  {n}  {n,}  {n,m}  a|b  (...)
+ *
+ * plus \d \w \s (and \D \W \S) as classes, \t for TAB, and \ before any
+ * other char to match it literally. Matches never span lines. Like in
+ * POSIX the match reported is the leftmost one, and the longest of the
+ * ones starting there. Empty matches are skipped, since there is nothing
+ * to show. The '.' and negated classes match a whole UTF-8 char, the other
+ * classes work on bytes (non ASCII chars in them are alternatives), and
+ * case folding is ASCII only.
+ *
+ * The expression is parsed into a tree, then compiled to two Thompson
+ * NFAs, one matching the text forward and one backward. The NFAs are not
+ * simulated directly, they are turned into DFAs lazily: a DFA state is
+ * built the first time the scan reaches it, so scanning costs a table
+ * lookup per byte, and there is no backtracking whatever the expression.
+ * The states are kept in a cache that is just flushed when it gets too
+ * big, so pathological expressions run at NFA speed, but still linear.
+ *
+ * To find the leftmost longest match, the states of the forward DFA keep
+ * the NFA threads grouped by the position they started at, earliest
+ * first, and a new group is started at every byte. When a group matches,
+ * the groups started after it can't win anymore and are dropped, and no
+ * new group is started: once no thread is left, the last position where
+ * some group matched is the end of the match. Then the backward DFA scans
+ * from the end to the start of the line, and the last position where it
+ * matches is the start of the match.
+ *
+ * When every match starts with the same literal, as in ERROR.*timeout,
+ * the search kernels look for the literal first, and the DFA just scans
+ * the lines where it is found. If the literal turns out to be in most
+ * lines it is not worth the overhead of looking for it, and the DFA goes
+ * on alone. */
+
+#define RE_MAX_STATES 4096      /* Max size of the NFA. */
+#define RE_MAX_REPEAT 1000      /* Max count of {n,m}. */
+#define DFA_MAX_STATES 4096     /* The DFA cache is flushed beyond this. */
+#define DFA_TABLE_SIZE (DFA_MAX_STATES*2)
+#define RE_PREFIX_PROBE (64*1024) /* DFA bytes before judging the prefix. */
+
+/* Parse tree nodes. */
+enum { RE_SET, RE_CAT, RE_ALT, RE_REP, RE_BOL, RE_EOL, RE_EMPTY };
+
+typedef struct reNode {
+    int type;
+    int a, b;           /* Children of RE_CAT and RE_ALT, 'a' of RE_REP. */
+    int min, max;       /* Bounds of RE_REP, max is -1 if unbounded. */
+    uint64_t set[4];    /* Bytes matched by RE_SET. */
+} reNode;
+
+typedef struct reParser {
+    const char *p;      /* Next char to parse. */
+    reNode *node;       /* Nodes are referenced by index, since the */
+    int count, cap;     /* array is reallocated while parsing. */
+    int icase;
+    int err;
+} reParser;
+
+/* NFA states. Besides consuming a byte in the set, a state can branch,
+ * assert it is at the start or end of a line, or accept. */
+enum { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+typedef struct nfaState {
+    int type;
+    int out, out1;      /* Next states, out1 only for NFA_SPLIT. */
+    uint64_t set[4];
+} nfaState;
+
+/* DFA state flags. */
+#define DFA_MATCH (1<<0)        /* A match ends before the next byte. */
+#define DFA_MATCH_EOL (1<<1)    /* The same, if the line ends there. */
+#define DFA_DEAD (1<<2)         /* No other match can be found. */
+/* Flags part of the identity of a state, in key[0]. */
+#define DFA_NORESTART (1<<3)    /* Don't start new groups of threads. */
+#define DFA_BOL (1<<4)          /* At the start of a line. */
+
+typedef struct dfaState {
+    int flags;
+    int keylen;
+    int *key;           /* Flags, then the groups of NFA states, each one
+                           sorted and terminated by -1. */
+    struct dfaState *next[];    /* Next state by byte class, if known. */
+} dfaState;
+
+typedef struct dfa {
+    nfaState *nfa;
+    int count;                  /* NFA states. */
+    int start;                  /* NFA initial state. */
+    int err;                    /* The NFA is too big. */
+    int nclass;                 /* Bytes are grouped in classes of bytes */
+    const unsigned char *cls;   /* that no NFA state tells apart. */
+    const unsigned char *rep;   /* A byte of every class. */
+    dfaState **table;           /* Hash table of the states. */
+    int states;
+    int flushes;
+    dfaState *init[4];          /* Initial states by DFA_BOL/NORESTART. */
+    int *mark, gen;             /* Closure visit marks. */
+    int *stack, *buf;           /* Scratch space. */
+} dfa;
+
+struct regex {
+    dfa fwd, rev;
+    unsigned char cls[256];
+    unsigned char rep[256];
+    int word;                   /* Match whole words only. */
+    searchQuery prefix;         /* Literal all matches start with. */
+    size_t skipped, scanned;    /* Bytes skipped looking for the prefix,
+                                   and then scanned by the DFA. */
+};
+
+static void reSetAdd(uint64_t *set, int from, int to) {
+    for (int c = from; c <= to; c++) set[c>>6] |= 1ULL<<(c&63);
+}
+
+static int reSetHas(const uint64_t *set, int c) {
+    return (set[c>>6] >> (c&63)) & 1;
+}
+
+/* ---------------------------------- Parser -------------------------------- */
+
+static int reNew(reParser *ps, int type, int a, int b) {
+    if (ps->count == ps->cap) {
+        ps->cap = ps->cap ? ps->cap*2 : 64;
+        ps->node = krealloc(ps->node,sizeof(reNode)*ps->cap);
+    }
+    reNode *n = ps->node+ps->count;
+    memset(n,0,sizeof(*n));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return ps->count++;
+}
+
+static int reNewRep(reParser *ps, int a, int min, int max) {
+    int n = reNew(ps,RE_REP,a,0);
+    ps->node[n].min = min;
+    ps->node[n].max = max;
+    return n;
+}
+
+/* With case folding add to 'set' the other case of its letters. */
+static void reFold(reParser *ps, uint64_t *set) {
+    if (!ps->icase) return;
+    for (int c = 'A'; c <= 'Z'; c++) {
+        if (reSetHas(set,c) || reSetHas(set,c+32)) {
+            reSetAdd(set,c,c);
+            reSetAdd(set,c+32,c+32);
+        }
+    }
+}
+
+/* Return a RE_SET node matching the bytes in 'set'. */
+static int reNewSet(reParser *ps, uint64_t *set) {
+    reFold(ps,set);
+    int n = reNew(ps,RE_SET,0,0);
+    memcpy(ps->node[n].set,set,sizeof(ps->node[n].set));
+    return n;
+}
+
+/* Return a node matching a char not in 'set': a first byte that is not in
+ * the set nor a newline, and the continuation bytes of UTF-8 sequences
+ * following it. */
+static int reNewNegated(reParser *ps, uint64_t *set) {
+    uint64_t lead[4] = {0}, cont[4] = {0};
+
+    reFold(ps,set);
+    for (int c = 0; c < 256; c++)
+        if (!reSetHas(set,c) && c != '\n' && (c < 0x80 || c > 0xbf))
+            reSetAdd(lead,c,c);
+    reSetAdd(cont,0x80,0xbf);
+    int n = reNewSet(ps,lead);
+    int m = reNewRep(ps,reNewSet(ps,cont),0,-1);
+    return reNew(ps,RE_CAT,n,m);
+}
+
+/* Add to 'set' the bytes of the class \d, \w or \s, or the ASCII bytes not
+ * in it for \D, \W, \S. Returns 0 if 'c' is not a class letter. */
+static int reClassEscape(int c, uint64_t *set) {
+    uint64_t s[4] = {0};
+
+    switch(tolower(c)) {
+    case 'd': reSetAdd(s,'0','9'); break;
+    case 'w':
+        reSetAdd(s,'a','z'); reSetAdd(s,'A','Z');
+        reSetAdd(s,'0','9'); reSetAdd(s,'_','_');
+        break;
+    case 's': reSetAdd(s,' ',' '); reSetAdd(s,'\t','\r'); break;
+    default: return 0;
+    }
+    for (int b = 0; b < 128; b++)
+        if (reSetHas(s,b) != !!isupper(c)) reSetAdd(set,b,b);
+    return 1;
+}
+
+/* Return a node matching the 'len' bytes at 's' in sequence. */
+static int reNewLiteral(reParser *ps, const char *s, int len) {
+    int n = -1;
+    for (int j = 0; j < len; j++) {
+        uint64_t set[4] = {0};
+        reSetAdd(set,(unsigned char)s[j],(unsigned char)s[j]);
+        int m = reNewSet(ps,set);
+        n = n == -1 ? m : reNew(ps,RE_CAT,n,m);
+    }
+    return n;
+}
+
+/* Length of the UTF-8 char at 's', or 1 if it is not valid. */
+static int reCharLen(const char *s) {
+    int cp, len = utf8Decode(s,strlen(s),&cp);
+    return cp == -1 ? 1 : len;
+}
+
+/* Parse a bracket expression. */
+static int reParseClass(reParser *ps) {
+    uint64_t set[4] = {0};
+    int neg = 0, alt = -1, first = 1;
+
+    ps->p++;
+    if (*ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    while(*ps->p && (*ps->p != ']' || first)) {
+        unsigned char c = *ps->p;
+        first = 0;
+        if (c >= 0x80) {
+            /* Non ASCII chars are alternatives, ignored if negated. */
+            int len = reCharLen(ps->p);
+            if (!neg) {
+                int n = reNewLiteral(ps,ps->p,len);
+                alt = alt == -1 ? n : reNew(ps,RE_ALT,alt,n);
+            }
+            ps->p += len;
+            if (*ps->p == '-' && ps->p[1] && ps->p[1] != ']') ps->err = 1;
+            continue;
+        }
+        if (c == '\\' && ps->p[1]) {
+            if (reClassEscape(ps->p[1],set)) {
+                ps->p += 2;
+                continue;
+            }
+            c = ps->p[1] == 't' ? '\t' : ps->p[1];
+            ps->p++;
+        }
+        ps->p++;
+        int to = c;
+        if (*ps->p == '-' && ps->p[1] && ps->p[1] != ']') {
+            to = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (to == '\\' && *ps->p) to = (unsigned char)*ps->p++;
+            if (to < c || to >= 0x80) ps->err = 1;
+        }
+        reSetAdd(set,c,to);
+    }
+    if (*ps->p != ']') {
+        ps->err = 1;
+        return 0;
+    }
+    ps->p++;
+    if (neg) return reNewNegated(ps,set);
+    int n = reNewSet(ps,set);
+    return alt == -1 ? n : reNew(ps,RE_ALT,n,alt);
+}
+
+static int reParseAlt(reParser *ps);
+
+static int reParseAtom(reParser *ps) {
+    uint64_t set[4] = {0};
+    unsigned char c = *ps->p;
+    int n, len;
+
+    switch(c) {
+    case '(':
+        ps->p++;
+        n = reParseAlt(ps);
+        if (*ps->p != ')') ps->err = 1;
+        else ps->p++;
+        return n;
+    case '[':
+        return reParseClass(ps);
+    case '.':
+        ps->p++;
+        return reNewNegated(ps,set);
+    case '^':
+        ps->p++;
+        return reNew(ps,RE_BOL,0,0);
+    case '$':
+        ps->p++;
+        return reNew(ps,RE_EOL,0,0);
+    case '*': case '+': case '?': case '{':
+        ps->err = 1;    /* Nothing to repeat. */
+        return 0;
+    case '\\':
+        c = ps->p[1];
+        if (c == '\0') {
+            ps->err = 1;
+            return 0;
+        }
+        ps->p += 2;
+        /* Outside brackets \D \W \S match whole UTF-8 chars. */
+        if (reClassEscape(tolower(c),set))
+            return isupper(c) ? reNewNegated(ps,set) : reNewSet(ps,set);
+        if (c == 't') c = '\t';
+        return reNewLiteral(ps,(char*)&c,1);
+    default:
+        len = reCharLen(ps->p);
+        n = reNewLiteral(ps,ps->p,len);
+        ps->p += len;
+        return n;
+    }
+}
+
+/* Parse the {n}, {n,} or {n,m} bounds at 's' into *min and *max. Returns
+ * a pointer to the closing brace, or NULL if the syntax is invalid. */
+static const char *reParseBounds(const char *s, int *min, int *max) {
+    if (!isdigit((unsigned char)*++s)) return NULL;
+    for (*min = 0; isdigit((unsigned char)*s); s++)
+        if ((*min = *min*10+(*s-'0')) > RE_MAX_REPEAT) return NULL;
+    *max = *min;
+    if (*s == ',') {
+        s++;
+        *max = -1;
+        if (isdigit((unsigned char)*s)) {
+            for (*max = 0; isdigit((unsigned char)*s); s++)
+                if ((*max = *max*10+(*s-'0')) > RE_MAX_REPEAT) return NULL;
+            if (*max < *min) return NULL;
+        }
+    }
+    return *s == '}' ? s : NULL;
+}
+
+static int reParseRepeat(reParser *ps) {
+    int n = reParseAtom(ps);
+
+    while(!ps->err) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') {
+            min = 0; max = -1;
+        } else if (c == '+') {
+            min = 1; max = -1;
+        } else if (c == '?') {
+            min = 0; max = 1;
+        } else if (c == '{') {
+            const char *end = reParseBounds(ps->p,&min,&max);
+            if (end == NULL) {
+                ps->err = 1;
+                break;
+            }
+            ps->p = end;
+        } else {
+            break;
+        }
+        ps->p++;
+        n = reNewRep(ps,n,min,max);
+    }
+    return n;
+}
+
+static int reParseCat(reParser *ps) {
+    int n = -1;
+
+    while(!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')') {
+        int m = reParseRepeat(ps);
+        n = n == -1 ? m : reNew(ps,RE_CAT,n,m);
+    }
+    return n == -1 ? reNew(ps,RE_EMPTY,0,0) : n;
+}
+
+static int reParseAlt(reParser *ps) {
+    int n = reParseCat(ps);
+
+    while(!ps->err && *ps->p == '|') {
+        ps->p++;
+        int m = reParseCat(ps);
+        n = reNew(ps,RE_ALT,n,m);
+    }
+    return n;
+}
+
+/* Append to buf, at *len, the literal bytes every match of the node 'n'
+ * starts with. Returns 1 if the node matches just that literal, so that
+ * the literal can go on with what follows it. */
+static int reLiteralPrefix(const reNode *t, int n, int icase, char *buf,
+                           int *len)
+{
+    const reNode *r = t+n;
+
+    if (r->type == RE_CAT)
+        return reLiteralPrefix(t,r->a,icase,buf,len) &&
+               reLiteralPrefix(t,r->b,icase,buf,len);
+    if (r->type == RE_BOL || r->type == RE_EMPTY) return 1;
+    if (r->type != RE_SET || *len == KILO_QUERY_LEN) return 0;
+
+    int c = -1, count = 0;
+    for (int b = 0; b < 256; b++) {
+        if (!reSetHas(r->set,b)) continue;
+        if (c == -1) c = b;
+        count++;
+    }
+    /* With case folding letters come with their other case. */
+    if (icase && count == 2 && isupper(c) && reSetHas(r->set,tolower(c))) {
+        c = tolower(c);
+        count = 1;
+    }
+    if (count != 1) return 0;
+    buf[(*len)++] = c;
+    return 1;
+}
+
+/* ------------------------------------ NFA --------------------------------- */
+
+static int nfaNew(dfa *d, int type, int out, int out1) {
+    if (d->count == RE_MAX_STATES) {
+        d->err = 1;
+        return RE_MAX_STATES;   /* Spare state, the NFA will be dropped. */
+    }
+    nfaState *s = d->nfa+d->count;
+    memset(s,0,sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return d->count++;
+}
+
+/* Compile the tree node 'n' to NFA states, that go on with the state
+ * 'next' once done, and return the first state. The states are created
+ * from the last one, so there is nothing to patch later. If 'reverse' is
+ * true, the NFA matches the text backward. */
+static int nfaEmit(dfa *d, const reNode *t, int n, int reverse, int next) {
+    const reNode *r = t+n;
+    int s, j;
+
+    if (d->err) return next;
+    switch(r->type) {
+    case RE_SET:
+        s = nfaNew(d,NFA_SET,next,-1);
+        memcpy(d->nfa[s].set,r->set,sizeof(r->set));
+        return s;
+    case RE_CAT:
+        if (reverse)
+            return nfaEmit(d,t,r->b,reverse,nfaEmit(d,t,r->a,reverse,next));
+        return nfaEmit(d,t,r->a,reverse,nfaEmit(d,t,r->b,reverse,next));
+    case RE_ALT:
+        s = nfaEmit(d,t,r->a,reverse,next);
+        return nfaNew(d,NFA_SPLIT,s,nfaEmit(d,t,r->b,reverse,next));
+    case RE_REP:
+        if (r->max == -1) {
+            /* A loop: the split goes back to the repeated node. */
+            s = nfaNew(d,NFA_SPLIT,-1,next);
+            j = nfaEmit(d,t,r->a,reverse,s);
+            d->nfa[s].out = j;
+        } else {
+            /* Optional copies: skipping one skips all the next. */
+            s = next;
+            for (j = r->min; j < r->max && !d->err; j++)
+                s = nfaNew(d,NFA_SPLIT,nfaEmit(d,t,r->a,reverse,s),next);
+        }
+        for (j = 0; j < r->min && !d->err; j++)
+            s = nfaEmit(d,t,r->a,reverse,s);
+        return s;
+    case RE_BOL: return nfaNew(d,reverse ? NFA_EOL : NFA_BOL,next,-1);
+    case RE_EOL: return nfaNew(d,reverse ? NFA_BOL : NFA_EOL,next,-1);
+    default: return next;
+    }
+}
+
+/* ------------------------------------ DFA --------------------------------- */
+
+/* Free all the DFA states. */
+static void dfaFlush(dfa *d) {
+    for (int j = 0; j < DFA_TABLE_SIZE; j++) {
+        free(d->table[j]);
+        d->table[j] = NULL;
+    }
+    memset(d->init,0,sizeof(d->init));
+    d->states = 0;
+    d->flushes++;
+}
+
+/* Add to 'out', at *len, the NFA states reachable from 'n' without
+ * consuming bytes, skipping the ones already visited in the current
+ * generation. Only the states that consume a byte, accept, or wait for
+ * the end of the line are added: the others are just passed through. */
+static void dfaClosure(dfa *d, int n, int flags, int eol, int *out, int *len) {
+    int sp = 0;
+
+    d->stack[sp++] = n;
+    while(sp) {
+        n = d->stack[--sp];
+        if (d->mark[n] == d->gen) continue;
+        d->mark[n] = d->gen;
+        nfaState *s = d->nfa+n;
+        switch(s->type) {
+        case NFA_SPLIT:
+            d->stack[sp++] = s->out1;
+            d->stack[sp++] = s->out;
+            break;
+        case NFA_BOL:
+            if (flags & DFA_BOL) d->stack[sp++] = s->out;
+            break;
+        case NFA_EOL:
+            if (eol) {
+                d->stack[sp++] = s->out;
+                break;
+            }
+            /* Fall through. */
+        default:
+            out[(*len)++] = n;
+            break;
+        }
+    }
+}
+
+/* Terminate the group of NFA states at d->buf+start ... d->buf+*len:
+ * sort it, so that the same group is always stored the same way, and add
+ * the separator. Empty groups are removed. Returns 1 if the group has a
+ * match. */
+static int dfaGroupEnd(dfa *d, int start, int *len) {
+    int *g = d->buf+start, n = *len-start, match = 0;
+
+    if (n == 0) return 0;
+    for (int j = 1; j < n; j++) {
+        int v = g[j], k = j;
+        for (; k > 0 && g[k-1] > v; k--) g[k] = g[k-1];
+        g[k] = v;
+    }
+    for (int j = 0; j < n; j++)
+        if (d->nfa[g[j]].type == NFA_MATCH) match = 1;
+    d->buf[(*len)++] = -1;
+    return match;
+}
+
+/* Return the DFA state whose key is the 'len' ints in d->buf, creating it
+ * if needed. */
+static dfaState *dfaLookup(dfa *d, int len) {
+    unsigned int h = 2166136261U;
+    for (int j = 0; j < len; j++) h = (h ^ (unsigned)d->buf[j])*16777619U;
+
+    unsigned int mask = DFA_TABLE_SIZE-1, j = h & mask;
+    dfaState *s;
+    while((s = d->table[j]) != NULL) {
+        if (s->keylen == len && !memcmp(s->key,d->buf,sizeof(int)*len))
+            return s;
+        j = (j+1) & mask;
+    }
+    if (d->states == DFA_MAX_STATES) {
+        dfaFlush(d);
+        j = h & mask;
+    }
+
+    size_t nextlen = sizeof(dfaState*)*d->nclass;
+    s = kmalloc(sizeof(*s)+nextlen+sizeof(int)*len);
+    memset(s->next,0,nextlen);
+    s->key = (int*)((char*)s->next+nextlen);
+    s->keylen = len;
+    memcpy(s->key,d->buf,sizeof(int)*len);
+    d->table[j] = s;
+    d->states++;
+
+    /* Precompute what the scan needs to know about the state. */
+    s->flags = 0;
+    if (len == 1 && (s->key[0] & DFA_NORESTART)) s->flags |= DFA_DEAD;
+    int tlen = 0;
+    d->gen++;
+    for (int k = 1; k < len; k++) {
+        if (s->key[k] == -1) continue;
+        if (d->nfa[s->key[k]].type == NFA_MATCH) s->flags |= DFA_MATCH;
+        dfaClosure(d,s->key[k],s->key[0],1,d->buf,&tlen);
+    }
+    for (int k = 0; k < tlen; k++)
+        if (d->nfa[d->buf[k]].type == NFA_MATCH) s->flags |= DFA_MATCH_EOL;
+    if (s->flags & DFA_MATCH) s->flags |= DFA_MATCH_EOL;
+    return s;
+}
+
+/* Return the initial state, given the DFA_BOL and DFA_NORESTART flags. */
+static dfaState *dfaStart(dfa *d, int flags) {
+    int i = ((flags & DFA_BOL) ? 1 : 0) + ((flags & DFA_NORESTART) ? 2 : 0);
+    if (d->init[i]) return d->init[i];
+
+    int len = 1;
+    d->gen++;
+    dfaClosure(d,d->start,flags,0,d->buf,&len);
+    if (dfaGroupEnd(d,1,&len)) flags |= DFA_NORESTART;
+    d->buf[0] = flags;
+    dfaState *s = dfaLookup(d,len);
+    d->init[i] = s;
+    return s;
+}
+
+/* Compute the state following 's' on a byte of the class 'c', other than
+ * newline. */
+static dfaState *dfaStep(dfa *d, dfaState *s, int c) {
+    int b = d->rep[c], flags = s->key[0] & ~DFA_BOL;
+    int len = 1, j = 1, match = 0;
+
+    d->gen++;
+    while(j < s->keylen && !match) {
+        int start = len;
+        for (; s->key[j] != -1; j++) {
+            nfaState *n = d->nfa+s->key[j];
+            if (n->type == NFA_SET && reSetHas(n->set,b))
+                dfaClosure(d,n->out,flags,0,d->buf,&len);
+        }
+        j++;
+        /* Groups started later than a match are dropped. */
+        match = dfaGroupEnd(d,start,&len);
+    }
+    if (!match && !(flags & DFA_NORESTART)) {
+        int start = len;
+        dfaClosure(d,d->start,flags,0,d->buf,&len);
+        match = dfaGroupEnd(d,start,&len);
+    }
+    if (match) flags |= DFA_NORESTART;
+    d->buf[0] = flags;
+
+    int flushes = d->flushes;
+    dfaState *next = dfaLookup(d,len);
+    if (d->flushes == flushes) s->next[c] = next;
+    return next;
+}
+
+/* Scan forward from 'pos' for the end of the leftmost longest match. If
+ * 'line' is true, the scan gives up at the end of the first line. *stop
+ * is set to the offset where the scan stopped. */
+static size_t dfaForward(dfa *d, const char *hay, size_t hlen, size_t pos,
+                         int line, size_t *stop)
+{
+    int bol = pos == 0 || hay[pos-1] == '\n';
+    dfaState *s = dfaStart(d,bol ? DFA_BOL : 0);
+    size_t last = SEARCH_NONE, p;
+
+    for (p = pos; p < hlen; p++) {
+        unsigned char b = hay[p];
+        if (s->flags) {
+            if (s->flags & DFA_MATCH) last = p;
+            if (s->flags & DFA_DEAD) break;
+        }
+        if (b == '\n') {
+            if (s->flags & DFA_MATCH_EOL) last = p;
+            if (last != SEARCH_NONE || line) break;
+            s = dfaStart(d,DFA_BOL);
+            continue;
+        }
+        dfaState *next = s->next[d->cls[b]];
+        s = next ? next : dfaStep(d,s,d->cls[b]);
+    }
+    if (p == hlen && (s->flags & DFA_MATCH_EOL)) last = p;
+    *stop = p;
+    return last;
+}
+
+/* Scan backward from the end of a match found by dfaForward() for the
+ * start of the longest match ending there, not before 'limit'. */
+static size_t dfaBackward(dfa *d, const char *hay, size_t hlen, size_t end,
+                          size_t limit)
+{
+    int eol = end == hlen || hay[end] == '\n';
+    dfaState *s = dfaStart(d,(eol ? DFA_BOL : 0)|DFA_NORESTART);
+    size_t first = SEARCH_NONE, p = end;
+
+    while(1) {
+        if (s->flags & DFA_MATCH) first = p;
+        if (s->flags & DFA_DEAD) break;
+        if (p == 0 || hay[p-1] == '\n') {
+            if (s->flags & DFA_MATCH_EOL) first = p;
+            break;
+        }
+        if (p == limit) break;
+        unsigned char b = hay[--p];
+        dfaState *next = s->next[d->cls[b]];
+        s = next ? next : dfaStep(d,s,d->cls[b]);
+    }
+    return first;
+}
+
+/* Build the NFA of the tree rooted at 'root' and set up its DFA. Returns
+ * 0 if the NFA is too big. */
+static int dfaInit(dfa *d, const reNode *t, int root, int reverse) {
+    d->nfa = kmalloc(sizeof(nfaState)*(RE_MAX_STATES+1));
+    int match = nfaNew(d,NFA_MATCH,-1,-1);
+    d->start = nfaEmit(d,t,root,reverse,match);
+    if (d->err) return 0;
+    d->nfa = krealloc(d->nfa,sizeof(nfaState)*d->count);
+    d->mark = kcalloc(d->count,sizeof(int));
+    d->stack = kmalloc(sizeof(int)*(d->count*2+2));
+    d->buf = kmalloc(sizeof(int)*(d->count*2+2));
+    d->table = kcalloc(DFA_TABLE_SIZE,sizeof(dfaState*));
+    return 1;
+}
+
+static void dfaFree(dfa *d) {
+    if (d->table) dfaFlush(d);
+    free(d->table);
+    free(d->nfa);
+    free(d->mark);
+    free(d->stack);
+    free(d->buf);
+}
+
+/* Split the bytes in classes, so that DFA states have a transition for
+ * every class instead of every byte: two bytes are in the same class if
+ * every set of the NFA has both or none. Newline gets its own class. */
+static void regexClasses(struct regex *re) {
+    dfa *d = &re->fwd;
+    int nclass = 1;
+
+    memset(re->cls,0,sizeof(re->cls));
+    for (int j = -1; j < d->count; j++) {
+        uint64_t nl[4] = {0};
+        const uint64_t *set = nl;
+        if (j == -1) reSetAdd(nl,'\n','\n');
+        else if (d->nfa[j].type == NFA_SET) set = d->nfa[j].set;
+        else continue;
+
+        int remap[512];
+        memset(remap,-1,sizeof(remap));
+        nclass = 0;
+        for (int b = 0; b < 256; b++) {
+            int k = re->cls[b]*2+reSetHas(set,b);
+            if (remap[k] == -1) {
+                remap[k] = nclass++;
+                re->rep[remap[k]] = b;
+            }
+            re->cls[b] = remap[k];
+        }
+    }
+    re->fwd.nclass = re->rev.nclass = nclass;
+    re->fwd.cls = re->rev.cls = re->cls;
+    re->fwd.rep = re->rev.rep = re->rep;
+}
+
+/* Compile the expression 's' with the SEARCH_* flags. Returns NULL if the
+ * expression is invalid or too big. */
+struct regex *regexCompile(const char *s, int flags) {
+    reParser ps = {s,NULL,0,0,(flags & SEARCH_ICASE) != 0,0};
+    struct regex *re = NULL;
+
+    int root = reParseAlt(&ps);
+    if (*ps.p != '\0') ps.err = 1;     /* Unbalanced ')'. */
+    if (!ps.err) {
+        re = kcalloc(1,sizeof(*re));
+        if (!dfaInit(&re->fwd,ps.node,root,0) ||
+            !dfaInit(&re->rev,ps.node,root,1))
+        {
+            regexFree(re);
+            re = NULL;
+        }
+    }
+    if (re) {
+        char prefix[KILO_QUERY_LEN+1];
+        int len = 0;
+        regexClasses(re);
+        re->word = (flags & SEARCH_WORD) != 0;
+        reLiteralPrefix(ps.node,root,ps.icase,prefix,&len);
+        prefix[len] = '\0';
+        searchSetQuery(&re->prefix,prefix,flags & SEARCH_ICASE);
+    }
+    free(ps.node);
+    return re;
+}
+
+void regexFree(struct regex *re) {
+    if (re == NULL) return;
+    dfaFree(&re->fwd);
+    dfaFree(&re->rev);
+    free(re);
+}
+
+/* Return the offset of the leftmost longest non empty match in 'hay' at or
+ * after 'pos', setting *mlen to its length, or SEARCH_NONE. */
+size_t regexSearch(struct regex *re, const char *hay, size_t hlen, size_t pos,
+                   size_t *mlen)
+{
+    while(pos < hlen) {
+        size_t from = pos, stop;
+        if (re->prefix.len) {
+            from = searchFind(&re->prefix,hay,hlen,pos);
+            if (from == SEARCH_NONE) return SEARCH_NONE;
+            re->skipped += from-pos;
+        }
+        size_t end = dfaForward(&re->fwd,hay,hlen,from,re->prefix.len != 0,
+                                &stop);
+        if (re->prefix.len) {
+            /* Drop the prefix if it does not skip most of the text. */
+            re->scanned += stop-from;
+            if (re->scanned > RE_PREFIX_PROBE && re->skipped < re->scanned)
+                re->prefix.len = 0;
+        }
+        if (end == SEARCH_NONE) {
+            /* No match in the line where the literal was found. */
+            if (stop == hlen) return SEARCH_NONE;
+            pos = stop+1;
+            continue;
+        }
+        size_t start = dfaBackward(&re->rev,hay,hlen,end,from);
+        if (start == SEARCH_NONE) start = end;
+        if (start == end ||
+            (re->word &&
+             ((start > 0 && searchIsWordChar((unsigned char)hay[start-1])) ||
+              (end < hlen && searchIsWordChar((unsigned char)hay[end])))))
+        {
+            pos = start+1;
+            continue;
+        }
+        *mlen = end-start;
+        return start;
+    }
+    return SEARCH_NONE;
+}
+
+/* ============================== Match index =============================== */
+
+/* While in find mode a background thread computes the position of every
+ * match of the query, in file order. Matches are stored in fixed size
+ * chunks that are never moved once allocated: the worker fills them and
+ * then publishes the new count, so the main thread can read any match
+ * below the published count without locking.
+ *
+ * The rows are never modified while in find mode, so the worker can walk
+ * them safely. The worker is always stopped before find mode returns. */
+
+/* Return the match at position 'i' of the index. */
+findMatch *findIndexGet(struct findIndex *fi, int i) {
+    return fi->chunk[i>>FIND_CHUNK_BITS]+(i&(FIND_CHUNK_SIZE-1));
+}
+
+/* Return the number of matches, among the first 'count' ones, that are
+ * before row 'row', column 'col'. That is the position at which a match
+ * at row, col is or would be. */
+int findIndexRank(struct findIndex *fi, int count, int row, int col) {
+    int lo = 0, hi = count;
+
+    while(lo < hi) {
+        int mid = lo+(hi-lo)/2;
+        findMatch *m = findIndexGet(fi,mid);
+        if (m->row < row || (m->row == row && m->col < col)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Publish the progress of the worker to the main thread. The screen is
+ * refreshed at most every FIND_REFRESH_MS milliseconds. */
+#define FIND_REFRESH_MS 50
+
+static void findIndexPublish(struct findIndex *fi, int count, int scanned) {
+    static long long last;
+    __atomic_store_n(&fi->count,count,__ATOMIC_RELEASE);
+    __atomic_store_n(&fi->scanned,scanned,__ATOMIC_RELEASE);
+    long long now = mstime();
+    if (now-last >= FIND_REFRESH_MS) {
+        last = now;
+        editorPostRefresh();
+    }
+}
+
+/* Store the match number 'count'. Returns 0 if the index is full. */
+static int findIndexAdd(struct findIndex *fi, int count, int row, int col,
+                        int len)
+{
+    int c = count>>FIND_CHUNK_BITS;
+    if (c == FIND_MAX_CHUNKS) return 0;
+    if (fi->chunk[c] == NULL) {
+        fi->chunk[c] = kmalloc(sizeof(findMatch)*FIND_CHUNK_SIZE);
+        if (fi->chunk[c] == NULL) return 0;
+    }
+    findMatch *m = findIndexGet(fi,count);
+    m->row = row;
+    m->col = col;
+    m->len = len;
+    return 1;
+}
+
+/* Index the matches in the candidate rows only. */
+static void findIndexCandidates(struct findIndex *fi) {
+    int count = 0;
+
+    for (int j = 0; j < fi->ncand; j++) {
+        if (__atomic_load_n(&fi->cancel,__ATOMIC_RELAXED)) return;
+        erow *row = editorRowAt(fi->cand[j]);
+        size_t pos = 0, len;
+        while((pos = searchMemory(&fi->q,row->chars,row->size,pos,&len)) !=
+              SEARCH_NONE)
+        {
+            if (!findIndexAdd(fi,count,fi->cand[j],pos,len)) {
+                findIndexPublish(fi,count,fi->cand[j]);
+                return;
+            }
+            count++;
+            pos = searchNextPos(&fi->q,pos,len);
+        }
+        findIndexPublish(fi,count,fi->cand[j]+1);
+    }
+    findIndexPublish(fi,count,E.numrows);
+    __atomic_store_n(&fi->done,1,__ATOMIC_RELEASE);
+}
+
+/* The worker thread. Rows are scanned like in editorSearchForward(),
+ * but without wrapping around and collecting every match. */
+static void *findIndexWorker(void *arg) {
+    struct findIndex *fi = arg;
+    erow *row = editorRowAt(0);
+    int idx = 0, count = 0;
+
+    if (fi->cand) {
+        findIndexCandidates(fi);
+        editorPostRefresh();
+        return NULL;
+    }
+    while(row && !__atomic_load_n(&fi->cancel,__ATOMIC_RELAXED)) {
+        erow *next;
+        int runrows;
+        size_t runlen = editorRowsRun(row,INT_MAX,&runrows,&next);
+        size_t pos = 0, base = 0, len;
+        erow *mrow = row;
+        int midx = idx;
+        while((pos = searchMemory(&fi->q,row->chars,runlen,pos,&len)) !=
+              SEARCH_NONE)
+        {
+            if (pos-base > (size_t)mrow->size) {
+                size_t off = pos-base;
+                mrow = editorRowsRunLocate(mrow,&off,&midx);
+                base = pos-off;
+            }
+            if (!findIndexAdd(fi,count,midx,pos-base,len)) {
+                /* Index full: it only covers the rows before this one. */
+                findIndexPublish(fi,count,midx);
+                return NULL;
+            }
+            count++;
+            pos = searchNextPos(&fi->q,pos,len);
+        }
+        idx += runrows;
+        row = next;
+        findIndexPublish(fi,count,idx);
+    }
+    if (row == NULL) __atomic_store_n(&fi->done,1,__ATOMIC_RELEASE);
+    editorPostRefresh();
+    return NULL;
+}
+
+/* Stop the worker, if running, waiting for it to exit. */
+void findIndexStop(struct findIndex *fi) {
+    if (!fi->running) return;
+    __atomic_store_n(&fi->cancel,1,__ATOMIC_RELAXED);
+    pthread_join(fi->thread,NULL);
+    fi->running = 0;
+}
+
+/* Start indexing the matches of the query 'q', discarding the current
+ * index. If 'extends' is true, see searchExtends(), and the current index
+ * is complete, only the rows it has matches in are searched. If the worker
+ * can't be started the index just stays empty, and find mode falls back
+ * to scan the rows. */
+void findIndexStart(struct findIndex *fi, const searchQuery *q, int extends) {
+    findIndexStop(fi);
+    if (extends && fi->done) {
+        /* Collect the rows with matches, in place if they were already
+         * candidates, since the new ones are a subset. */
+        int *cand = fi->cand ? fi->cand : kmalloc(sizeof(int)*(fi->count+1));
+        int n = 0;
+        for (int j = 0; j < fi->count; j++) {
+            int row = findIndexGet(fi,j)->row;
+            if (n == 0 || cand[n-1] != row) cand[n++] = row;
+        }
+        fi->cand = cand;
+        fi->ncand = n;
+    } else {
+        free(fi->cand);
+        fi->cand = NULL;
+    }
+    searchCopyQuery(&fi->q,q);
+    fi->count = fi->scanned = fi->done = fi->cancel = 0;
+    if (q->len == 0) {
+        fi->scanned = E.numrows;
+        fi->done = 1;
+        return;
+    }
+    if (pthread_create(&fi->thread,NULL,findIndexWorker,fi) == 0)
+        fi->running = 1;
+}
+
+/* Stop the worker and release the memory used by the index. */
+void findIndexFree(struct findIndex *fi) {
+    findIndexStop(fi);
+    searchFreeQuery(&fi->q);
+    free(fi->cand);
+    fi->cand = NULL;
+    for (int j = 0; j < FIND_MAX_CHUNKS && fi->chunk[j]; j++) {
+        free(fi->chunk[j]);
+        fi->chunk[j] = NULL;
+    }
+    fi->count = fi->scanned = fi->done = 0;
+}
+
+/* Highlight the cells of the match at offset 'cx' and render column 'rx',
+ * of length 'len', of the row drawn at screen row 'y', with the attribute
+ * 'attr'. The screen cells are modified, so the row highlight is never
+ * touched. */
+static void editorDrawMatch(int y, erow *row, int cx, int rx, int len,
+                            int attr)
+{
+    unsigned char *a = E.back.attrs+y*E.back.cols;
+    int end = editorRowAdvanceRx(row,cx,rx,cx+len);
+
+    for (rx -= E.coloff, end -= E.coloff; rx < end; rx++)
+        if (rx >= 0 && rx < E.back.cols) a[rx] = attr;
+}
+
+/* Highlight all the find mode matches of the row 'filerow', drawn at
+ * screen row 'y'. The current match is shown in reverse video. */
+void editorDrawMatches(int y, int filerow, erow *row) {
+    struct findIndex *fi = &E.find;
+    int count = __atomic_load_n(&fi->count,__ATOMIC_ACQUIRE);
+    int cx = 0, rx = 0;
+
+    if (fi->q.len == 0) return;
+    if (row->ext) {
+        /* Start from the rendered window of long rows. */
+        cx = row->ext->wfrom;
+        rx = row->ext->wrx;
+    }
+    for (int i = findIndexRank(fi,count,filerow,cx); i < count; i++) {
+        findMatch *m = findIndexGet(fi,i);
+        if (m->row != filerow) break;
+        /* Matches are sorted, so the render column is computed
+         * incrementally, stopping past the right edge of the screen. */
+        rx = editorRowAdvanceRx(row,cx,rx,m->col);
+        cx = m->col;
+        if (rx >= E.coloff+E.screencols) break;
+        editorDrawMatch(y,row,cx,rx,m->len,HL_MATCH);
+    }
+    /* The current match may not be indexed yet. */
+    if (fi->cur_row == filerow)
+        editorDrawMatch(y,row,fi->cur_col,editorRowCxToRx(row,fi->cur_col),
+                        fi->cur_len,HL_MATCH|ATTR_REVERSE);
+}
+
+/* ================================= Replace ================================ */
+
+/* Replacing all the matches of the query is done in a single pass over
+ * the rows, like the match index does: runs of contiguous rows are
+ * scanned at once, and every row with matches is then rebuilt a single
+ * time with all its replacements. Since replacements can't contain
+ * newlines no row is ever added or removed, and modified rows just drop
+ * their cached render and highlight, so the cost is a scan of the file
+ * plus a copy of the modified rows, whatever the number of matches.
+ *
+ * Matches are replaced left to right without overlapping. In regex mode
+ * '&' in the replacement stands for the matched text, and "\&" and "\\"
+ * for a literal '&' and '\', like in sed. */
+
+/* Append to 'ab' the replacement 'with' of the match 'm' of length 'mlen'. */
+static void replaceExpand(struct abuf *ab, const searchQuery *q,
+                          const char *with, int wlen, const char *m,
+                          size_t mlen)
+{
+    if (q->re == NULL) {
+        abAppend(ab,with,wlen);
+        return;
+    }
+    for (const char *p = with; *p; p++) {
+        if (*p == '&')
+            abAppend(ab,m,mlen);
+        else if (*p == '\\' && (p[1] == '&' || p[1] == '\\'))
+            abAppend(ab,++p,1);
+        else
+            abAppend(ab,p,1);
+    }
+}
+
+/* Complete the new content of 'row' in 'ab' with the 'len' bytes at 'tail',
+ * the part of the row after the last match, and set it. */
+static void replaceRow(erow *row, int idx, struct abuf *ab, const char *tail,
+                       size_t len)
+{
+    abAppend(ab,tail,len);
+    char *chars = kmalloc(ab->len+1);
+    if (ab->len) memcpy(chars,ab->b,ab->len); /* Empty: ab->b may be NULL. */
+    chars[ab->len] = '\0';
+    editorRowSetChars(row,idx,chars,ab->len);
+    ab->len = 0;
+}
+
+/* Replace every match of the query 'q' with 'with'. The rows must be
+ * flattened and the match index stopped. Returns the number of
+ * replacements, that count as a single modification of the file. */
+long editorReplaceAll(const searchQuery *q, const char *with) {
+    struct abuf ab = ABUF_INIT;
+    int wlen = strlen(with);
+    erow *row = editorRowAt(0);
+    int idx = 0;
+    long count = 0;
+
+    if (q->len == 0) return 0;
+    while(row) {
+        erow *next;
+        int runrows;
+        size_t runlen = editorRowsRun(row,INT_MAX,&runrows,&next);
+
+        /* 'copied' is the offset in the row 'mrow' up to which its content
+         * was already copied in 'ab', or -1 if it has no matches so far.
+         * Rows are only set once scanned, and the run is either inside
+         * the mapped file or a single row, so 'run' stays valid. */
+        const char *run = row->chars;
+        size_t pos = 0, base = 0, len;
+        long copied = -1;
+        erow *mrow = row;
+        int midx = idx;
+        while((pos = searchMemory(q,run,runlen,pos,&len)) != SEARCH_NONE) {
+            if (pos-base > (size_t)mrow->size) {
+                erow *prev = mrow;
+                int pidx = midx;
+                size_t off = pos-base;
+                mrow = editorRowsRunLocate(mrow,&off,&midx);
+                if (copied != -1) replaceRow(prev,pidx,&ab,run+base+copied,
+                                             prev->size-copied);
+                copied = -1;
+                base = pos-off;
+            }
+            if (copied == -1) copied = 0;
+            abAppend(&ab,run+base+copied,pos-base-copied);
+            replaceExpand(&ab,q,with,wlen,run+pos,len);
+            copied = pos-base+len;
+            pos += len;
+            count++;
+        }
+        if (copied != -1)
+            replaceRow(mrow,midx,&ab,run+base+copied,mrow->size-copied);
+        idx += runrows;
+        row = next;
+    }
+    abFree(&ab);
+    if (count) {
+        char rec[KILO_QUERY_LEN*2+2];
+        size_t qlen = strlen(q->s);
+        memcpy(rec,q->s,qlen+1);
+        memcpy(rec+qlen+1,with,wlen);
+        journalEdit(JOURNAL_REPLACE,q->flags,rec,qlen+1+wlen);
+        E.dirty++;
+    }
+    return count;
+}
+
+/* =============================== Find mode ================================ */
+
+/* Return true if the query 's' with the given flags can only match where
+ * the query 'q' matches too, that is, every match of 's' contains a match
+ * of 'q' starting at the same offset: then only the rows where 'q' was
+ * found need to be searched. This is the case if 's' just appends to 'q',
+ * unless with regexes the appended part repeats what precedes it, or
+ * there are top level alternatives. Whole word matches don't qualify,
+ * since 'q' may match just a part of a word matched by 's'. */
+int searchExtends(const searchQuery *q, const char *s, int flags) {
+    size_t len = strlen(s);
+
+    if (q->len == 0 || len <= q->len || flags != q->flags ||
+        (flags & SEARCH_WORD)) return 0;
+    if (!(flags & SEARCH_REGEX)) {
+        for (size_t j = 0; j < q->len; j++)
+            if (q->s[j] != ((flags & SEARCH_ICASE) ?
+                            tolower((unsigned char)s[j]) : s[j])) return 0;
+        return 1;
+    }
+    if (memcmp(q->s,s,q->len) != 0 || strchr("*+?{",s[q->len])) return 0;
+
+    /* Look for a '|' outside brackets and parens. */
+    int depth = 0;
+    for (const char *p = s; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '[') {
+            p++;
+            if (*p == '^') p++;
+            if (*p == ']') p++;
+            while(*p && *p != ']') p += (*p == '\\' && p[1]) ? 2 : 1;
+            if (*p == '\0') break;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (*p == '|' && depth == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Move to the next (dir == 1) or previous (dir == -1) match of the query
+ * 'q' starting from the match at *row, *col, of length *len, or from that
+ * position included if dir is 0. The match index is used when it covers
+ * the position to look up, otherwise the rows are scanned. Returns 1 and
+ * sets *row, *col, *len if a match is found, otherwise 0. */
+int editorFindMove(const searchQuery *q, int dir, int *row, int *col,
+                   int *len)
+{
+    struct findIndex *fi = &E.find;
+    int count = __atomic_load_n(&fi->count,__ATOMIC_ACQUIRE);
+    int scanned = __atomic_load_n(&fi->scanned,__ATOMIC_ACQUIRE);
+    int done = __atomic_load_n(&fi->done,__ATOMIC_ACQUIRE);
+    int i = -1;
+
+    if (q->len == 0) return 0;
+    if (dir == -1) {
+        /* Every match before *row is indexed if *row was scanned. */
+        if (*row < scanned) {
+            i = findIndexRank(fi,count,*row,*col)-1;
+            if (i == -1 && done) i = count-1;
+        }
+    } else {
+        i = findIndexRank(fi,count,*row,*col+(dir == 1));
+        if (i == count) i = (done && count) ? 0 : -1;
+    }
+    if (i != -1) {
+        findMatch *m = findIndexGet(fi,i);
+        *row = m->row;
+        *col = m->col;
+        *len = m->len;
+        return 1;
+    }
+    if (done) return 0;
+
+    if (dir == -1) return editorSearchBackward(q,row,col,len);
+    if (dir == 1) *col = searchNextPos(q,*col,*len);
+    return editorSearchForward(q,row,col,len);
+}
+
+/* Like editorSearchForward(), but searching only the candidate rows of
+ * the match index, see findIndexStart(). */
+int editorFindCandidates(const searchQuery *q, int *at, int *col, int *len) {
+    struct findIndex *fi = &E.find;
+    int lo = 0, hi = fi->ncand;
+
+    while(lo < hi) {
+        int mid = lo+(hi-lo)/2;
+        if (fi->cand[mid] < *at) lo = mid+1;
+        else hi = mid;
+    }
+    /* Start from *col in the row *at, and if it is a candidate get back
+     * to it after wrapping around, to search the part before *col. */
+    for (int k = 0; k <= fi->ncand && fi->ncand; k++) {
+        int j = (lo+k) % fi->ncand, wrapped = k == fi->ncand;
+        if (wrapped && fi->cand[j] != *at) break;
+        erow *row = editorRowAt(fi->cand[j]);
+        size_t from = (k == 0 && fi->cand[j] == *at) ? (size_t)*col : 0;
+        size_t mlen, pos = searchMemory(q,row->chars,row->size,from,&mlen);
+        if (pos == SEARCH_NONE) continue;
+        if (wrapped && pos >= (size_t)*col) break;
+        *at = fi->cand[j];
+        *col = pos;
+        *len = mlen;
+        return 1;
+    }
+    return 0;
+}
+
+void editorFind(int fd) {
+    char query[KILO_QUERY_LEN+1] = {0};
+    int qlen = 0;
+    int flags = 0; /* SEARCH_ICASE / WORD / REGEX toggled by the user. */
+    int find_next = 0; /* if 1 search next, if -1 search prev. */
+    int restart = 0; /* If 1 search again from the start position. */
+    struct findIndex *fi = &E.find;
+    searchQuery q;
+    int invalid = 0; /* The query is not a valid regex. */
+
+    memset(&q,0,sizeof(q));
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.cx, saved_cy = E.cy;
+    int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+
+    /* The match index reads the rows from another thread, all of them. */
+    editorMapFinish();
+    editorRowsFlatten();
+    fi->active = 1;
+    fi->cur_row = -1;
+    fi->q.len = 0;
+    while(1) {
+        char count[64];
+        int total = __atomic_load_n(&fi->count,__ATOMIC_ACQUIRE);
+        const char *more = __atomic_load_n(&fi->done,__ATOMIC_ACQUIRE) ?
+                           "" : "+";
+
+        if (qlen == 0) {
+            count[0] = '\0';
+        } else if (invalid) {
+            snprintf(count,sizeof(count)," -- invalid regex");
+        } else if (fi->cur_row == -1) {
+            snprintf(count,sizeof(count)," -- no match");
+        } else {
+            int k = findIndexRank(fi,total,fi->cur_row,fi->cur_col);
+            if (k < total) {
+                findMatch *m = findIndexGet(fi,k);
+                if (m->row != fi->cur_row || m->col != fi->cur_col) k = total;
+            }
+            if (k < total)
+                snprintf(count,sizeof(count)," -- match %d of %d%s",
+                    k+1,total,more);
+            else
+                snprintf(count,sizeof(count)," -- match ? of %d%s",
+                    total,more);
+        }
+        editorSetStatusMessage(
+            "Search%s%s%s: %s%s (ESC/Arrows/Enter, Tab:case ^W:word ^E:regex "
+            "^R:replace)",
+            (flags & SEARCH_ICASE) ? " [i]" : "",
+            (flags & SEARCH_WORD) ? " [w]" : "",
+            (flags & SEARCH_REGEX) ? " [re]" : "", query, count);
+        if (!editorInputPending(fd)) editorRefreshScreen();
+
+        int c = editorReadKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (qlen != 0) query[--qlen] = '\0';
+            restart = 1;
+        } else if (c == ESC || c == ENTER || c == CTRL_R) {
+            long replaced = -1;
+            if (c == CTRL_R) {
+                /* Replace all the matches, then get back to the saved
+                 * position, at the same column it was displayed. */
+                char prompt[KILO_QUERY_LEN+32];
+                char with[KILO_QUERY_LEN+1] = {0};
+                if (q.len == 0) continue;
+                snprintf(prompt,sizeof(prompt),"Replace %s with: ",query);
+                if (!editorPrompt(fd,prompt,with,sizeof(with))) continue;
+                findIndexStop(fi);
+                int filerow = saved_rowoff+saved_cy, rx = 0;
+                erow *row = editorRowAt(filerow);
+                if (row) rx = editorRowCxToRx(row,
+                    saved_cx < row->size ? saved_cx : row->size);
+                replaced = editorReplaceAll(&q,with);
+                E.coloff = saved_coloff; E.rowoff = saved_rowoff;
+                editorCursorAt(filerow,rx);
+            } else if (c == ESC) {
+                E.cx = saved_cx; E.cy = saved_cy;
+                E.coloff = saved_coloff; E.rowoff = saved_rowoff;
+            }
+            findIndexFree(fi);
+            searchFreeQuery(&q);
+            fi->active = 0;
+            if (replaced == -1)
+                editorSetStatusMessage("");
+            else
+                editorSetStatusMessage("%ld matches replaced",replaced);
+            return;
+        } else if (c == TAB) {
+            flags ^= SEARCH_ICASE;
+            restart = 1;
+        } else if (c == CTRL_W) {
+            flags ^= SEARCH_WORD;
+            restart = 1;
+        } else if (c == CTRL_E) {
+            flags ^= SEARCH_REGEX;
+            restart = 1;
+        } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
+            find_next = 1;
+        } else if (c == ARROW_LEFT || c == ARROW_UP) {
+            find_next = -1;
+        } else if (isprint(c) || (c >= 0x80 && c < 256)) {
+            if (qlen < KILO_QUERY_LEN) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+                restart = 1;
+            }
+        }
+        if (!restart && !find_next) continue;
+
+        /* Search occurrence. Incremental search starts from the cursor
+         * position at the time the find mode was entered, except when
+         * the query just grows: a match of the longer query is also a
+         * match of the current one, so it can't be before the current
+         * match, nor in a row where the current query has no match. */
+        int row = fi->cur_row, col = fi->cur_col, len = fi->cur_len, found;
+        if (restart) {
+            int extends = searchExtends(&q,query,flags);
+            invalid = searchSetQuery(&q,query,flags) == -1;
+            if (row == -1 || !extends) {
+                row = saved_rowoff+saved_cy;
+                col = saved_cx;
+                if (row >= E.numrows) row = col = 0;
+            }
+            /* Look for the first match with a scan, so that it is
+             * shown ASAP, then index all the others in background. */
+            findIndexStart(fi,&q,extends);
+            if (q.len == 0)
+                found = 0;
+            else if (fi->cand)
+                found = editorFindCandidates(&q,&row,&col,&len);
+            else
+                found = editorSearchForward(&q,&row,&col,&len);
+        } else {
+            if (row == -1) {
+                find_next = 0;
+                continue;
+            }
+            found = editorFindMove(&q,find_next,&row,&col,&len);
+        }
+        find_next = restart = 0;
+
+        if (found) {
+            fi->cur_row = row;
+            fi->cur_col = col;
+            fi->cur_len = len;
+            E.cy = 0;
+            E.cx = col;
+            E.rowoff = row;
+            E.coloff = 0;
+        } else {
+            fi->cur_row = -1;
+        }
+    }
+}
+
+/* ========================= Editor events handling  ======================== */
+
+/* Ask the user for a string in the status bar, showing 'prompt' before it.
+ * 'buf' holds the initial text and receives the result, up to 'size'-1
+ * chars. Returns 1 if the user pressed Enter, 0 on ESC. */
+int editorPrompt(int fd, const char *prompt, char *buf, size_t size) {
+    size_t len = strlen(buf);
+    while(1) {
+        editorSetStatusMessage("%s%s",prompt,buf);
+        if (!editorInputPending(fd)) editorRefreshScreen();
+
+        int c = editorReadKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (len != 0) buf[--len] = '\0';
+        } else if (c == ESC || c == ENTER) {
+            editorSetStatusMessage("");
+            return c == ENTER;
+        } else if ((isprint(c) || (c >= 0x80 && c < 256)) && len < size-1) {
+            buf[len++] = c;
+            buf[len] = '\0';
+        }
+    }
+}
+
+/* Return the render column of the cursor. */
+int editorCursorRx(void) {
+    erow *row = editorRowAt(E.rowoff+E.cy);
+    if (row == NULL) return 0;
+    return editorRowCxToRx(row,E.cx < row->size ? E.cx : row->size);
+}
+
+/* Put the cursor at the render column 'rx' of the row 'filerow', or at its
+ * end if the row is shorter. */
+void editorCursorAt(int filerow, int rx) {
+    erow *row = editorRowAt(filerow);
+    E.cx = row ? editorRowRxToCx(row,rx) : 0;
+    E.cy = filerow-E.rowoff;
+}
+
+/* Handle cursor position change because arrow keys were pressed. */
+void editorMoveCursor(int key) {
+    int filerow = E.rowoff+E.cy;
+    erow *row = editorRowAt(filerow);
+
+    switch(key) {
+    case ARROW_LEFT:
+        if (E.cx > 0) {
+            E.cx = editorRowPrevGlyph(row,E.cx);
+        } else if (filerow > 0) {
+            E.cy--;
+            E.cx = editorRowAt(filerow-1)->size;
+        }
+        break;
+    case ARROW_RIGHT:
+        if (row && E.cx < row->size) {
+            E.cx = editorRowNextGlyph(row,E.cx);
+        } else if (row) {
+            E.cy++;
+            E.cx = 0;
+        }
+        break;
+    case ARROW_UP:
+        if (filerow > 0) editorCursorAt(filerow-1,editorCursorRx());
+        break;
+    case ARROW_DOWN:
+        if (filerow < E.numrows) editorCursorAt(filerow+1,editorCursorRx());
+        break;
+    }
+}
+
+/* Return the largest useful E.rowoff: the last page shows the empty line
+ * after the end of the file at the bottom. */
+static int editorMaxRowoff(void) {
+    int maxoff = E.numrows-E.screenrows+1;
+    return maxoff > 0 ? maxoff : 0;
+}
+
+/* Scroll the view by 'lines' (up if negative) moving the cursor by the
+ * same amount, so that it stays at the same screen row. At the start and
+ * at the end of the file, where the view can't scroll, just the cursor
+ * moves. The positions are computed, so any distance takes the same time. */
+void editorScrollLines(int lines) {
+    int rx = editorCursorRx();
+    int filerow = E.rowoff+E.cy+lines;
+    int maxoff = editorMaxRowoff();
+
+    E.rowoff += lines;
+    if (E.rowoff > maxoff) E.rowoff = maxoff;
+    if (E.rowoff < 0) E.rowoff = 0;
+    if (filerow > E.numrows) filerow = E.numrows;
+    if (filerow < 0) filerow = 0;
+    editorCursorAt(filerow,rx);
+}
+
+/* Move the cursor at the start of the row 'filerow'. If the row is not
+ * visible, the view is scrolled to show it at the center of the screen. */
+void editorGotoRow(int filerow) {
+    if (filerow >= E.numrows) filerow = E.numrows-1;
+    if (filerow < 0) filerow = 0;
+    if (filerow < E.rowoff || filerow >= E.rowoff+E.screenrows) {
+        int maxoff = editorMaxRowoff();
+        E.rowoff = filerow-E.screenrows/2;
+        if (E.rowoff > maxoff) E.rowoff = maxoff;
+        if (E.rowoff < 0) E.rowoff = 0;
+    }
+    E.cy = filerow-E.rowoff;
+    E.cx = 0;
+}
+
+/* Ask for a line number and move the cursor there. */
+void editorGotoLine(int fd) {
+    char buf[32] = {0};
+    if (!editorPrompt(fd,"Go to line (ESC to cancel): ",buf,sizeof(buf)))
+        return;
+    long line = atol(buf);
+    if (line <= 0) {
+        editorSetStatusMessage("Invalid line number: %s",buf);
+        return;
+    }
+    if (line > E.numrows) editorMapFinish();
+    editorGotoRow(line > E.numrows ? E.numrows : line-1);
+}
+
+/* Read the text pasted by the terminal, up to the end of the bracketed
+ * paste sequence, and insert it at once. */
+void editorPaste(int fd) {
+    static const char endseq[] = "\x1b[201~";
+    struct abuf text = ABUF_INIT;
+    int matched = 0; /* Bytes of endseq matched so far. */
+
+    while(matched < (int)sizeof(endseq)-1) {
+        if (E.inpos == E.inlen && editorInputFill(fd) == 0) break;
+        if (matched == 0) {
+            /* Copy everything up to the next ESC as it is. */
+            char *start = E.inbuf+E.inpos;
+            char *esc = memchr(start,ESC,E.inlen-E.inpos);
+            int n = esc ? esc-start : E.inlen-E.inpos;
+            abAppend(&text,start,n);
+            E.inpos += n;
+            if (!esc) continue;
+        }
+        char c = E.inbuf[E.inpos++];
+        if (c == endseq[matched]) {
+            matched++;
+            continue;
+        }
+        abAppend(&text,endseq,matched);
+        matched = c == ESC;
+        if (!matched) abAppend(&text,&c,1);
+    }
+    if (text.len) editorInsertText(text.b,text.len);
+    free(text.b);
+}
+
+/* Process events arriving from the standard input, which is, the user
+ * is typing stuff on the terminal. */
+#define KILO_QUIT_TIMES 3
+void editorProcessKeypress(int fd) {
+    /* When the file is modified, requires Ctrl-q to be pressed N times
+     * before actually quitting. */
+    static int quit_times = KILO_QUIT_TIMES;
+
+    int c = editorReadKey(fd);
+    if (c == KEY_NULL) return; /* Just refresh the screen. */
+    switch(c) {
+    case ENTER:         /* Enter */
+        editorInsertNewline();
+        break;
+    case CTRL_C:        /* Ctrl-c */
+        /* We ignore ctrl-c, it can't be so simple to lose the changes
+         * to the edited file. */
+        break;
+    case CTRL_Q:        /* Ctrl-q */
+        /* Wait for a save in progress to know if the file is saved. */
+        if (E.save) saveFinish(E.save);
+        /* Quit if the file was already saved. */
+        if (E.dirty && quit_times) {
+            editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                "Press Ctrl-Q %d more times to quit.", quit_times);
+            quit_times--;
+            return;
+        }
+        journalClose();
+        exit(0);
+        break;
+    case CTRL_S:        /* Ctrl-s */
+        editorSave();
+        break;
+    case CTRL_F:
+        editorFind(fd);
+        break;
+    case CTRL_T:
+        E.stats_overlay = !E.stats_overlay;
+        break;
+    case BACKSPACE:     /* Backspace */
+    case CTRL_H:        /* Ctrl-h */
+    case DEL_KEY:
+        editorDelChar();
+        break;
+    case PAGE_UP:
+        editorScrollLines(-E.screenrows);
+        break;
+    case PAGE_DOWN:
+        editorScrollLines(E.screenrows);
+        break;
+    case CTRL_U:
+        editorScrollLines(-E.screenrows/2);
+        break;
+    case CTRL_D:
+        editorScrollLines(E.screenrows/2);
+        break;
+    case CTRL_G:
+        editorGotoLine(fd);
+        break;
+    case HOME_KEY:
+        E.cx = 0;
+        break;
+    case END_KEY: {
+        erow *row = editorRowAt(E.rowoff+E.cy);
+        E.cx = row ? row->size : 0;
+        break;
+    }
+    case CTRL_HOME:
+        editorGotoRow(0);
+        break;
+    case CTRL_END:
+        editorMapFinish();
+        editorGotoRow(E.numrows-1);
+        if (E.numrows) E.cx = editorRowAt(E.numrows-1)->size;
+        break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+        editorMoveCursor(c);
+        break;
+    case PASTE_START:
+        editorPaste(fd);
+        break;
+    case PASTE_END:
+        break;
+    case CTRL_L: /* ctrl+l, clear screen */
+        /* Force a full redraw of the screen at the next refresh. */
+        E.front_valid = 0;
+        break;
+    case ESC:
+        /* Nothing to do for ESC in this mode. */
+        break;
+    default:
+        if ((c >= 32 && c < 256 && c != 127) || c == TAB) {
+            /* Text already queued after this key, as when the terminal
+             * does not support bracketed paste, is inserted at once. */
+            char buf[KILO_INBUF+1];
+            buf[0] = c;
+            int n = 1+editorInputTakeText(buf+1,KILO_INBUF);
+            if (n > 1) {
+                editorInsertText(buf,n);
+                break;
+            }
+        }
+        editorInsertChar(c);
+        break;
+    }
+
+    quit_times = KILO_QUIT_TIMES; /* Reset it to the original value. */
+}
 
-    fp = fopen(filename,"r");
-    if (!fp) {
-        if (errno != ENOENT) {
-            perror("Opening file");
-            exit(1);
+int editorFileWasModified(void) {
+    return E.dirty;
+}
+
+/* ============================== Swap journal ============================== */
+
+/* The edits not yet saved are journaled in a swap file, "dir/.name.kswp",
+ * so that they are not lost if kilo dies: when the file is opened again,
+ * if the swap file is still there and the file was not changed after it,
+ * kilo asks to recover them.
+ *
+ * The journal records the editing commands with the cursor position they
+ * were given at, not the rows they modified: replaying a command calls the
+ * same function with the same cursor, so it has the same effect, and a
+ * replace of millions of matches is a single record. The keystroke path
+ * just appends the record to a queue in memory, where text typed right
+ * after the text inserted by the previous record, or deleting its last
+ * char, only updates that record. A writer thread waits for the queue to
+ * be non empty, lets it collect the edits of JOURNAL_DELAY_MS more, and
+ * appends it to the file with a single write followed by fsync(2).
+ *
+ * The journal starts with the identity (size, mtime, inode) of the file
+ * it applies to. Saves add a mark record when the snapshot is taken and,
+ * once the new file is written, a record with its identity: the journal
+ * from the mark on applies to it. When nothing was modified while saving,
+ * the swap file is simply removed. After such a save, or when the swap
+ * file doubled in size, the writer compacts it: the records before the
+ * last save are dropped and adjacent records merged again, and the result
+ * replaces the swap file with a rename. Records have a checksum, so a
+ * journal truncated or corrupted by a crash is replayed up to its last
+ * valid record.
+ *
+ * The swap file is locked with flock(2) by the instance journaling into
+ * it, and its content is touched only once the lock is taken: a second
+ * kilo editing the same file finds the lock held and does not journal,
+ * instead of overwriting the journal of the first one.
+ *
+ * With kilo -f the rows also change when data appended to the file is
+ * read. The identity of a followed file has a zero mtime, and means its
+ * first 'size' bytes: while there are unsaved edits every read is
+ * journaled with the size read so far, and replaying it reads the same
+ * bytes again, so the edits and the data read are interleaved as they
+ * were. A journal of a followed file is recovered only with kilo -f, as
+ * long as the file just grew. */
+
+#define JOURNAL_MAGIC "KILOSWP1"
+#define JOURNAL_DELAY_MS 100            /* Max time an edit is queued. */
+#define JOURNAL_RUN 4096                /* Max text merged in a record. */
+#define JOURNAL_COMPACT (1024*1024)     /* Smaller journals aren't compacted. */
+#define JOURNAL_MARKS 8                 /* Save marks remembered. */
+
+/* Journal records are made of this header followed by 'len' bytes. */
+typedef struct journalRec {
+    uint32_t sum;       /* Checksum of the rest of the record. */
+    int32_t op;         /* JOURNAL_... */
+    int32_t row, col;   /* Cursor position of the command. */
+    int32_t arg;        /* Char, search flags or save mark. */
+    int32_t len;        /* Payload length. */
+} journalRec;
+
+/* Identity of a file, to know if it is the one the journal applies to. */
+typedef struct journalId {
+    long long size;     /* -1 if the file does not exist. */
+    long long mtime;    /* In nanoseconds. */
+    long long ino;
+} journalId;
+
+void followJournalId(journalId *id);
+void followReadTo(long long size);
+void followCut(long long size);
+
+static struct journalState {
+    int enabled;            /* Writer thread running. */
+    int replaying;          /* Recovering: the edits are not journaled. */
+    char *path;             /* The swap file. */
+    char *tmp;              /* Template of the temporary files where
+                               compacted journals are written. */
+    int marks;              /* Save marks issued so far. */
+    /* Shared with the writer, protected by 'lock'. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct abuf queue;      /* Records not yet taken by the writer. */
+    int last;               /* Offset of the last record in 'queue', or -1. */
+    journalId base;         /* File a new swap file applies to. */
+    int reset;              /* Remove the swap file before the queue. */
+    int stop;
+    int failed;             /* Writing failed: the edits are not journaled. */
+    pthread_t thread;
+    /* Used only by the writer. */
+    int fd;                 /* The swap file, locked, or -1 if not created
+                               yet. */
+    long long size;         /* Its size. */
+    long long resume;       /* Valid bytes of a recovered swap file. */
+    long long compact;      /* Size that triggers a compaction. */
+} J;
+
+static void journalFileId(const char *path, journalId *id) {
+    struct stat sb;
+    memset(id,0,sizeof(*id));
+    if (stat(path,&sb) == -1) {
+        id->size = -1;
+        return;
+    }
+    id->size = sb.st_size;
+    id->mtime = (long long)sb.st_mtim.tv_sec*1000000000+sb.st_mtim.tv_nsec;
+    id->ino = sb.st_ino;
+}
+
+/* FNV-1a of the record, but the checksum field, and its payload. */
+static uint32_t journalSum(const journalRec *r, const char *p) {
+    const unsigned char *s = (const unsigned char*)r+sizeof(r->sum);
+    uint32_t h = 2166136261u;
+    for (size_t j = 0; j < sizeof(*r)-sizeof(r->sum); j++)
+        h = (h^s[j])*16777619u;
+    for (int32_t j = 0; j < r->len; j++)
+        h = (h^(unsigned char)p[j])*16777619u;
+    return h;
+}
+
+/* If the 'len' bytes at 'p' start with a valid record, load its header
+ * in 'r' and return its size, otherwise return 0. */
+static size_t journalParse(const char *p, size_t len, journalRec *r) {
+    if (len < sizeof(*r)) return 0;
+    memcpy(r,p,sizeof(*r));
+    if (r->len < 0 || (size_t)r->len > len-sizeof(*r)) return 0;
+    if (journalSum(r,p+sizeof(*r)) != r->sum) return 0;
+    return sizeof(*r)+r->len;
+}
+
+static int journalSingleLine(const char *p, size_t len) {
+    return !memchr(p,'\n',len) && !memchr(p,'\r',len);
+}
+
+/* Append the record 'r' with payload 'p' to 'ab', where '*last' is the
+ * offset of the previous record or -1. Text inserted where the text of
+ * the previous record ends, on the same line, is merged with it, and so
+ * is deleting its last char, as long as it is ASCII, so that the glyph
+ * editorDelChar() removes is just that char. */
+static void journalAppend(struct abuf *ab, int *last, journalRec *r,
+                          const char *p)
+{
+    if (*last != -1) {
+        journalRec prev;
+        char *text = ab->b+*last+sizeof(prev);
+        memcpy(&prev,ab->b+*last,sizeof(prev));
+        if (prev.op == JOURNAL_TEXT && prev.row == r->row &&
+            prev.col+prev.len == r->col && journalSingleLine(text,prev.len))
+        {
+            if (r->op == JOURNAL_TEXT && prev.len+r->len <= JOURNAL_RUN &&
+                journalSingleLine(p,r->len))
+            {
+                abAppend(ab,p,r->len);
+                prev.len += r->len;
+                memcpy(ab->b+*last,&prev,sizeof(prev));
+                return;
+            }
+            if (r->op == JOURNAL_DEL && prev.len &&
+                (unsigned char)text[prev.len-1] < 0x80)
+            {
+                ab->len--;
+                prev.len--;
+                memcpy(ab->b+*last,&prev,sizeof(prev));
+                return;
+            }
         }
-        return 1;
     }
+    *last = ab->len;
+    abAppend(ab,(char*)r,sizeof(*r));
+    abAppend(ab,p,r->len);
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while((linelen = getline(&line,&linecap,fp)) != -1) {
-        if (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-            line[--linelen] = '\0';
-        editorInsertRow(E.numrows,line,linelen);
+/* Queue a record. Called in the main thread. */
+static void journalQueue(int op, int row, int col, int arg, const char *p,
+                         size_t len)
+{
+    journalRec r = {0,op,row,col,arg,len};
+    pthread_mutex_lock(&J.lock);
+    int wake = J.queue.len == 0;
+    if (!J.failed) journalAppend(&J.queue,&J.last,&r,p);
+    pthread_mutex_unlock(&J.lock);
+    if (wake) pthread_cond_signal(&J.cond);
+}
+
+/* Journal the editing command 'op' about to be executed at the cursor.
+ * 'arg' and the payload 'p' of length 'len' depend on the command. */
+void journalEdit(int op, int arg, const char *p, size_t len) {
+    if (!J.enabled || J.replaying) return;
+    journalQueue(op,E.rowoff+E.cy,E.cx,arg,p,len);
+}
+
+/* Mark the journal where the snapshot of a save is taken, returning the
+ * mark to pass to journalSaved(). */
+int journalMark(void) {
+    if (!J.enabled) return 0;
+    journalQueue(JOURNAL_MARK,0,0,++J.marks,NULL,0);
+    return J.marks;
+}
+
+/* The save of the snapshot taken at 'mark' completed. If the rows were
+ * not modified since, the swap file is no longer needed, otherwise the
+ * journal from the mark on applies to the new file. */
+void journalSaved(int mark, int modified) {
+    journalId id;
+    if (!J.enabled) return;
+    journalFileId(E.filename,&id);
+    if (modified) {
+        journalQueue(JOURNAL_SAVED,0,0,mark,(char*)&id,sizeof(id));
+        return;
+    }
+    pthread_mutex_lock(&J.lock);
+    J.queue.len = 0;
+    J.last = -1;
+    J.base = id;
+    J.reset = 1;
+    pthread_mutex_unlock(&J.lock);
+    pthread_cond_signal(&J.cond);
+}
+
+/* kilo -f read the followed file: the rows now hold the part of it 'id'.
+ * If 'dirty' the read is journaled between the edits, otherwise the
+ * journal starts again from the file as read so far, like after a save. */
+void journalFollow(int dirty, journalId *id) {
+    if (!J.enabled) return;
+    if (dirty) {
+        journalQueue(JOURNAL_FOLLOW,0,0,0,(char*)id,sizeof(*id));
+        return;
+    }
+    pthread_mutex_lock(&J.lock);
+    J.queue.len = 0;
+    J.last = -1;
+    J.base = *id;
+    J.reset = 1;
+    pthread_mutex_unlock(&J.lock);
+    pthread_cond_signal(&J.cond);
+}
+
+/* Writer failure: stop journaling and tell the user. */
+static void journalFailedMsg(void *unused) {
+    (void)unused;
+    editorSetStatusMessage("Can't write the swap file %s: edits are not "
+                           "journaled", J.path);
+}
+
+static void journalInUseMsg(void *unused) {
+    (void)unused;
+    editorSetStatusMessage("%s is in use by another kilo: edits are not "
+                           "journaled", J.path);
+}
+
+/* Stop journaling. If 'inuse' the swap file was locked by another kilo. */
+static void journalFail(int inuse) {
+    pthread_mutex_lock(&J.lock);
+    J.failed = 1;
+    J.queue.len = 0;
+    J.last = -1;
+    pthread_mutex_unlock(&J.lock);
+    if (J.fd != -1) close(J.fd);
+    J.fd = -1;
+    editorPostEvent(inuse ? journalInUseMsg : journalFailedMsg,NULL);
+}
+
+static int journalWriteAll(int fd, const char *p, size_t len) {
+    while(len) {
+        ssize_t n = write(fd,p,len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
     return 0;
 }
 
-/* Save the current file on disk. Return 0 on success, 1 on error. */
-int editorSave(void) {
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(E.filename,O_RDWR|O_CREAT,0644);
-    if (fd == -1) goto writeerr;
+/* Compute the checksums of the records in 'ab'. */
+static void journalSumAll(struct abuf *ab) {
+    journalRec r;
+    for (int off = 0; off < ab->len; off += sizeof(r)+r.len) {
+        memcpy(&r,ab->b+off,sizeof(r));
+        r.sum = journalSum(&r,ab->b+off+sizeof(r));
+        memcpy(ab->b+off,&r,sizeof(r));
+    }
+}
 
-    /* Use truncate + a single write(2) call in order to make saving
-     * a bit safer, under the limits of what we can do in a small editor. */
-    if (ftruncate(fd,len) == -1) goto writeerr;
-    if (write(fd,buf,len) != len) goto writeerr;
+/* Open the swap file at 'path', creating it if 'create' is true, and lock
+ * it, so that other instances know it is in use. The content is left
+ * alone: it may belong to another instance until the lock is ours.
+ * Returns the file descriptor, or -1 with errno set to EWOULDBLOCK if
+ * another instance holds the lock. */
+static int journalLock(const char *path, int create) {
+    struct stat fsb, psb;
 
-    close(fd);
-    free(buf);
-    E.dirty = 0;
-    editorSetStatusMessage("%d bytes written on disk", len);
+    while(1) {
+        int fd = open(path,O_RDWR|O_CLOEXEC|(create ? O_CREAT : 0),0600);
+        if (fd == -1) return -1;
+        if (flock(fd,LOCK_EX|LOCK_NB) == -1 || fstat(fd,&fsb) == -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        /* Before releasing it, the owner may have removed the file or
+         * replaced it with a compacted one: then lock the file that has
+         * the name now. */
+        int gone = stat(path,&psb) == -1;
+        if (!gone && psb.st_dev == fsb.st_dev && psb.st_ino == fsb.st_ino)
+            return fd;
+        close(fd);
+        if (gone && !create) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+}
+
+/* Replace the content of the locked swap file 'fd' with the magic followed
+ * by 'len' bytes of records. Returns 0 on success, -1 on error. */
+static int journalFill(int fd, const char *p, size_t len) {
+    if (ftruncate(fd,0) == -1 || lseek(fd,0,SEEK_SET) == -1 ||
+        journalWriteAll(fd,JOURNAL_MAGIC,8) == -1 ||
+        journalWriteAll(fd,p,len) == -1 || fsync(fd) == -1) return -1;
     return 0;
+}
+
+/* Rewrite the swap file dropping the records before the last save and
+ * merging adjacent records. Called by the writer. */
+static void journalCompact(void) {
+    struct abuf out = ABUF_INIT;
+    struct { int mark, off; } marks[JOURNAL_MARKS];
+    int nmarks = 0, last = -1;
+    char *buf = kmalloc(J.size), *tmp = NULL;
+    journalRec r;
+    size_t off = 8, n;
+
+    if (buf == NULL || pread(J.fd,buf,J.size,0) != J.size) goto done;
+    while((n = journalParse(buf+off,J.size-off,&r)) != 0) {
+        char *p = buf+off+sizeof(r);
+        off += n;
+        if (r.op == JOURNAL_SAVED) {
+            /* Keep what follows the mark, applied to the new file. */
+            int j = nmarks;
+            while(j && marks[j-1].mark != r.arg) j--;
+            if (j == 0) continue;
+            int cut = marks[j-1].off;
+            struct abuf tail = ABUF_INIT;
+            r.op = JOURNAL_BASE;
+            r.arg = 0;
+            abAppend(&tail,(char*)&r,sizeof(r));
+            abAppend(&tail,p,r.len);
+            int shift = tail.len-cut;
+            abAppend(&tail,out.b+cut,out.len-cut);
+            abFree(&out);
+            out = tail;
+            if (last != -1) last = last >= cut ? last+shift : -1;
+            nmarks -= j-1;
+            memmove(marks,marks+j-1,sizeof(marks[0])*nmarks);
+            for (j = 0; j < nmarks; j++) marks[j].off += shift;
+            continue;
+        }
+        if (r.op == JOURNAL_MARK) {
+            if (nmarks == JOURNAL_MARKS) {
+                memmove(marks,marks+1,sizeof(marks[0])*(--nmarks));
+            }
+            marks[nmarks].mark = r.arg;
+            marks[nmarks].off = out.len;
+            nmarks++;
+        }
+        journalAppend(&out,&last,&r,p);
+    }
+    journalSumAll(&out);
+
+    /* The new file is locked before it replaces the old one. */
+    size_t tmplen = strlen(J.tmp)+1;
+    tmp = kmalloc(tmplen);
+    if (tmp == NULL) goto done;
+    memcpy(tmp,J.tmp,tmplen);
+    int fd = mkstemp(tmp);
+    if (fd == -1) goto done;
+    fcntl(fd,F_SETFD,FD_CLOEXEC);
+    if (flock(fd,LOCK_EX|LOCK_NB) == -1 ||
+        journalFill(fd,out.b,out.len) == -1 || rename(tmp,J.path) == -1)
+    {
+        close(fd);
+        unlink(tmp);
+        goto done;
+    }
+    close(J.fd);
+    J.fd = fd;
+    J.size = 8+out.len;
+
+done:
+    /* If it failed, try again only once the journal doubled. */
+    J.compact = J.size*2 > JOURNAL_COMPACT ? J.size*2 : JOURNAL_COMPACT;
+    free(buf);
+    free(tmp);
+    abFree(&out);
+}
+
+/* Append a batch of records to the swap file, creating it if needed.
+ * Called by the writer. */
+static void journalWrite(struct abuf *batch, journalId *base) {
+    journalRec r;
+    int saved = 0;
+
+    for (int off = 0; off < batch->len; off += sizeof(r)+r.len) {
+        memcpy(&r,batch->b+off,sizeof(r));
+        if (r.op == JOURNAL_SAVED) saved = 1;
+    }
+    journalSumAll(batch);
+
+    if (J.resume) {
+        /* Continue the recovered journal, after its last valid record.
+         * It is still open and locked, see journalRecover(). */
+        J.size = J.resume;
+        J.resume = 0;
+        if (ftruncate(J.fd,J.size) == -1 || lseek(J.fd,0,SEEK_END) == -1) {
+            journalFail(0);
+            return;
+        }
+    } else if (J.fd == -1) {
+        struct abuf head = ABUF_INIT;
+        journalRec b = {0,JOURNAL_BASE,0,0,0,sizeof(*base)};
+        abAppend(&head,(char*)&b,sizeof(b));
+        abAppend(&head,(char*)base,sizeof(*base));
+        journalSumAll(&head);
+        J.fd = journalLock(J.path,1);
+        int inuse = J.fd == -1 && errno == EWOULDBLOCK;
+        if (J.fd != -1 && journalFill(J.fd,head.b,head.len) == -1) {
+            close(J.fd);
+            unlink(J.path);
+            J.fd = -1;
+        }
+        J.size = 8+head.len;
+        abFree(&head);
+        if (J.fd == -1) {
+            journalFail(inuse);
+            return;
+        }
+    }
+
+    if (journalWriteAll(J.fd,batch->b,batch->len) == -1 ||
+        fsync(J.fd) == -1)
+    {
+        journalFail(0);
+        return;
+    }
+    J.size += batch->len;
+    if (saved || J.size >= J.compact) journalCompact();
+}
+
+static void *journalWorker(void *unused) {
+    struct abuf batch = ABUF_INIT;
+    (void)unused;
+
+    pthread_mutex_lock(&J.lock);
+    while(1) {
+        while(J.queue.len == 0 && !J.reset && !J.stop)
+            pthread_cond_wait(&J.cond,&J.lock);
+        if (J.stop) break;
+        if (J.reset) {
+            /* The file was saved: the journal starts again. */
+            J.reset = 0;
+            pthread_mutex_unlock(&J.lock);
+            if (J.fd != -1 || J.resume) unlink(J.path);
+            if (J.fd != -1) close(J.fd);
+            J.fd = -1;
+            J.resume = 0;
+            pthread_mutex_lock(&J.lock);
+            continue;
+        }
+
+        /* Let the edits of the next few milliseconds join the batch.
+         * Only stopping or resetting signal the condition meanwhile. */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_nsec += JOURNAL_DELAY_MS*1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while(!J.stop && !J.reset &&
+              pthread_cond_timedwait(&J.cond,&J.lock,&until) != ETIMEDOUT);
+        if (J.stop) break;
+        if (J.reset || J.queue.len == 0) continue;
+
+        struct abuf tmp = batch;
+        batch = J.queue;
+        J.queue = tmp;
+        J.queue.len = 0;
+        J.last = -1;
+        journalId base = J.base;
+        pthread_mutex_unlock(&J.lock);
+        journalWrite(&batch,&base);
+        batch.len = 0;
+        pthread_mutex_lock(&J.lock);
+    }
+    pthread_mutex_unlock(&J.lock);
+    abFree(&batch);
+    return NULL;
+}
+
+/* Replay the records in the 'len' bytes at 'p'. Returns the number of
+ * editing commands replayed, stopping at the first invalid one. */
+static int journalReplay(const char *p, size_t len) {
+    journalRec r;
+    size_t off = 0, n;
+    int count = 0;
+
+    J.replaying = 1;
+    while((n = journalParse(p+off,len-off,&r)) != 0) {
+        const char *data = p+off+sizeof(r);
+        off += n;
+        if (r.op == JOURNAL_BASE || r.op == JOURNAL_MARK ||
+            r.op == JOURNAL_SAVED) continue;
+
+        if (r.op == JOURNAL_FOLLOW) {
+            journalId id;
+            if (!E.follow || r.len != sizeof(id)) break;
+            memcpy(&id,data,sizeof(id));
+            followReadTo(id.size);
+            continue;
+        }
+
+        if (r.op == JOURNAL_REPLACE) {
+            /* The only command that does not depend on the cursor. */
+            const char *with = memchr(data,'\0',r.len);
+            size_t wlen = with ? data+r.len-(with+1) : 0;
+            char s[KILO_QUERY_LEN+1], w[KILO_QUERY_LEN+1];
+            searchQuery q;
+            if (with == NULL || with-data > KILO_QUERY_LEN ||
+                wlen > KILO_QUERY_LEN) break;
+            memcpy(s,data,with-data+1);
+            memcpy(w,with+1,wlen);
+            w[wlen] = '\0';
+            memset(&q,0,sizeof(q));
+            if (searchSetQuery(&q,s,r.arg) == -1) break;
+            editorRowsFlatten();
+            editorReplaceAll(&q,w);
+            searchFreeQuery(&q);
+            count++;
+            continue;
+        }
+
+        if (r.row < 0 || r.row > E.numrows || r.col < 0) break;
+        erow *row = editorRowAt(r.row);
+        if (r.col > (row ? row->size : 0)) break;
+        E.rowoff = 0;
+        E.cy = r.row;
+        E.cx = r.col;
+        if (r.op == JOURNAL_TEXT) {
+            editorInsertText(data,r.len);
+        } else if (r.op == JOURNAL_CHAR) {
+            editorInsertChar(r.arg);
+        } else if (r.op == JOURNAL_NEWLINE) {
+            editorInsertNewline();
+        } else if (r.op == JOURNAL_DEL) {
+            editorDelChar();
+        } else {
+            break;
+        }
+        count++;
+    }
+    J.replaying = 0;
+    return count;
+}
+
+/* Return true if the identity 'rec', found in a journal, is the one of
+ * the file 'id'. For a followed file, see journalFollow(), it is enough
+ * that the file was not replaced and did not get shorter. */
+static int journalIdMatch(journalId *rec, journalId *id) {
+    if (rec->mtime == 0)
+        return E.follow && rec->ino == id->ino && rec->size <= id->size;
+    return memcmp(rec,id,sizeof(*id)) == 0;
+}
+
+/* Look for a swap file left by a previous session. If the file was not
+ * changed after it, and it has edits to recover, ask the user: if they
+ * want them back they are replayed, and the swap file, that stays locked,
+ * keeps journaling from there, otherwise it is removed. Returns -1 if
+ * another instance of kilo is editing the file, 0 otherwise. */
+static int journalRecover(void) {
+    struct stat sb;
+    char *buf = NULL;
+    int fd = journalLock(J.path,0), retval = 0;
+    journalId id, rec;
+    journalRec r;
+    size_t off = 8, n, start = 0;
+    struct { int mark; size_t off; } marks[JOURNAL_MARKS];
+    int nmarks = 0, edits = 0;
+    long long prefix = -1; /* Bytes of a followed file it applies to. */
+
+    if (fd == -1) return errno == EWOULDBLOCK ? -1 : 0;
+    if (fstat(fd,&sb) == -1 || sb.st_size < 8) goto done;
+    buf = kmalloc(sb.st_size);
+    if (buf == NULL || read(fd,buf,sb.st_size) != sb.st_size ||
+        memcmp(buf,JOURNAL_MAGIC,8)) goto done;
+
+    /* Find where the journal applying to the file as it is now starts. */
+    journalFileId(E.filename,&id);
+    while((n = journalParse(buf+off,sb.st_size-off,&r)) != 0) {
+        char *p = buf+off+sizeof(r);
+        off += n;
+        if (r.op == JOURNAL_MARK) {
+            if (nmarks == JOURNAL_MARKS)
+                memmove(marks,marks+1,sizeof(marks[0])*(--nmarks));
+            marks[nmarks].mark = r.arg;
+            marks[nmarks].off = off;
+            nmarks++;
+        } else if (r.op == JOURNAL_BASE || r.op == JOURNAL_SAVED) {
+            if (r.len != sizeof(rec)) continue;
+            memcpy(&rec,p,sizeof(rec));
+            if (!journalIdMatch(&rec,&id)) continue;
+            if (r.op == JOURNAL_BASE) {
+                start = off;
+                prefix = rec.mtime == 0 ? rec.size : -1;
+                continue;
+            }
+            int j = nmarks;
+            while(j && marks[j-1].mark != r.arg) j--;
+            if (j) {
+                start = marks[j-1].off;
+                prefix = rec.mtime == 0 ? rec.size : -1;
+            }
+        }
+    }
+
+    /* Count the edits to recover. */
+    for (size_t o = start; start && o < off; o += sizeof(r)+r.len) {
+        memcpy(&r,buf+o,sizeof(r));
+        if (r.op != JOURNAL_BASE && r.op != JOURNAL_MARK &&
+            r.op != JOURNAL_SAVED && r.op != JOURNAL_FOLLOW) edits++;
+    }
+
+    if (start == 0) {
+        editorSetStatusMessage("Swap file %s ignored: the file was changed "
+                               "after it", J.path);
+        goto done;
+    }
+    if (edits == 0) {
+        unlink(J.path);
+        goto done;
+    }
 
-writeerr:
+    printf("Found the swap file %s, with %d unsaved edits of %s.\n"
+           "Recover them? (y/n) ", J.path, edits, E.filename);
+    fflush(stdout);
+    char answer[16];
+    if (fgets(answer,sizeof(answer),stdin) && tolower(answer[0]) == 'y') {
+        /* A followed file grew since: start from what was read then. */
+        if (prefix != -1) followCut(prefix);
+        editorMapFinish();
+        int replayed = journalReplay(buf+start,off-start);
+        J.fd = fd;
+        J.resume = off;
+        fd = -1;
+        editorSetStatusMessage("%d edits recovered from %s",replayed,J.path);
+    } else {
+        unlink(J.path);
+    }
+
+done:
     free(buf);
     if (fd != -1) close(fd);
-    editorSetStatusMessage("Can't save! I/O error: %s",strerror(errno));
-    return 1;
+    return retval;
 }
 
-/* ============================= Terminal update ============================ */
+/* Start journaling the edits of the file just opened. If 'interactive'
+ * the user is asked about recovering the edits of a previous session,
+ * otherwise a swap file already there is left alone and the edits are not
+ * journaled. */
+void journalOpen(int interactive) {
+    char *slash = strrchr(E.filename,'/');
+    int dirlen = slash ? slash-E.filename+1 : 0;
+    size_t len = strlen(E.filename)+16;
+
+    pthread_mutex_init(&J.lock,NULL);
+    pthread_cond_init(&J.cond,NULL);
+    J.last = -1;
+    J.fd = -1;
+    J.compact = JOURNAL_COMPACT;
+    J.path = kmalloc(len);
+    J.tmp = kmalloc(len);
+    snprintf(J.path,len,"%.*s.%s.kswp",dirlen,E.filename,E.filename+dirlen);
+    snprintf(J.tmp,len,"%s.XXXXXX",J.path);
+    if (E.follow)
+        followJournalId(&J.base);
+    else
+        journalFileId(E.filename,&J.base);
+    if (interactive && journalRecover() == -1) {
+        journalInUseMsg(NULL);
+        return;
+    }
+    if (!interactive && access(J.path,F_OK) == 0) {
+        editorSetStatusMessage("Swap file %s found: edits are not "
+                               "journaled", J.path);
+        return;
+    }
+    J.enabled = pthread_create(&J.thread,NULL,journalWorker,NULL) == 0;
+}
 
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
-struct abuf {
-    char *b;
-    int len;
-};
+/* Stop journaling and remove the swap file, as kilo exits on purpose. */
+void journalClose(void) {
+    if (!J.enabled) return;
+    pthread_mutex_lock(&J.lock);
+    J.stop = 1;
+    pthread_mutex_unlock(&J.lock);
+    pthread_cond_signal(&J.cond);
+    pthread_join(J.thread,NULL);
+    J.enabled = 0;
+    if (J.fd != -1 || J.resume) unlink(J.path);
+    if (J.fd != -1) close(J.fd);
+}
 
-#define ABUF_INIT {NULL,0}
+/* =============================== Follow mode ============================== */
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b,ab->len+len);
+/* With kilo -f the file is followed like with tail -f: when some other
+ * process appends to it, just the new bytes are read, from the offset where
+ * the previous read stopped, and become rows added at the end of the file.
+ * If the view was showing the end of the file, it scrolls to show them. A
+ * last line without newline is a row that later data keeps growing.
+ *
+ * The file is watched with inotify where available, together with its
+ * directory so that a new file created with the same name is noticed,
+ * otherwise it is checked with fstat(2) every FOLLOW_POLL_MS milliseconds.
+ * The check is posted as an event, since the rows can only change in the
+ * main loop, not inside modal loops like find mode.
+ *
+ * When the file gets truncated, or rotated (the name now refers to a new
+ * file), it is read again from the start, but just compared with the rows:
+ * the rows the file still starts with are kept as they are, with their
+ * render and highlight, and only the other ones are replaced. This is only
+ * done when the buffer has no unsaved edits, that the rows replaced could
+ * hold: otherwise the file is no longer followed, and the user is warned,
+ * until the buffer is saved. Appended data is read in any case, and the
+ * reads are journaled with the edits, see journalFollow().
+ *
+ * Since other processes can truncate it, the file is never mapped in
+ * memory: accessing the mapped pages past the new end would kill kilo with
+ * SIGBUS. It is read into anonymous memory instead, that is still the
+ * backing store of the rows, so lines are not copied one by one. */
+
+#define FOLLOW_POLL_MS 500              /* Polling period without inotify. */
+#define FOLLOW_READ (1024*1024)         /* Bytes read at once. */
+#define FOLLOW_MAX_READ (64*1024*1024)  /* Max bytes read per check. */
+
+static struct followState {
+    int fd;             /* The file we are following, or -1 if missing. */
+    dev_t dev;          /* Its identity, to detect rotations. */
+    ino_t ino;
+    off_t offset;       /* Bytes of it already read. */
+    int partial;        /* The last row is a line without newline yet. */
+    int posted;         /* A check is posted and did not run yet. */
+    int stale;          /* Changed under unsaved edits: not reloaded. */
+    int ifd;            /* inotify instance, or -1 when polling. */
+    int wd;             /* inotify watch of the file, or -1. */
+    char *buf;          /* Read buffer of FOLLOW_READ bytes. */
+} F = {-1,0,0,0,0,0,0,-1,-1,NULL};
+
+static void followCheck(void *unused);
+
+/* Post a check of the file, unless one is already pending. */
+static void followPost(void) {
+    if (F.posted) return;
+    F.posted = 1;
+    editorPostEvent(followCheck,NULL);
+}
 
-    if (new == NULL) return;
-    memcpy(new+ab->len,s,len);
-    ab->b = new;
-    ab->len += len;
+/* inotify events are only used as a hint that something changed. */
+static void followNotified(void *unused) {
+    char buf[4096];
+    (void)unused;
+    while(read(F.ifd,buf,sizeof(buf)) > 0);
+    followPost();
+}
+
+static void followTimer(void *unused) {
+    (void)unused;
+    followPost();
+    editorAddTimer(FOLLOW_POLL_MS,followTimer,NULL);
+}
+
+/* Watch the file currently having our name, replacing the watch of the
+ * previous one. */
+static void followWatch(void) {
+#ifdef __linux__
+    if (F.ifd == -1) return;
+    if (F.wd != -1) inotify_rm_watch(F.ifd,F.wd);
+    F.wd = inotify_add_watch(F.ifd,E.filename,
+                             IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF);
+#endif
+}
+
+/* Add to the rows the 'len' bytes at 's', read from the file. */
+static void followAppend(char *s, size_t len) {
+    char *end = s+len;
+    while(s < end) {
+        char *nl = memchr(s,'\n',end-s);
+        size_t linelen = nl ? (size_t)(nl-s) : (size_t)(end-s);
+        if (F.partial && E.numrows) {
+            if (linelen) editorRowAppendString(editorRowAt(E.numrows-1),s,
+                                               linelen);
+        } else {
+            editorInsertRow(E.numrows,s,linelen);
+        }
+        F.partial = nl == NULL;
+        if (nl == NULL) break;
+        s = nl+1;
+    }
+}
+
+/* Read the file from F.offset up to 'size', or FOLLOW_MAX_READ bytes so
+ * that a big append does not block the editor for long. Returns 1 if
+ * there is more to read. */
+static int followRead(off_t size) {
+    off_t limit = F.offset+FOLLOW_MAX_READ;
+    while(F.offset < size && F.offset < limit) {
+        ssize_t n = pread(F.fd,F.buf,FOLLOW_READ,F.offset);
+        if (n <= 0) break;
+        followAppend(F.buf,n);
+        F.offset += n;
+    }
+    return F.offset < size;
+}
+
+/* Identity of the part of the file read so far, for the journal. */
+void followJournalId(journalId *id) {
+    id->size = F.offset;
+    id->mtime = 0;
+    id->ino = F.ino;
+}
+
+/* Read the file up to 'size', replaying the journal. */
+void followReadTo(long long size) {
+    off_t offset;
+    do {
+        offset = F.offset;
+        if (!followRead(size)) break;
+    } while(F.offset != offset);
+}
+
+/* Remove the rows after the first 'size' bytes of the file, just opened,
+ * to recover a journal that applies to them. */
+void followCut(long long size) {
+    while(E.numrows) {
+        erow *row = editorRowAt(E.numrows-1);
+        long long start = row->chars-E.map;
+        if (start < size) {
+            if (start+row->size > size) {
+                size_t len = size-start;
+                char *chars = kmalloc(len+1);
+                memcpy(chars,row->chars,len);
+                chars[len] = '\0';
+                editorRowSetChars(row,E.numrows-1,chars,len);
+            }
+            break;
+        }
+        editorDelRow(E.numrows-1);
+    }
+    F.offset = size;
+    F.partial = size && E.map[size-1] != '\n';
+    E.dirty = 0;
+}
+
+/* The file was truncated or replaced, so the rows after the part it still
+ * starts with are going to be replaced: unless the buffer has no unsaved
+ * edits, that would be lost, stop following the file until it is saved.
+ * Returns 1 if the rows can be reloaded. */
+static int followCanReload(int dirty) {
+    if (!dirty) {
+        F.stale = 0;
+        return 1;
+    }
+    if (!F.stale)
+        editorSetStatusMessage("%s was truncated or replaced: not reloaded "
+                               "until the edits are saved",E.filename);
+    F.stale = 1;
+    return 0;
+}
+
+/* The file was truncated or replaced: compare it with the rows from the
+ * start, keep the rows it still starts with, and replace the others with
+ * the rest of the file. Returns like followRead(). */
+static int followReload(off_t size) {
+    off_t off = 0;          /* File offset of F.buf[0]. */
+    off_t keep = 0;         /* File offset after the rows kept. */
+    size_t pos = 0, len = 0;
+    int kept = 0, partial = 0;
+
+    editorRowsFlatten();
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) {
+        /* Compare the row content, then its newline. */
+        size_t j = 0;
+        int match = 1;
+        while(match && j <= (size_t)row->size) {
+            if (pos == len) {
+                off += len;
+                ssize_t n = pread(F.fd,F.buf,FOLLOW_READ,off);
+                pos = 0;
+                len = n > 0 ? n : 0;
+                if (len == 0) break;
+            }
+            size_t n = row->size-j;
+            if (n > len-pos) n = len-pos;
+            if (n) {
+                match = memcmp(row->chars+j,F.buf+pos,n) == 0;
+            } else {
+                match = F.buf[pos] == '\n';
+                n = 1;
+            }
+            j += n;
+            pos += n;
+        }
+        if (!match) break;
+        if (j <= (size_t)row->size) {
+            /* The file ends here: keep the row if just its newline is
+             * missing, as a partial line. */
+            if (j == (size_t)row->size) {
+                kept++;
+                keep += j;
+                partial = 1;
+            }
+            break;
+        }
+        kept++;
+        keep += j;
+    }
+
+    while(E.numrows > kept) editorDelRow(E.numrows-1);
+    if (E.numrows == 0) editorFreeMap();
+    F.offset = keep;
+    F.partial = partial;
+    return followRead(size);
+}
+
+/* Check the file for changes. Called in the main loop. */
+static void followCheck(void *unused) {
+    int dirty = E.dirty, numrows = E.numrows, more = 0;
+    int bottom = E.rowoff+E.screenrows > E.numrows; /* End of file shown. */
+    struct stat sb;
+    (void)unused;
+
+    off_t offset = F.offset;
+    ino_t ino = F.ino;
+
+    F.posted = 0;
+    if (F.fd != -1 && !F.stale && fstat(F.fd,&sb) == 0) {
+        if (sb.st_size < F.offset) {
+            if (followCanReload(dirty)) more = followReload(sb.st_size);
+        } else if (sb.st_size > F.offset) {
+            more = followRead(sb.st_size);
+        }
+    }
+
+    /* Once the data appended to the file we have open is read, switch
+     * to the new file if it was rotated. A file no longer followed is
+     * opened again once the edits are saved, as the save may replace
+     * it as well. */
+    if (!more && stat(E.filename,&sb) == 0 &&
+        (F.stale || F.fd == -1 || sb.st_dev != F.dev || sb.st_ino != F.ino)
+        && followCanReload(dirty))
+    {
+        int fd = open(E.filename,O_RDONLY);
+        if (fd != -1 && fstat(fd,&sb) == 0) {
+            if (F.fd != -1) close(F.fd);
+            F.fd = fd;
+            F.dev = sb.st_dev;
+            F.ino = sb.st_ino;
+            followWatch();
+            more = followReload(sb.st_size);
+        } else if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    /* What is on disk is not a modification. */
+    E.dirty = dirty;
+    if (F.offset != offset || F.ino != ino) {
+        journalId id;
+        followJournalId(&id);
+        journalFollow(dirty,&id);
+    }
+    if (more) followPost();
+    if (bottom && E.numrows > numrows)
+        editorScrollLines(editorMaxRowoff()-E.rowoff);
+    else if (E.numrows < numrows)
+        editorScrollLines(0);
+}
+
+/* Open the file in follow mode. */
+void followOpen(char *filename) {
+    struct stat sb;
+
+    E.follow = 1;
+    size_t fnlen = strlen(filename)+1;
+    E.filename = kmalloc(fnlen);
+    memcpy(E.filename,filename,fnlen);
+    F.buf = kmalloc(FOLLOW_READ);
+
+    F.fd = open(filename,O_RDONLY);
+    if (F.fd == -1 && errno != ENOENT) {
+        perror("Opening file");
+        exit(1);
+    }
+    if (F.fd != -1) {
+        if (fstat(F.fd,&sb) == -1 || !S_ISREG(sb.st_mode)) {
+            fprintf(stderr,"kilo -f needs a regular file\n");
+            exit(1);
+        }
+        F.dev = sb.st_dev;
+        F.ino = sb.st_ino;
+        if (sb.st_size) {
+            char *map = mmap(NULL,sb.st_size,PROT_READ|PROT_WRITE,
+                             MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+            if (map == MAP_FAILED) {
+                perror("Reading file");
+                exit(1);
+            }
+            size_t got = 0;
+            ssize_t n;
+            while(got < (size_t)sb.st_size &&
+                  (n = read(F.fd,map+got,sb.st_size-got)) > 0) got += n;
+            E.map = map;
+            E.mapsize = sb.st_size;
+            editorMapRows(map,got);
+            F.offset = got;
+            F.partial = got && map[got-1] != '\n';
+        }
+    }
+    E.dirty = 0;
+
+#ifdef __linux__
+    /* New files with our name are created in the directory. */
+    F.ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (F.ifd != -1) {
+        char *dir = kmalloc(fnlen+1), *slash;
+        memcpy(dir,filename,fnlen);
+        slash = strrchr(dir,'/');
+        if (slash == NULL) strcpy(dir,".");
+        else slash[slash == dir] = '\0';
+        if (inotify_add_watch(F.ifd,dir,IN_CREATE|IN_MOVED_TO) == -1) {
+            close(F.ifd);
+            F.ifd = -1;
+        }
+        free(dir);
+    }
+    if (F.ifd != -1) {
+        editorWatchFd(F.ifd,followNotified);
+        followWatch();
+        return;
+    }
+#endif
+    editorAddTimer(FOLLOW_POLL_MS,followTimer,NULL);
+}
+
+/* =============================== Pager mode =============================== */
+
+/* kilo -R opens a file read only, without loading it in rows: the file is
+ * mapped in memory and the lines on screen are rendered directly from the
+ * mapping, so the first screen is shown immediately whatever the file
+ * size. To jump to a line number without scanning the file from the start,
+ * a background thread builds a sparse index with the offset of every
+ * PAGER_STEP-th line: the memory used is the index plus a constant.
+ *
+ * Moving by lines or pages and searching never need the index, and the
+ * search reads the file like the indexer does. The line numbers of the
+ * parts of the file not indexed yet are shown as "?", and jumps there are
+ * completed as soon as the index gets there. Lines are highlighted one by
+ * one: multi line comments are not tracked.
+ *
+ * Like the backing store of the editor, the mapping is protected by the
+ * guard of editorMapGuard(): if the file is truncated while shown, the
+ * pages past its end read as zeros instead of raising SIGBUS. */
+#define PAGER_STEP 1024             /* Lines between index entries. */
+#define PAGER_CHUNK_BITS 16
+#define PAGER_CHUNK_SIZE (1<<PAGER_CHUNK_BITS)
+#define PAGER_MAX_CHUNKS 4096       /* Lines up to 2^38 are indexed. */
+#define PAGER_NOTIFY (64*1024*1024) /* Refresh the progress every N bytes. */
+#define PAGER_READ (1024*1024)      /* Bytes read at once by the indexer. */
+
+static struct pagerState {
+    /* Written by the indexer thread. */
+    size_t *chunk[PAGER_MAX_CHUNKS]; /* Entry k is the offset of the line
+                                        k*PAGER_STEP. */
+    size_t entries;         /* Entries published. */
+    size_t scanned;         /* Bytes indexed so far. */
+    long long lines;        /* Lines in the file, valid when done. */
+    int done;               /* Set when the whole file is indexed. */
+    int fd;                 /* The file, read by the indexer. */
+    pthread_t thread;
+
+    /* Used by the main thread. */
+    size_t top;             /* Offset of the first line on screen. */
+    long long topline;      /* Its line number, or -1 if not known yet. */
+    long long goto_line;    /* Jump waiting for the index, or -1. */
+    searchQuery q;          /* Last search. */
+    size_t match;           /* Offset of the current match, or SEARCH_NONE. */
+} P;
+
+/* Return the offset of the newline ending the line at 'off', or the file
+ * size for the last line. */
+static size_t pagerLineEnd(size_t off) {
+    const char *nl = memchr(E.map+off,'\n',E.mapsize-off);
+    return nl ? (size_t)(nl-E.map) : E.mapsize;
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+/* Return the offset of the line after the one at 'off', or the file size
+ * if it is the last one. */
+static size_t pagerNextLine(size_t off) {
+    size_t eol = pagerLineEnd(off);
+    return eol < E.mapsize ? eol+1 : E.mapsize;
 }
 
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(void) {
-    int y;
-    erow *r;
-    char buf[32];
-    struct abuf ab = ABUF_INIT;
+/* Return the offset of the line before the one at 'off', or 0. */
+static size_t pagerPrevLine(size_t off) {
+    if (off == 0) return 0;
+    off--;
+    while(off > 0 && E.map[off-1] != '\n') off--;
+    return off;
+}
 
-    abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
-    abAppend(&ab,"\x1b[H",3); /* Go home. */
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = E.rowoff+y;
+/* Return the number of lines starting in the range from 'a' to 'b'-1, or
+ * 'max' if they are more. */
+static long long pagerCountLines(size_t a, size_t b, long long max) {
+    long long count = 0;
+    while(a < b && count < max) {
+        const char *nl = memchr(E.map+a,'\n',b-a);
+        count++;
+        if (nl == NULL) break;
+        a = nl-E.map+1;
+    }
+    return count;
+}
 
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows/3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome,sizeof(welcome),
-                    "Kilo editor -- verison %s\x1b[0K\r\n", KILO_VERSION);
-                int padding = (E.screencols-welcomelen)/2;
-                if (padding) {
-                    abAppend(&ab,"~",1);
-                    padding--;
-                }
-                while(padding--) abAppend(&ab," ",1);
-                abAppend(&ab,welcome,welcomelen);
-            } else {
-                abAppend(&ab,"~\x1b[0K\r\n",7);
+/* Build the line index. The file is read instead of scanned through the
+ * mapping, so that the pages read are not kept mapped in the process. */
+static void *pagerIndexer(void *arg) {
+    char *buf = kmalloc(PAGER_READ);
+    size_t off = 0, notify = PAGER_NOTIFY, n = 0;
+    long long lines = 0;
+    int bol = 1; /* The next byte starts a line. */
+
+    (void)arg;
+    while(off < E.mapsize) {
+        ssize_t nread = pread(P.fd,buf,PAGER_READ,off);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) break;
+
+        char *p = buf, *end = buf+nread;
+        while(p < end) {
+            if (bol && lines++ % PAGER_STEP == 0 &&
+                (n>>PAGER_CHUNK_BITS) < PAGER_MAX_CHUNKS)
+            {
+                size_t **chunk = &P.chunk[n>>PAGER_CHUNK_BITS];
+                if (*chunk == NULL)
+                    *chunk = kmalloc(sizeof(size_t)*PAGER_CHUNK_SIZE);
+                (*chunk)[n&(PAGER_CHUNK_SIZE-1)] = off+(p-buf);
+                __atomic_store_n(&P.entries,++n,__ATOMIC_RELEASE);
             }
-            continue;
+            char *nl = memchr(p,'\n',end-p);
+            bol = nl != NULL;
+            if (nl == NULL) break;
+            p = nl+1;
         }
-
-        r = &E.row[filerow];
-
-        int len = r->rsize - E.coloff;
-        int current_color = -1;
-        if (len > 0) {
-            if (len > E.screencols) len = E.screencols;
-            char *c = r->render+E.coloff;
-            unsigned char *hl = r->hl+E.coloff;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NONPRINT) {
-                    char sym;
-                    abAppend(&ab,"\x1b[7m",4);
-                    if (c[j] <= 26)
-                        sym = '@'+c[j];
-                    else
-                        sym = '?';
-                    abAppend(&ab,&sym,1);
-                    abAppend(&ab,"\x1b[0m",4);
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(&ab,"\x1b[39m",5);
-                        current_color = -1;
-                    }
-                    abAppend(&ab,c+j,1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        char buf[16];
-                        int clen = snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-                        current_color = color;
-                        abAppend(&ab,buf,clen);
-                    }
-                    abAppend(&ab,c+j,1);
-                }
-            }
+        off += nread;
+        if (off >= notify) {
+            __atomic_store_n(&P.scanned,off,__ATOMIC_RELAXED);
+            editorPostRefresh();
+            notify = off+PAGER_NOTIFY;
         }
-        abAppend(&ab,"\x1b[39m",5);
-        abAppend(&ab,"\x1b[0K",4);
-        abAppend(&ab,"\r\n",2);
     }
+    free(buf);
+    P.lines = lines;
+    __atomic_store_n(&P.scanned,E.mapsize,__ATOMIC_RELAXED);
+    __atomic_store_n(&P.done,1,__ATOMIC_RELEASE);
+    editorPostRefresh();
+    return NULL;
+}
 
-    /* Create a two rows status. First row: */
-    abAppend(&ab,"\x1b[0K",4);
-    abAppend(&ab,"\x1b[7m",4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename, E.numrows, E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus),
-        "%d/%d",E.rowoff+E.cy+1,E.numrows);
-    if (len > E.screencols) len = E.screencols;
-    abAppend(&ab,status,len);
-    while(len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(&ab,rstatus,rlen);
-            break;
-        } else {
-            abAppend(&ab," ",1);
-            len++;
-        }
+/* Return the offset of the line number 'line', or SEARCH_NONE if the index
+ * does not reach it yet. Lines past the end are the last line. */
+static size_t pagerLineOffset(long long line) {
+    int done = __atomic_load_n(&P.done,__ATOMIC_ACQUIRE);
+    size_t entries = __atomic_load_n(&P.entries,__ATOMIC_ACQUIRE);
+    if (done && line >= P.lines) line = P.lines-1;
+    if (line <= 0) return 0;
+    if (entries == 0) return done ? 0 : SEARCH_NONE;
+
+    size_t k = line/PAGER_STEP;
+    if (k >= entries || (k+1 == entries && !done)) return SEARCH_NONE;
+    size_t off = P.chunk[k>>PAGER_CHUNK_BITS][k&(PAGER_CHUNK_SIZE-1)];
+    for (long long j = (long long)k*PAGER_STEP; j < line; j++)
+        off = pagerNextLine(off);
+    return off;
+}
+
+/* Return the number of the line at offset 'off', or -1 if the index does
+ * not reach it yet. */
+static long long pagerLineNumber(size_t off) {
+    int done = __atomic_load_n(&P.done,__ATOMIC_ACQUIRE);
+    size_t entries = __atomic_load_n(&P.entries,__ATOMIC_ACQUIRE);
+    if (entries == 0) return done ? 0 : -1;
+
+    /* Find the last entry at or before 'off'. */
+    size_t lo = 0, hi = entries-1;
+    while(lo < hi) {
+        size_t mid = (lo+hi+1)/2;
+        if (P.chunk[mid>>PAGER_CHUNK_BITS][mid&(PAGER_CHUNK_SIZE-1)] <= off)
+            lo = mid;
+        else
+            hi = mid-1;
     }
-    abAppend(&ab,"\x1b[0m\r\n",6);
+    /* If it is the last entry so far, the line is known only if it is
+     * before where the next entry will be. */
+    size_t start = P.chunk[lo>>PAGER_CHUNK_BITS][lo&(PAGER_CHUNK_SIZE-1)];
+    long long count = pagerCountLines(start,off,PAGER_STEP);
+    if (lo+1 == entries && !done && count == PAGER_STEP) return -1;
+    return (long long)lo*PAGER_STEP+count;
+}
 
-    /* Second row depends on E.statusmsg and the status message update time. */
-    abAppend(&ab,"\x1b[0K",4);
-    int msglen = strlen(E.statusmsg);
-    if (msglen && time(NULL)-E.statusmsg_time < 5)
-        abAppend(&ab,E.statusmsg,msglen <= E.screencols ? msglen : E.screencols);
+/* Show the line at offset 'off', whose number is 'line' or -1 if not
+ * known, at the top of the screen. */
+static void pagerSetTop(size_t off, long long line) {
+    P.top = off;
+    P.topline = line;
+}
 
-    /* Put cursor at its current position. Note that the horizontal position
-     * at which the cursor is displayed may be different compared to 'E.cx'
-     * because of TABs. */
-    int j;
-    int cx = 1;
-    int filerow = E.rowoff+E.cy;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    if (row) {
-        for (j = E.coloff; j < (E.cx+E.coloff); j++) {
-            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
-            cx++;
-        }
+/* Scroll by 'n' lines, down if 'n' is positive. The last line of the file
+ * can go up to the top of the screen. */
+void pagerScroll(int n) {
+    for (; n > 0; n--) {
+        size_t next = pagerNextLine(P.top);
+        if (next >= E.mapsize) break;
+        pagerSetTop(next,P.topline == -1 ? -1 : P.topline+1);
     }
-    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.cy+1,cx);
-    abAppend(&ab,buf,strlen(buf));
-    abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
-    write(STDOUT_FILENO,ab.b,ab.len);
-    abFree(&ab);
+    for (; n < 0 && P.top > 0; n++)
+        pagerSetTop(pagerPrevLine(P.top),P.topline == -1 ? -1 : P.topline-1);
 }
 
-/* Set an editor status message for the second line of the status, at the
- * end of the screen. */
-void editorSetStatusMessage(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap,fmt);
-    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+/* Jump to the line number 'line', or as soon as the index reaches it. */
+void pagerGoto(long long line) {
+    if (__atomic_load_n(&P.done,__ATOMIC_ACQUIRE) && line >= P.lines)
+        line = P.lines-1;
+    if (line < 0) line = 0;
+    size_t off = pagerLineOffset(line);
+    if (off == SEARCH_NONE) {
+        P.goto_line = line;
+        editorSetStatusMessage("Indexing... jumping to line %lld when ready",
+            line+1);
+        return;
+    }
+    P.goto_line = -1;
+    pagerSetTop(off,line);
 }
 
-/* =============================== Find mode ================================ */
+/* Show the last screen of the file. */
+void pagerEnd(void) {
+    pagerSetTop(E.mapsize,-1);
+    pagerScroll(-E.screenrows);
+}
 
-#define KILO_QUERY_LEN 256
+/* Return the offset of the first match of the last query starting in the
+ * range from 'from' to 'to'-1, or SEARCH_NONE. Like the indexer, the file
+ * is read instead of scanned through the mapping, so that searching a big
+ * file does not make it all resident. Matches never span lines, so the
+ * chunks searched end at a newline, and start with the byte before the
+ * part to search, that a match at its start may need to check. A line
+ * longer than the buffer is searched in overlapping parts, taking only
+ * the matches that end before the end of the part. */
+static size_t pagerSearch(size_t from, size_t to) {
+    static char *buf;
+    size_t off = from ? from-1 : 0, pos = from-off;
+
+    if (buf == NULL) buf = kmalloc(PAGER_READ);
+    while(off+pos < to) {
+        size_t want = E.mapsize-off < PAGER_READ ? E.mapsize-off : PAGER_READ;
+        ssize_t nread = pread(P.fd,buf,want,off);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= (ssize_t)pos) break;  /* Truncated meanwhile. */
+
+        size_t len = nread, mlen, found;
+        int whole = off+len == E.mapsize; /* The chunk ends a line. */
+        while(!whole && len > pos && buf[len-1] != '\n') len--;
+        if (len > pos) {
+            whole = 1;
+        } else {
+            len = nread;
+        }
+        found = searchMemory(&P.q,buf,len,pos,&mlen);
+        if (found != SEARCH_NONE && (whole || found+mlen < len))
+            return off+found < to ? off+found : SEARCH_NONE;
+
+        /* Go on from the newline ending the chunk, or keep enough of a
+         * long line to find the matches that did not fit. */
+        size_t keep = whole ? 1 : (P.q.re ? PAGER_READ/2 : P.q.len+1);
+        if (len < keep+pos) break;
+        off += len-keep;
+        pos = 1;
+    }
+    return SEARCH_NONE;
+}
 
-void editorFind(int fd) {
-    char query[KILO_QUERY_LEN+1] = {0};
-    int qlen = 0;
-    int last_match = -1; /* Last line where a match was found. -1 for none. */
-    int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
-    char *saved_hl = NULL;
+/* Search the next match of the last query after the current one, or from
+ * the top of the screen, wrapping around at the end of the file. */
+void pagerFindNext(void) {
+    if (P.q.len == 0 || E.mapsize == 0) return;
+    size_t from = P.match == SEARCH_NONE ? P.top : P.match+1;
+    size_t found = pagerSearch(from,E.mapsize);
+    if (found == SEARCH_NONE) {
+        found = pagerSearch(0,from);
+        if (found != SEARCH_NONE)
+            editorSetStatusMessage("Search wrapped around the end of file");
+    }
+    P.match = found;
+    if (found == SEARCH_NONE) {
+        editorSetStatusMessage("No match for '%s'",P.q.s);
+        return;
+    }
 
-#define FIND_RESTORE_HL do { \
-    if (saved_hl) { \
-        memcpy(E.row[saved_hl_line].hl,saved_hl, E.row[saved_hl_line].rsize); \
-        free(saved_hl); \
-        saved_hl = NULL; \
-    } \
-} while (0)
+    /* Show the line of the match at the top, and the match on screen. */
+    size_t start = found;
+    while(start > 0 && E.map[start-1] != '\n') start--;
+    pagerSetTop(start,pagerLineNumber(start));
 
-    /* Save the cursor position in order to restore it later. */
-    int saved_cx = E.cx, saved_cy = E.cy;
-    int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+    int rx = 0;
+    for (size_t j = start; j < found; j++)
+        rx = E.map[j] == TAB ? (rx+1) | 7 : rx+1;
+    E.coloff = rx < E.screencols ? 0 : rx-E.screencols/2;
+}
 
-    while(1) {
-        editorSetStatusMessage(
-            "Search: %s (Use ESC/Arrows/Enter)", query);
-        editorRefreshScreen();
+/* Called before drawing: complete the pending jump and find the number
+ * of the top line when the index gets there. */
+static void pagerPoll(void) {
+    if (P.goto_line != -1 && pagerLineOffset(P.goto_line) != SEARCH_NONE) {
+        pagerGoto(P.goto_line);
+        editorSetStatusMessage("");
+    }
+    if (P.topline == -1) P.topline = pagerLineNumber(P.top);
+}
 
-        int c = editorReadKey(fd);
-        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
-            if (qlen != 0) query[--qlen] = '\0';
-            last_match = -1;
-        } else if (c == ESC || c == ENTER) {
-            if (c == ESC) {
-                E.cx = saved_cx; E.cy = saved_cy;
-                E.coloff = saved_coloff; E.rowoff = saved_rowoff;
-            }
-            FIND_RESTORE_HL;
-            editorSetStatusMessage("");
-            return;
-        } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
-            find_next = 1;
-        } else if (c == ARROW_LEFT || c == ARROW_UP) {
-            find_next = -1;
-        } else if (isprint(c)) {
-            if (qlen < KILO_QUERY_LEN) {
-                query[qlen++] = c;
-                query[qlen] = '\0';
-                last_match = -1;
-            }
+/* Draw the lines on screen in the back buffer. */
+void pagerDrawRows(void) {
+    static char *render;
+    static unsigned char *hl;
+    static int cap;
+    int width = E.coloff+E.screencols;
+    size_t off = P.top;
+
+    pagerPoll();
+    if (width*4+8 > cap) {
+        cap = width*4+8;
+        render = krealloc(render,cap);
+        hl = krealloc(hl,cap);
+    }
+    for (int y = 0; y < E.screenrows; y++) {
+        if (off >= E.mapsize) {
+            screenPut(y,0,"~",1,0);
+            continue;
         }
-
-        /* Search occurrence. */
-        if (last_match == -1) find_next = 1;
-        if (find_next) {
-            char *match = NULL;
-            int match_offset = 0;
-            int i, current = last_match;
-
-            for (i = 0; i < E.numrows; i++) {
-                current += find_next;
-                if (current == -1) current = E.numrows-1;
-                else if (current == E.numrows) current = 0;
-                match = strstr(E.row[current].render,query);
-                if (match) {
-                    match_offset = match-E.row[current].render;
-                    break;
-                }
-            }
-            find_next = 0;
-
-            /* Highlight */
-            FIND_RESTORE_HL;
-
-            if (match) {
-                erow *row = &E.row[current];
-                last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = malloc(row->rsize);
-                    memcpy(saved_hl,row->hl,row->rsize);
-                    memset(row->hl+match_offset,HL_MATCH,qlen);
-                }
-                E.cy = 0;
-                E.cx = match_offset;
-                E.rowoff = current;
-                E.coloff = 0;
-                /* Scroll horizontally as needed. */
-                if (E.cx > E.screencols) {
-                    int diff = E.cx - E.screencols;
-                    E.cx -= diff;
-                    E.coloff += diff;
+        size_t eol = pagerLineEnd(off), len = eol-off;
+        if (len && E.map[eol-1] == '\r') len--;
+
+        /* Render just the columns up to the right edge of the screen. */
+        int n = 0, col = 0, match = -1;
+        for (size_t j = off; j < off+len && col < width && n+8 < cap; ) {
+            unsigned char c = E.map[j];
+            if (j == P.match) match = n;
+            if (c == TAB) {
+                render[n++] = ' ';
+                col++;
+                while((col+1) % 8 != 0) {
+                    render[n++] = ' ';
+                    col++;
                 }
+                j++;
+            } else if (c < 0x80) {
+                render[n++] = c;
+                col++;
+                j++;
+            } else {
+                int cp, glen = utf8Decode(E.map+j,off+len-j,&cp);
+                memcpy(render+n,E.map+j,glen);
+                n += glen;
+                j += glen;
+                col += utf8Width(cp);
             }
         }
+        editorSyntaxLex(E.syntax,render,n,hl,0);
+        if (match != -1)
+            memset(hl+match,HL_MATCH|ATTR_REVERSE,
+                   n-match < (int)P.q.len ? n-match : (int)P.q.len);
+        screenPutText(y,0,render,n,hl,0,E.coloff);
+        off = eol < E.mapsize ? eol+1 : E.mapsize;
     }
 }
 
-/* ========================= Editor events handling  ======================== */
+/* Fill the status bar texts, see editorDrawStatus(). */
+void pagerStatus(char *status, size_t slen, char *rstatus, size_t rlen) {
+    char total[32];
+    if (__atomic_load_n(&P.done,__ATOMIC_ACQUIRE)) {
+        snprintf(total,sizeof(total),"%lld",P.lines);
+    } else {
+        size_t scanned = __atomic_load_n(&P.scanned,__ATOMIC_RELAXED);
+        snprintf(total,sizeof(total),"%lld+ (indexing %d%%)",
+            (long long)__atomic_load_n(&P.entries,__ATOMIC_RELAXED)*PAGER_STEP,
+            (int)(scanned*100/E.mapsize));
+    }
+    snprintf(status,slen,"%.20s - %s lines [read only]",E.filename,total);
+    if (P.topline == -1)
+        snprintf(rstatus,rlen,"?");
+    else
+        snprintf(rstatus,rlen,"%lld",P.topline+1);
+}
 
-/* Handle cursor position change because arrow keys were pressed. */
-void editorMoveCursor(int key) {
-    int filerow = E.rowoff+E.cy;
-    int filecol = E.coloff+E.cx;
-    int rowlen;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+/* Open the file in pager mode. */
+void pagerOpen(char *filename) {
+    struct stat sb;
 
-    switch(key) {
-    case ARROW_LEFT:
-        if (E.cx == 0) {
-            if (E.coloff) {
-                E.coloff--;
-            } else {
-                if (filerow > 0) {
-                    E.cy--;
-                    E.cx = E.row[filerow-1].size;
-                    if (E.cx > E.screencols-1) {
-                        E.coloff = E.cx-E.screencols+1;
-                        E.cx = E.screencols-1;
-                    }
-                }
-            }
-        } else {
-            E.cx -= 1;
-        }
+    size_t fnlen = strlen(filename)+1;
+    E.filename = kmalloc(fnlen);
+    memcpy(E.filename,filename,fnlen);
+    P.topline = 0;
+    P.goto_line = -1;
+    P.match = SEARCH_NONE;
+
+    int fd = open(filename,O_RDONLY);
+    if (fd == -1 || fstat(fd,&sb) == -1) {
+        perror("Opening file");
+        exit(1);
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        fprintf(stderr,"kilo -R needs a regular file\n");
+        exit(1);
+    }
+    if (sb.st_size == 0) {
+        P.done = 1;
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (map == MAP_FAILED) {
+        perror("Mapping file");
+        exit(1);
+    }
+    P.fd = fd;
+    E.map = map;
+    E.mapsize = E.maploaded = sb.st_size; /* No rows to create. */
+    editorMapGuard(fd);
+    if (pthread_create(&P.thread,NULL,pagerIndexer,NULL) != 0)
+        pagerIndexer(NULL);
+}
+
+/* Process a key in pager mode. */
+void pagerProcessKeypress(int fd) {
+    char buf[32];
+    int c = editorReadKey(fd);
+
+    switch(c) {
+    case KEY_NULL: break;
+    case 'q':
+    case CTRL_Q: exit(0); break;
+    case ARROW_UP: case 'k': pagerScroll(-1); break;
+    case ARROW_DOWN: case 'j': case ENTER: pagerScroll(1); break;
+    case ARROW_LEFT: if (E.coloff) E.coloff--; break;
+    case ARROW_RIGHT: E.coloff++; break;
+    case PAGE_UP: case 'b': pagerScroll(-E.screenrows); break;
+    case PAGE_DOWN: case ' ': pagerScroll(E.screenrows); break;
+    case HOME_KEY: case CTRL_HOME: case 'g': pagerGoto(0); break;
+    case END_KEY: case CTRL_END: case 'G': pagerEnd(); break;
+    case CTRL_G:
+        buf[0] = '\0';
+        if (editorPrompt(fd,"Go to line (ESC to cancel): ",buf,sizeof(buf)) &&
+            atoll(buf) > 0) pagerGoto(atoll(buf)-1);
         break;
-    case ARROW_RIGHT:
-        if (row && filecol < row->size) {
-            if (E.cx == E.screencols-1) {
-                E.coloff++;
-            } else {
-                E.cx += 1;
-            }
-        } else if (row && filecol == row->size) {
-            E.cx = 0;
-            E.coloff = 0;
-            if (E.cy == E.screenrows-1) {
-                E.rowoff++;
-            } else {
-                E.cy += 1;
-            }
-        }
+    case CTRL_F:
+    case '/': {
+        char query[KILO_QUERY_LEN+1] = {0};
+        if (!editorPrompt(fd,"Search (ESC to cancel): ",query,sizeof(query)))
+            break;
+        if (query[0]) searchSetQuery(&P.q,query,0);
+        P.match = SEARCH_NONE;
+        pagerFindNext();
         break;
-    case ARROW_UP:
-        if (E.cy == 0) {
-            if (E.rowoff) E.rowoff--;
-        } else {
-            E.cy -= 1;
+    }
+    case 'n': pagerFindNext(); break;
+    case CTRL_L: E.front_valid = 0; break;
+    case CTRL_T: E.stats_overlay = !E.stats_overlay; break;
+    }
+}
+
+/* ============================= Benchmark mode ============================= */
+
+/* kilo -B <script> <file> replays a script of keystrokes without a
+ * terminal: the keys are fed to the input queue as if the terminal sent
+ * them, and the frames are composed as usual but not written anywhere, so
+ * the whole editor is measured except the terminal itself.
+ *
+ * Every line of the script is an operation, repeated 'count' times:
+ *
+ *   type <count> <text>    Type the text, every byte is a keystroke.
+ *   key <count> <name>     Press a key: up, down, left, right, home, end,
+ *                          pageup, pagedown, del, backspace, enter, esc,
+ *                          tab, ctrl-a ... ctrl-z.
+ *   raw <count> <bytes>    Send the bytes at once, like a single keystroke.
+ *   paste <count> <text>   Send the text as a bracketed paste.
+ *
+ * Text supports the \n \r \t \e \\ and \xHH escapes, and lines starting
+ * with # are comments. A keystroke lasts from the moment its bytes are
+ * queued to the moment the editor waits for more input, so it includes
+ * the screen refresh. When the script is over a report is printed with
+ * the latency percentiles of every operation, the bytes of the frames
+ * and the memory allocations. */
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+
+typedef struct benchOp {
+    char *line;         /* The script line, for the report. */
+    char *keys;         /* Bytes to send. */
+    int len;            /* Length of 'keys'. */
+    int step;           /* Bytes sent per keystroke, 'len' or 1. */
+    int count;          /* Times 'keys' is sent. */
+    int done;           /* Keystrokes replayed so far. */
+    long long *lat;     /* Latency of every keystroke, in microseconds. */
+    long long bytes;    /* Frame bytes emitted by this operation. */
+    long long allocs;   /* Allocations done by this operation. */
+} benchOp;
+
+static struct benchState {
+    benchOp *op;
+    int numops;
+    int cur;                /* Operation being replayed. */
+    long long start;        /* When the last keystroke was queued, or 0. */
+    long long bytes, allocs; /* Counters when it was queued. */
+    long long open_time;    /* Time to the first frame, in microseconds, */
+    long long load_time;    /* and to create all the rows. */
+    long long begin;        /* When the replay started. */
+} B;
+
+static const struct {
+    const char *name;
+    const char *seq;
+} benchKeys[] = {
+    {"up","\x1b[A"}, {"down","\x1b[B"}, {"right","\x1b[C"}, {"left","\x1b[D"},
+    {"home","\x1b[H"}, {"end","\x1b[F"}, {"pageup","\x1b[5~"},
+    {"pagedown","\x1b[6~"}, {"del","\x1b[3~"}, {"backspace","\x7f"},
+    {"ctrl-home","\x1b[1;5H"}, {"ctrl-end","\x1b[1;5F"},
+    {"enter","\r"}, {"esc","\x1b"}, {"tab","\t"}, {NULL,NULL}
+};
+
+/* Unescape 's' into 'dst', that must be at least as long. Returns the
+ * length of the result. */
+static int benchUnescape(const char *s, char *dst) {
+    int len = 0;
+    while(*s) {
+        if (*s != '\\' || s[1] == '\0') {
+            dst[len++] = *s++;
+            continue;
         }
-        break;
-    case ARROW_DOWN:
-        if (filerow < E.numrows) {
-            if (E.cy == E.screenrows-1) {
-                E.rowoff++;
-            } else {
-                E.cy += 1;
+        s++;
+        switch(*s) {
+        case 'n': dst[len++] = '\n'; break;
+        case 'r': dst[len++] = '\r'; break;
+        case 't': dst[len++] = '\t'; break;
+        case 'e': dst[len++] = ESC; break;
+        case 'x':
+            if (isxdigit((unsigned char)s[1]) &&
+                isxdigit((unsigned char)s[2]))
+            {
+                char hex[3] = {s[1],s[2],0};
+                dst[len++] = strtol(hex,NULL,16);
+                s += 2;
+                break;
             }
+            /* Fall through. */
+        default: dst[len++] = *s; break;
         }
-        break;
+        s++;
     }
-    /* Fix cx if the current line has not enough chars. */
-    filerow = E.rowoff+E.cy;
-    filecol = E.coloff+E.cx;
-    row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    rowlen = row ? row->size : 0;
-    if (filecol > rowlen) {
-        E.cx -= filecol-rowlen;
-        if (E.cx < 0) {
-            E.coloff += E.cx;
-            E.cx = 0;
+    return len;
+}
+
+/* Load the script, exiting with an error message if it is not valid. */
+void benchLoad(char *filename) {
+    FILE *fp = fopen(filename,"r");
+    char line[KILO_INBUF];
+    int lineno = 0;
+
+    if (!fp) {
+        perror("Opening the benchmark script");
+        exit(1);
+    }
+    while(fgets(line,sizeof(line),fp)) {
+        char cmd[16], *arg;
+        int count, skip;
+
+        lineno++;
+        line[strcspn(line,"\r\n")] = '\0';
+        if (line[0] == '#' || line[strspn(line," \t")] == '\0') continue;
+        if (sscanf(line,"%15s %d %n",cmd,&count,&skip) != 2 || count < 1)
+            goto syntaxerr;
+        arg = line+skip;
+
+        benchOp *op;
+        B.op = krealloc(B.op,sizeof(benchOp)*(B.numops+1));
+        op = B.op+B.numops;
+        memset(op,0,sizeof(*op));
+        op->line = strdup(line);
+        op->count = count;
+        op->keys = kmalloc(strlen(arg)+16);
+        if (!strcmp(cmd,"type")) {
+            op->len = benchUnescape(arg,op->keys);
+            /* Terminals send CR for the enter key. */
+            for (int j = 0; j < op->len; j++)
+                if (op->keys[j] == '\n') op->keys[j] = '\r';
+            op->step = 1;
+        } else if (!strcmp(cmd,"raw")) {
+            op->len = benchUnescape(arg,op->keys);
+            op->step = op->len;
+        } else if (!strcmp(cmd,"paste")) {
+            memcpy(op->keys,"\x1b[200~",6);
+            op->len = 6+benchUnescape(arg,op->keys+6);
+            memcpy(op->keys+op->len,"\x1b[201~",6);
+            op->len += 6;
+            op->step = op->len;
+        } else if (!strcmp(cmd,"key")) {
+            int j;
+            for (j = 0; benchKeys[j].name; j++)
+                if (!strcmp(arg,benchKeys[j].name)) break;
+            if (benchKeys[j].name) {
+                strcpy(op->keys,benchKeys[j].seq);
+            } else if (!strncmp(arg,"ctrl-",5) && arg[6] == '\0' &&
+                       arg[5] >= 'a' && arg[5] <= 'z') {
+                op->keys[0] = arg[5]-'a'+1;
+                op->keys[1] = '\0';
+            } else {
+                goto syntaxerr;
+            }
+            op->len = op->step = strlen(op->keys);
+        } else {
+            goto syntaxerr;
         }
+        if (op->len == 0 || op->step > KILO_INBUF) goto syntaxerr;
+        op->lat = kmalloc(sizeof(long long)*op->count*(op->len/op->step));
+        B.numops++;
     }
+    fclose(fp);
+    return;
+
+syntaxerr:
+    fprintf(stderr,"%s:%d: invalid benchmark script line\n",filename,lineno);
+    exit(1);
 }
 
-/* Process events arriving from the standard input, which is, the user
- * is typing stuff on the terminal. */
-#define KILO_QUIT_TIMES 3
-void editorProcessKeypress(int fd) {
-    /* When the file is modified, requires Ctrl-q to be pressed N times
-     * before actually quitting. */
-    static int quit_times = KILO_QUIT_TIMES;
+static int benchCompare(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
 
-    int c = editorReadKey(fd);
-    switch(c) {
-    case ENTER:         /* Enter */
-        editorInsertNewline();
-        break;
-    case CTRL_C:        /* Ctrl-c */
-        /* We ignore ctrl-c, it can't be so simple to lose the changes
-         * to the edited file. */
-        break;
-    case CTRL_Q:        /* Ctrl-q */
-        /* Quit if the file was already saved. */
-        if (E.dirty && quit_times) {
-            editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                "Press Ctrl-Q %d more times to quit.", quit_times);
-            quit_times--;
-            return;
-        }
-        exit(0);
-        break;
-    case CTRL_S:        /* Ctrl-s */
-        editorSave();
-        break;
-    case CTRL_F:
-        editorFind(fd);
-        break;
-    case BACKSPACE:     /* Backspace */
-    case CTRL_H:        /* Ctrl-h */
-    case DEL_KEY:
-        editorDelChar();
-        break;
-    case PAGE_UP:
-    case PAGE_DOWN:
-        if (c == PAGE_UP && E.cy != 0)
-            E.cy = 0;
-        else if (c == PAGE_DOWN && E.cy != E.screenrows-1)
-            E.cy = E.screenrows-1;
-        {
-        int times = E.screenrows;
-        while(times--)
-            editorMoveCursor(c == PAGE_UP ? ARROW_UP:
-                                            ARROW_DOWN);
-        }
-        break;
+/* Print the report. Called at exit, so it also works when the script
+ * quits the editor. */
+void benchReport(void) {
+    long long total = 0, elapsed = ustime()-B.begin;
+    struct rusage ru;
+
+    printf("open: %.3f ms, %d rows loaded in %.3f ms\n\n",
+        B.open_time/1000.0,E.numrows,B.load_time/1000.0);
+    printf("%-32s %8s %9s %9s %9s %9s %10s %9s\n","operation","keys",
+        "p50 us","p90 us","p99 us","max us","bytes/key","allocs/key");
+    for (int j = 0; j < B.numops; j++) {
+        benchOp *op = B.op+j;
+        int n = op->done;
+        if (n == 0) continue;
+        qsort(op->lat,n,sizeof(long long),benchCompare);
+        printf("%-32.32s %8d %9lld %9lld %9lld %9lld %10lld %9lld\n",
+            op->line,n,op->lat[(n-1)*50/100],op->lat[(n-1)*90/100],
+            op->lat[(n-1)*99/100],op->lat[n-1],op->bytes/n,op->allocs/n);
+        total += n;
+    }
+    getrusage(RUSAGE_SELF,&ru);
+    printf("\n%lld keys in %.3f s, %lld frames, %lld bytes, %lld allocs, "
+           "peak RSS %ld kB\n", total, elapsed/1000000.0, E.stats.frames,
+           E.stats.bytes, E.stats.allocs,
+#ifdef __APPLE__
+           ru.ru_maxrss/1024
+#else
+           ru.ru_maxrss
+#endif
+           );
+}
 
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-        editorMoveCursor(c);
-        break;
-    case CTRL_L: /* ctrl+l, clear screen */
-        /* Just refresht the line as side effect. */
-        break;
-    case ESC:
-        /* Nothing to do for ESC in this mode. */
-        break;
-    default:
-        editorInsertChar(c);
-        break;
+/* Called by the event loop when the editor waits for input: account the
+ * last keystroke and queue the next one. At the end of the script the
+ * editor exits. Returns 1 as there is always input ready. */
+int benchFeed(void) {
+    long long now = ustime();
+
+    if (B.start) {
+        benchOp *op = B.op+B.cur;
+        op->lat[op->done++] = now-B.start;
+        op->bytes += E.stats.bytes-B.bytes;
+        op->allocs += __atomic_load_n(&E.stats.allocs,__ATOMIC_RELAXED)-
+                      B.allocs;
+        if (op->done == op->count*(op->len/op->step)) B.cur++;
+    } else {
+        B.begin = now;
+    }
+    if (B.cur == B.numops) {
+        journalClose();
+        exit(0);
     }
 
-    quit_times = KILO_QUIT_TIMES; /* Reset it to the original value. */
+    benchOp *op = B.op+B.cur;
+    int off = (op->done*op->step) % op->len;
+    memcpy(E.inbuf,op->keys+off,op->step);
+    E.inpos = 0;
+    E.inlen = op->step;
+    statsInputArrived();
+    B.bytes = E.stats.bytes;
+    B.allocs = __atomic_load_n(&E.stats.allocs,__ATOMIC_RELAXED);
+    B.start = ustime();
+    return 1;
 }
 
-int editorFileWasModified(void) {
-    return E.dirty;
+/* Start the benchmark mode: the standard input is replaced by a pipe
+ * nobody writes to, that is a terminal that never sends more keys than
+ * the ones queued by benchFeed(). */
+void benchStart(void) {
+    int fd[2];
+    if (pipe(fd) == -1 || dup2(fd[0],STDIN_FILENO) == -1) {
+        perror("Creating the benchmark input pipe");
+        exit(1);
+    }
+    fcntl(STDIN_FILENO,F_SETFL,fcntl(STDIN_FILENO,F_GETFL)|O_NONBLOCK);
+    close(fd[0]);
+    atexit(benchReport);
 }
 
 void updateWindowSize(void) {
+    if (E.bench) {
+        E.screenrows = BENCH_ROWS-2;
+        E.screencols = BENCH_COLS;
+        return;
+    }
     if (getWindowSize(STDIN_FILENO,STDOUT_FILENO,
                       &E.screenrows,&E.screencols) == -1) {
         perror("Unable to query the screen for size (columns / rows)");
@@ -1267,42 +8160,109 @@ void updateWindowSize(void) {
     E.screenrows -= 2; /* Get room for status bar. */
 }
 
-void handleSigWinCh(int unused __attribute__((unused))) {
-    updateWindowSize();
-    if (E.cy > E.screenrows) E.cy = E.screenrows - 1;
-    if (E.cx > E.screencols) E.cx = E.screencols - 1;
-    editorRefreshScreen();
-}
-
 void initEditor(void) {
     E.cx = 0;
     E.cy = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = rowsNewNode(1);
     E.dirty = 0;
     E.filename = NULL;
+    E.map = NULL;
+    E.mapsize = 0;
+    E.maploaded = 0;
+    E.save = NULL;
+    E.inpos = E.inlen = 0;
+    E.hl_npending = 0;
+    E.hl_force = 0;
+    E.hl_job = NULL;
+    E.hl_edit_min = INT_MAX;
+    E.cache_bytes = 0;
+    E.cache_clock = 0;
+    memset(&E.front,0,sizeof(E.front));
+    memset(&E.back,0,sizeof(E.back));
+    E.front_valid = 0;
+    E.cursor_y = E.cursor_x = -1;
+    screenInitColors();
+    memset(&E.stats,0,sizeof(E.stats));
+    E.stats_overlay = 0;
     E.syntax = NULL;
+    E.statusmsg_timer = -1;
     updateWindowSize();
+    editorEventInit();
     signal(SIGWINCH, handleSigWinCh);
+
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_sigaction = handleSigBus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS,&sa,NULL);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr,"Usage: kilo <filename>\n");
+    char *filename = NULL, *script = NULL;
+    int pager = 0, follow = 0;
+
+    for (int j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"-B") && j+1 < argc) {
+            script = argv[++j];
+        } else if (!strcmp(argv[j],"-R")) {
+            pager = 1;
+        } else if (!strcmp(argv[j],"-f")) {
+            follow = 1;
+        } else if (filename == NULL) {
+            filename = argv[j];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (filename == NULL || (pager && follow)) {
+        fprintf(stderr,"Usage: kilo [-B <script>] [-R|-f] <filename>\n");
         exit(1);
     }
+    if (script) {
+        E.bench = 1;
+        benchLoad(script);
+    }
 
     initEditor();
-    editorSelectSyntaxHighlight(argv[1]);
-    editorOpen(argv[1]);
-    enableRawMode(STDIN_FILENO);
-    editorSetStatusMessage(
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    E.pager = pager;
+    if (getenv("KILO_STATS")) atexit(statsDump);
+    editorSelectSyntaxHighlight(filename);
+    long long start = ustime();
+    if (E.pager)
+        pagerOpen(filename);
+    else if (follow)
+        followOpen(filename);
+    else
+        editorOpen(filename);
+    B.open_time = ustime()-start;
+    /* The benchmark runs on all the rows, see editorMapLoad(). */
+    if (E.bench) editorMapFinish();
+    B.load_time = ustime()-start;
+    if (E.pager)
+        editorSetStatusMessage(
+            "HELP: q = quit | Ctrl-F or / = find, n = next | Ctrl-G = goto");
+    else
+        editorSetStatusMessage(
+            "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    /* Before raw mode, since recovering asks on the terminal. */
+    if (!E.pager) journalOpen(!E.bench && isatty(STDIN_FILENO));
+    if (E.bench)
+        benchStart();
+    else
+        enableRawMode(STDIN_FILENO);
     while(1) {
-        editorRefreshScreen();
-        editorProcessKeypress(STDIN_FILENO);
+        editorRunEvents();
+        /* Redraw only when all the input so far was processed. */
+        if (!editorInputPending(STDIN_FILENO)) editorRefreshScreen();
+        if (E.pager)
+            pagerProcessKeypress(STDIN_FILENO);
+        else
+            editorProcessKeypress(STDIN_FILENO);
     }
     return 0;
 }